@@ -8,10 +8,11 @@
       - Files can be opened from "saves/" or absolute/relative paths
       - Key bindings hidden by default; press Ctrl+H to toggle them
 
-    Compile:  gcc -o ced_v4.5 main.c -lncurses
+    Compile:  gcc -o ced_v4.5 main.c -lncurses -lpthread
     Run:      ./ced_v4.5
 */
 
+#define _GNU_SOURCE /* struct ucred for the daemon's SO_PEERCRED check */
 #include <ncurses.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,6 +21,23 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 /* Version updated to v4.5 */
 #define CED_VERSION "v4.5"
@@ -38,8 +56,11 @@ typedef struct Config
 {
     int tab_four_spaces;
     int auto_indent;
+    int autosave_seconds; /* 0 = off */
+    int max_fps;          /* frames per second while input is queued; 0 = draw after every key */
+    int memory_budget_mb; /* 0 = no limit */
 } Config;
-Config config = {1, 1};
+Config config = {1, 1, 0, 60, 0};
 
 char current_file[PROMPT_BUFFER_SIZE] = {0};
 int dirty = 0;
@@ -74,10 +95,18 @@ int syntax_enabled = 0;
 typedef struct
 {
     char *token;
+    int len;
     short color_pair;
 } TokenMap;
 TokenMap *token_lookup = NULL;
 int token_lookup_count = 0;
+/* token_lookup is sorted, so tokens starting with byte c are [token_bucket[c], token_bucket[c + 1]) */
+static int token_bucket[257];
+
+/* Keyword matching in draw_line: scan every token, or only those sharing the first byte */
+#define HIGHLIGHT_LINEAR 0
+#define HIGHLIGHT_INDEXED 1
+static int highlight_strategy = HIGHLIGHT_INDEXED;
 
 typedef struct Editor
 {
@@ -90,9 +119,11 @@ typedef struct Editor
 } Editor;
 Editor editor;
 
+/* Undo/redo snapshots: only the lines in use, packed back to back on the heap */
 typedef struct EditorState
 {
-    char text[MAX_LINES][MAX_COLS];
+    char *text; /* num_lines NUL-terminated lines */
+    size_t text_size;
     int num_lines;
     int cursor_x;
     int cursor_y;
@@ -104,6 +135,28 @@ EditorState undo_stack[UNDO_STACK_SIZE];
 int undo_stack_top = 0;
 EditorState redo_stack[UNDO_STACK_SIZE];
 int redo_stack_top = 0;
+static size_t undo_bytes = 0; /* snapshot text held by both stacks */
+
+/* Keyboard macros */
+#define MACRO_MAX_KEYS 1024
+static int macro_keys[MACRO_MAX_KEYS];
+static int macro_length = 0;
+static int macro_recording = 0;
+static int macro_replaying = 0;
+
+/* Code folding: sorted disjoint folds; lines start+1..end of each are hidden */
+#define MAX_FOLDS 256
+#define FOLD_BIT_TOP 1024 /* power of two >= MAX_LINES */
+typedef struct Fold
+{
+    int start;
+    int end;
+} Fold;
+static Fold folds[MAX_FOLDS];
+static int fold_count = 0;
+static unsigned char fold_hidden[MAX_LINES];
+static int fold_bit[MAX_LINES + 1]; /* Fenwick tree of per-line visibility */
+static int fold_known_lines = 1;
 
 /* Partial redraw tracking */
 static int line_dirty[MAX_LINES];
@@ -117,17 +170,74 @@ void editor_mark_line_dirty(int line)
 void editor_mark_all_lines_dirty(void)
 {
     int i;
+    if (macro_replaying)
+    {
+        /* A replay repaints everything once when it finishes. */
+        return;
+    }
     for (i = 0; i < MAX_LINES; i++)
     {
         line_dirty[i] = 1;
     }
 }
 
+/*
+    Content change tracking: edits report which lines changed (not just which
+    rows need repainting) so per-line indexes can refresh only what changed.
+    'last' == LINES_TO_END means every line from 'first' on may have moved.
+*/
+#define LINES_TO_END -1
+void bracket_index_invalidate(int first, int last);
+void fold_content_changed(int first, int last);
+void completion_index_invalidate(int first, int last);
+void gutter_invalidate(int first, int last);
+void minimap_invalidate(int first, int last);
+void editor_content_changed(int first, int last)
+{
+    gutter_invalidate(first, last);
+    bracket_index_invalidate(first, last);
+    fold_content_changed(first, last);
+    completion_index_invalidate(first, last);
+    minimap_invalidate(first, last);
+}
+
+void fold_unfold_all(void);
+/* The whole buffer was replaced (init, load, undo, redo): folds do not carry over. */
+void editor_buffer_replaced(void)
+{
+    fold_unfold_all();
+    editor_content_changed(0, LINES_TO_END);
+}
+
+/* Terminal size, cached: re-read only when ncurses reports KEY_RESIZE */
+static int screen_rows = 24;
+static int screen_cols = 80;
+
+/* Direct VT backend (--vt): front/back cell grids diffed into one write() per frame */
+static int vt_backend = 0;
+static chtype *vt_front = NULL; /* what the terminal shows; 0 = unknown, always repainted */
+static chtype *vt_back = NULL;  /* the frame being drawn */
+static int vt_rows = 0, vt_cols = 0;
+static int vt_cursor_y = 0, vt_cursor_x = 0;
+static int vt_shown_y = -1, vt_shown_x = -1; /* where the last frame left the cursor */
+static char *vt_out = NULL;
+static size_t vt_out_len = 0, vt_out_cap = 0;
+
 /* Shell Panel */
 static int shell_panel_open = 0;
+#define SHELL_PANEL_HEIGHT 10
 #define SHELL_PANEL_LINES 256
 static char shell_output[SHELL_PANEL_LINES][MAX_COLS];
 static int shell_output_count = 0;
+static pid_t shell_pid = 0;    /* running (or unreaped) command, 0 if none; also its process group */
+static int shell_fd = -1;      /* its output, read as it arrives */
+static int shell_line_len = 0; /* bytes so far in shell_output[shell_output_count] */
+/* Stopped commands not yet reaped: their group got SIGTERM and gets SIGKILL at the deadline */
+#define SHELL_STOPPING_MAX 8
+#define SHELL_KILL_GRACE_MS 2000
+static pid_t shell_stopping_pid[SHELL_STOPPING_MAX];
+static long shell_stopping_deadline[SHELL_STOPPING_MAX]; /* monotonic ms; 0 once SIGKILL was sent */
+static int shell_stopping_count = 0;
 
 /* Search & Replace */
 static char g_searchTerm[128] = {0};
@@ -135,13 +245,375 @@ static int g_searchActive = 0;
 static char search_color_pair_defined = 0;
 #define SEARCH_COLOR_PAIR 200
 
+/* Selection & Clipboard */
+#define SELECTION_NONE 0
+#define SELECTION_STREAM 1
+#define SELECTION_RECT 2
+static int selection_mode = SELECTION_NONE;
+static int selection_anchor_x = 0;
+static int selection_anchor_y = 0;
+typedef struct Clipboard
+{
+    char **lines;
+    int count;
+    int rectangular;
+} Clipboard;
+static Clipboard clipboard = {NULL, 0, 0};
+
+/* Multiple cursors: extra positions kept sorted by (y, x); the primary is editor.cursor_* */
+typedef struct CursorPos
+{
+    int x;
+    int y;
+} CursorPos;
+static CursorPos extra_cursors[MAX_LINES];
+static int extra_cursor_count = 0;
+#define MULTI_INSERT 0
+#define MULTI_BACKSPACE 1
+#define MULTI_DELETE 2
+#define MULTI_MOVE 3
+
+/* Bracket matching: per-kind segment trees of per-line depth summaries */
+#define BRACKET_KINDS 3
+#define BRACKET_TREE_LEAVES 1024 /* power of two >= MAX_LINES */
+typedef struct BracketSummary
+{
+    int net;
+    int min_prefix;
+    int min_suffix;
+} BracketSummary;
+static BracketSummary bracket_tree[BRACKET_KINDS][2 * BRACKET_TREE_LEAVES];
+static unsigned char bracket_leaf_stale[MAX_LINES];
+static int bracket_stale_from = 0;
+static int bracket_hl_y = -1, bracket_hl_x = -1;
+static int bracket_match_y = -1, bracket_match_x = -1;
+
+/* Word completion: identifier trie plus the words each line contributed */
+#define COMPLETION_MIN_WORD 2
+#define COMPLETION_MAX_WORD 64
+#define COMPLETION_MAX_CANDIDATES 32
+typedef struct CompletionNode
+{
+    int child;
+    int sibling;
+    int count;
+    char ch;
+} CompletionNode;
+typedef struct CompletionCandidate
+{
+    char word[COMPLETION_MAX_WORD];
+    int count;
+} CompletionCandidate;
+static CompletionNode *completion_nodes = NULL;
+static int completion_node_count = 0;
+static int completion_node_cap = 0;
+static char *completion_line_words[MAX_LINES];
+static size_t completion_word_bytes = 0; /* held by completion_line_words */
+static unsigned char completion_line_stale[MAX_LINES];
+static int completion_stale_from = 0;
+static CompletionCandidate completion_candidates[COMPLETION_MAX_CANDIDATES];
+static int completion_candidate_count = 0;
+static int completion_index = 0;
+static int completion_prefix_len = 0;
+static int completion_inserted_len = 0;
+static int completion_cycling = 0;
+
+/* Tags: sorted offsets into a ctags-format blob (mmap'd file or scanner output) */
+#define TAGS_NONE 0
+#define TAGS_BUILDING 1
+#define TAGS_READY 2
+static char *tags_data = NULL;
+static size_t tags_size = 0;
+static int tags_mapped = 0;
+static size_t *tags_offsets = NULL;
+static int tags_count = 0;
+static int tags_state = TAGS_NONE;
+static pthread_t tags_thread;
+static pthread_mutex_t tags_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Change gutter: per-line hashes diffed against the baseline on a worker thread */
+static unsigned long gutter_line_hash[MAX_LINES];
+static unsigned char gutter_line_stale[MAX_LINES];
+static int gutter_stale_from = 0;
+static int gutter_buffer_changed = 1;
+static int gutter_baseline_changed = 1;
+static char gutter_marks[MAX_LINES]; /* what the screen shows: 0, '+', '~' or '-' */
+static int gutter_started = 0;
+static int gutter_shown_gen = 0;
+static pthread_t gutter_thread;
+static pthread_mutex_t gutter_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gutter_cond = PTHREAD_COND_INITIALIZER;
+/* Shared with the worker under gutter_lock */
+static unsigned long gutter_request_hashes[MAX_LINES];
+static int gutter_request_count = 0;
+static char gutter_request_path[PROMPT_BUFFER_SIZE];
+static int gutter_reload_baseline = 0;
+static int gutter_request_gen = 0;
+static int gutter_done_gen = 0;
+static int gutter_result_gen = 0;
+static char gutter_result[MAX_LINES];
+
+/* Overview ruler: per-line search-match counts and change marks summed per block of lines */
+#define MINIMAP_BLOCK_LINES 32
+#define MINIMAP_BLOCKS ((MAX_LINES + MINIMAP_BLOCK_LINES - 1) / MINIMAP_BLOCK_LINES)
+static int minimap_visible = 0;
+static int minimap_line_matches[MAX_LINES];
+static unsigned char minimap_line_stale[MAX_LINES];
+static int minimap_stale_from = 0;
+static int minimap_counted_lines = 0;
+static int minimap_block_matches[MINIMAP_BLOCKS];
+static int minimap_block_changes[MINIMAP_BLOCKS]; /* kept in step with gutter_marks by gutter_poll() */
+static char minimap_term[128] = {0};
+
+/* Session: per-directory binary file of recently edited files and view state, kept under the XDG state dir */
+#define SESSION_DIR "ced/sessions"
+#define SESSION_MAGIC 0x53444543u /* "CEDS" */
+#define SESSION_VERSION 1
+#define SESSION_MAX_FILES 32
+typedef struct SessionHeader
+{
+    unsigned int magic;
+    unsigned int version;
+    int file_count;      /* SessionFile records follow the header, most recent first */
+    int shell_count;     /* then shell_bytes of NUL-terminated shell panel lines */
+    int shell_bytes;
+    int shell_panel_open;
+    int show_line_numbers;
+    int minimap_visible;
+    int search_active;
+    char search_term[128];
+} SessionHeader;
+typedef struct SessionFile
+{
+    char path[PROMPT_BUFFER_SIZE];
+    int cursor_x;
+    int cursor_y;
+    int row_offset;
+    int col_offset;
+} SessionFile;
+static char *session_map_data = NULL; /* the session file as found at startup, mmap'd read-only */
+static SessionFile session_visited[SESSION_MAX_FILES]; /* files left during this run, most recent first */
+static int session_visited_count = 0;
+
+/* Autosave: monotonic time of the last key, pushed back by every keystroke */
+static long autosave_last_input = 0;
+
+/* Render scheduler: full frames, or cursor line + status bar only while keys are queued */
+#define FRAME_FULL 0
+#define FRAME_PRIORITY 1
+static long render_last_frame = 0;
+static int render_deferred = 0;  /* a background repaint is waiting for the next frame slot */
+static int render_after_key = 0; /* a key was handled since the last full frame */
+
+/* Event loop: descriptors polled next to the tty, and the wake-up pipe for worker threads */
+#define EVENT_MAX_WATCHES 8
+typedef void (*EventHandler)(int fd);
+typedef struct EventWatch
+{
+    int fd;
+    EventHandler handler;
+} EventWatch;
+static EventWatch event_watches[EVENT_MAX_WATCHES];
+static int event_watch_count = 0;
+static int event_wake_pipe[2] = {-1, -1};
+
+/* File watch: inotify on the current file's directory (Linux) */
+static int watch_fd = -1;
+static int watch_wd = -1;
+static char watch_name[PROMPT_BUFFER_SIZE];
+static struct stat watch_known;
+
+/* Memory budget: what enforcement has evicted so far, for the F11 report */
+static int mem_evicted_caches = 0;
+static int mem_evicted_snapshots = 0;
+
+/* Daemon file cache: contents of files the daemon keeps warm for its sessions */
+typedef struct DaemonFile
+{
+    char path[PATH_MAX];
+    char *data;
+    size_t size;
+    struct stat st; /* as read; any change of inode, size, mtime or ctime means a reread */
+} DaemonFile;
+static DaemonFile *daemon_files = NULL;
+static int daemon_file_count = 0;
+
+/* Key traces (-DCED_REPLAY): --record logs every input event with its time, --replay feeds them back headless */
+#ifdef CED_REPLAY
+#define TRACE_MAGIC "ced-trace"
+#define TRACE_VERSION 1
+typedef struct TraceEvent
+{
+    long ms;    /* since the recording started */
+    char kind;  /* K key, D key handled (a = us), M mouse, P prompt answer, R resize, Q quit */
+    int a, b;   /* K: key; M: x, y; R: rows, cols */
+    unsigned long c; /* M: button state; Q: buffer hash */
+    char *text; /* P */
+} TraceEvent;
+static FILE *trace_out = NULL;
+static long trace_start = 0;
+static int trace_replaying = 0;
+static TraceEvent *trace_events = NULL;
+static int trace_event_count = 0;
+static int trace_next = 0;
+static int trace_desyncs = 0; /* replayed handlers that wanted a different event than the trace had */
+static long trace_prompt_us = 0; /* time spent waiting for prompt answers, not counted as handling */
+#else
+#define trace_replaying 0
+#endif
+
+/*
+    Profiler (-DCED_PROFILE): scoped timers summed per call path, written as folded stacks on exit
+    (CED_PROFILE=file), and with -DCED_TRACE also logged as begin/end events per thread, written as a
+    Chrome trace on exit (CED_TRACE=file)
+*/
+#if defined(CED_TRACE) && !defined(CED_PROFILE)
+#define CED_PROFILE /* the trace records the profiler's timers */
+#endif
+#ifdef CED_PROFILE
+#define PROF_KEYPRESS 0
+#define PROF_UNDO 1
+#define PROF_REFRESH 2
+#define PROF_DRAW_LINE 3
+#define PROF_LOAD 4
+#define PROF_SAVE 5
+#define PROF_SHELL_RUN 6
+#define PROF_SHELL_READ 7
+#define PROF_PROMPT 8
+#define PROF_GUTTER 9
+#define PROF_TAGS_SCAN 10
+#define PROF_KINDS 11
+#define PROF_MAX_NODES 256
+#define PROF_MAX_DEPTH 16
+static const char *const prof_names[PROF_KINDS] = {"process_keypress", "save_state_undo", "editor_refresh_screen",
+                                                   "draw_line", "load_file", "save_file", "shell_run", "shell_read",
+                                                   "prompt_wait", "gutter_diff", "tags_scan"};
+typedef struct ProfNode
+{
+    int parent; /* -1: called from the top level */
+    int kind;
+    long us; /* time inside, callees included */
+} ProfNode;
+static int prof_on = 0; /* either output is wanted */
+static char *prof_path = NULL;
+static pid_t prof_pid = 0;
+static pthread_t prof_thread; /* the call-path tree is only kept for the main thread */
+static ProfNode prof_nodes[PROF_MAX_NODES];
+static int prof_node_count = 0;
+static int prof_stack[PROF_MAX_DEPTH]; /* open timers: node index, or -1 when the tree is full */
+static int prof_stack_kind[PROF_MAX_DEPTH];
+static long prof_started[PROF_MAX_DEPTH];
+static int prof_depth = 0;
+#ifdef CED_TRACE
+/* Trace events: each thread appends to its own buffer, whose lock only the dump contends for */
+#define CTRACE_MAX_THREADS 8
+#define CTRACE_EVENTS 65536
+typedef struct CTraceEvent
+{
+    long us;
+    int kind;
+    char phase; /* 'B' or 'E' */
+} CTraceEvent;
+typedef struct CTraceBuffer
+{
+    pthread_mutex_t lock; /* guards name, count and dropped */
+    char name[32];
+    CTraceEvent *events;
+    int count;
+    int dropped;
+} CTraceBuffer;
+static char *ctrace_path = NULL;
+static long ctrace_start = 0;
+static CTraceBuffer ctrace_buffers[CTRACE_MAX_THREADS];
+static int ctrace_thread_count = 0;
+static pthread_key_t ctrace_key;
+static pthread_mutex_t ctrace_lock = PTHREAD_MUTEX_INITIALIZER; /* guards registration */
+#else
+#define prof_thread_name(name) ((void)0)
+#endif
+#define PROF_BEGIN(kind)       \
+    do                         \
+    {                          \
+        if (prof_on)           \
+        {                      \
+            prof_begin(kind);  \
+        }                      \
+    } while (0)
+#define PROF_END(kind)         \
+    do                         \
+    {                          \
+        if (prof_on)           \
+        {                      \
+            prof_end(kind);    \
+        }                      \
+    } while (0)
+#else
+#define PROF_BEGIN(kind) ((void)0)
+#define PROF_END(kind) ((void)0)
+#define prof_thread_name(name) ((void)0)
+#define prof_dump() ((void)0)
+#define prof_init() ((void)0)
+#endif
+
 /* Toggle help display in status bar */
 static int show_help = 0;
 
+/* Status messages: queued, shown in the status bar and expire on their own */
+#define STATUS_QUEUE_SIZE 8
+#define STATUS_MESSAGE_SECONDS 3
+typedef struct StatusMessage
+{
+    char text[256];
+    long expires; /* monotonic ms; 0 until the message reaches the front of the queue */
+} StatusMessage;
+static StatusMessage status_queue[STATUS_QUEUE_SIZE];
+static int status_head = 0;
+static int status_count = 0;
+
+/* Batch mode: no ncurses, messages go to stderr */
+static int batch_mode = 0;
+
+/* Set by editor_load_stream when the file had more than MAX_LINES lines or a line of MAX_COLS or more */
+static int load_truncated = 0;
+
 /* Forward declarations */
+void mem_enforce_budget(void);
 static void editor_prompt(char *prompt, char *buffer, size_t bufsize);
+static int extra_cursor_at(int y, int x);
+int bracket_find_match(int y, int x, int *my, int *mx);
+void editor_process_key(int ch);
+void editor_load_stream(FILE *fp, const char *filepath);
+static int editor_interactive(const char *path, FILE *src);
+static int autosave_wait_ms(void);
+void event_watch_fd(int fd, void (*handler)(int fd));
+void event_unwatch_fd(int fd);
+void event_wake(void);
+void file_watch_update(void);
+void file_watch_note(void);
 
 /* ---------- Helper ---------- */
+static long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long)ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+#if defined(CED_REPLAY) || defined(CED_PROFILE) || defined(CED_BENCH)
+/* Microseconds since the first call, so a 32-bit long lasts over half an hour. */
+static long monotonic_us(void)
+{
+    static struct timespec base;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (base.tv_sec == 0 && base.tv_nsec == 0)
+    {
+        base = ts;
+    }
+    return (long)(ts.tv_sec - base.tv_sec) * 1000000L + (ts.tv_nsec - base.tv_nsec) / 1000L;
+}
+#endif
+
 static char *trim_whitespace(char *str)
 {
     char *end;
@@ -162,6 +634,348 @@ static char *trim_whitespace(char *str)
     return str;
 }
 
+/* ---------- Profiler ---------- */
+#ifdef CED_PROFILE
+/*
+    Folded stacks (CED_PROFILE): the call-path tree is only kept for the
+    main thread. Each (caller path, timer) pair gets a node the first time
+    it is seen, so a timer costs two clock reads and a short scan of the
+    caller's children. The dump gives each node's self time (its time minus
+    its callees') in microseconds, one "ced;outer;inner N" line per node:
+    the folded format flamegraph.pl and speedscope read.
+
+    Chrome trace (CED_TRACE): every thread, workers included, appends B/E
+    events to a buffer only it writes, so its lock is only contended while
+    the dump reads it; when a buffer is full further events are counted as
+    dropped.
+*/
+#ifdef CED_TRACE
+/* The calling thread's trace buffer, registered on first use; NULL once all slots are taken. */
+static CTraceBuffer *ctrace_buffer(void)
+{
+    CTraceBuffer *buf = (CTraceBuffer *)pthread_getspecific(ctrace_key);
+    if (buf)
+    {
+        return buf;
+    }
+    pthread_mutex_lock(&ctrace_lock);
+    if (ctrace_thread_count < CTRACE_MAX_THREADS)
+    {
+        buf = &ctrace_buffers[ctrace_thread_count];
+        buf->events = (CTraceEvent *)malloc(sizeof(CTraceEvent) * CTRACE_EVENTS);
+        if (buf->events)
+        {
+            pthread_mutex_init(&buf->lock, NULL);
+            snprintf(buf->name, sizeof(buf->name), "thread %d", ctrace_thread_count);
+            ctrace_thread_count++;
+            pthread_setspecific(ctrace_key, buf);
+        }
+        else
+        {
+            buf = NULL;
+        }
+    }
+    pthread_mutex_unlock(&ctrace_lock);
+    return buf;
+}
+
+static void ctrace_event(char phase, int kind)
+{
+    CTraceBuffer *buf = ctrace_buffer();
+    long now = monotonic_us();
+    if (!buf)
+    {
+        return;
+    }
+    pthread_mutex_lock(&buf->lock);
+    if (buf->count == CTRACE_EVENTS)
+    {
+        buf->dropped++;
+    }
+    else
+    {
+        CTraceEvent *ev = &buf->events[buf->count++];
+        ev->us = now;
+        ev->kind = kind;
+        ev->phase = phase;
+    }
+    pthread_mutex_unlock(&buf->lock);
+}
+
+/* Labels the calling thread in the trace. */
+static void prof_thread_name(const char *name)
+{
+    CTraceBuffer *buf;
+    if (ctrace_path && (buf = ctrace_buffer()) != NULL)
+    {
+        pthread_mutex_lock(&buf->lock);
+        snprintf(buf->name, sizeof(buf->name), "%s", name);
+        pthread_mutex_unlock(&buf->lock);
+    }
+}
+#endif
+
+static void prof_begin(int kind)
+{
+    int parent, node = -1, i;
+#ifdef CED_TRACE
+    if (ctrace_path)
+    {
+        ctrace_event('B', kind);
+    }
+#endif
+    if (!prof_path || !pthread_equal(pthread_self(), prof_thread) || prof_depth == PROF_MAX_DEPTH)
+    {
+        return;
+    }
+    /* The call-path state is the main thread's; workers have returned above. */
+    parent = prof_depth > 0 ? prof_stack[prof_depth - 1] : -1;
+    if (prof_depth == 0 || parent >= 0)
+    {
+        for (i = 0; i < prof_node_count; i++)
+        {
+            if (prof_nodes[i].parent == parent && prof_nodes[i].kind == kind)
+            {
+                node = i;
+                break;
+            }
+        }
+        if (node < 0 && prof_node_count < PROF_MAX_NODES)
+        {
+            node = prof_node_count++;
+            prof_nodes[node].parent = parent;
+            prof_nodes[node].kind = kind;
+            prof_nodes[node].us = 0;
+        }
+    }
+    prof_stack[prof_depth] = node;
+    prof_stack_kind[prof_depth] = kind;
+    prof_started[prof_depth] = monotonic_us();
+    prof_depth++;
+}
+
+/* Closes the innermost open 'kind' timer (and any left open inside it). */
+static void prof_end(int kind)
+{
+    long now = monotonic_us();
+    int i;
+#ifdef CED_TRACE
+    if (ctrace_path)
+    {
+        ctrace_event('E', kind);
+    }
+#endif
+    if (!prof_path || !pthread_equal(pthread_self(), prof_thread))
+    {
+        return;
+    }
+    for (i = prof_depth - 1; i >= 0 && prof_stack_kind[i] != kind; i--)
+    {
+    }
+    if (i < 0)
+    {
+        return;
+    }
+    if (prof_stack[i] >= 0)
+    {
+        prof_nodes[prof_stack[i]].us += now - prof_started[i];
+    }
+    prof_depth = i;
+}
+
+/* Forked workers and daemon sessions write beside the main file instead of over it. */
+static FILE *prof_open_output(const char *base)
+{
+    char path[PATH_MAX];
+    if (getpid() == prof_pid)
+    {
+        snprintf(path, sizeof(path), "%s", base);
+    }
+    else
+    {
+        snprintf(path, sizeof(path), "%s.%d", base, (int)getpid());
+    }
+    return fopen(path, "w");
+}
+
+#ifdef CED_TRACE
+/*
+    Chrome trace JSON (chrome://tracing, Perfetto): a thread_name record per
+    thread, then its B/E events with microsecond timestamps. Worker threads
+    may still be appending; each buffer's count is read under its lock, so
+    only events written before then are read.
+*/
+static void ctrace_dump(void)
+{
+    FILE *fp;
+    int t, i, threads, dropped = 0, first = 1;
+    if (!ctrace_path || (fp = prof_open_output(ctrace_path)) == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&ctrace_lock);
+    threads = ctrace_thread_count;
+    pthread_mutex_unlock(&ctrace_lock);
+    fputs("{\"traceEvents\":[\n", fp);
+    for (t = 0; t < threads; t++)
+    {
+        CTraceBuffer *buf = &ctrace_buffers[t];
+        char name[sizeof(buf->name)];
+        int count;
+        pthread_mutex_lock(&buf->lock);
+        count = buf->count;
+        dropped += buf->dropped;
+        memcpy(name, buf->name, sizeof(name));
+        pthread_mutex_unlock(&buf->lock);
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", (int)getpid(), t, name);
+        first = 0;
+        for (i = 0; i < count; i++)
+        {
+            const CTraceEvent *ev = &buf->events[i];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%ld,\"pid\":%d,\"tid\":%d}",
+                    prof_names[ev->kind], ev->phase, ev->us - ctrace_start, (int)getpid(), t);
+        }
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":%d}}\n", dropped);
+    fclose(fp);
+}
+#endif
+
+static void prof_dump(void)
+{
+    long self[PROF_MAX_NODES];
+    FILE *fp;
+    int i;
+#ifdef CED_TRACE
+    ctrace_dump();
+#endif
+    if (!prof_path || (fp = prof_open_output(prof_path)) == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < prof_node_count; i++)
+    {
+        self[i] = prof_nodes[i].us;
+    }
+    for (i = 0; i < prof_node_count; i++)
+    {
+        if (prof_nodes[i].parent >= 0)
+        {
+            self[prof_nodes[i].parent] -= prof_nodes[i].us;
+        }
+    }
+    for (i = 0; i < prof_node_count; i++)
+    {
+        int chain[PROF_MAX_DEPTH], depth = 0, n;
+        if (self[i] <= 0)
+        {
+            continue;
+        }
+        for (n = i; n >= 0 && depth < PROF_MAX_DEPTH; n = prof_nodes[n].parent)
+        {
+            chain[depth++] = n;
+        }
+        fputs("ced", fp);
+        while (depth > 0)
+        {
+            fprintf(fp, ";%s", prof_names[prof_nodes[chain[--depth]].kind]);
+        }
+        fprintf(fp, " %ld\n", self[i]);
+    }
+    fclose(fp);
+}
+
+#ifndef CED_FUZZ /* profiling is set up from main() only */
+static char *prof_env_path(const char *var)
+{
+    const char *value = getenv(var);
+    char *copy;
+    if (!value || !value[0])
+    {
+        return NULL;
+    }
+    copy = (char *)malloc(strlen(value) + 1);
+    strcpy(copy, value);
+    return copy;
+}
+
+/* CED_PROFILE=file and CED_TRACE=file turn the timers on; both are written when the process exits. */
+static void prof_init(void)
+{
+    prof_path = prof_env_path("CED_PROFILE");
+    prof_on = prof_path != NULL;
+#ifdef CED_TRACE
+    ctrace_path = prof_env_path("CED_TRACE");
+    if (ctrace_path)
+    {
+        prof_on = 1;
+        ctrace_start = monotonic_us();
+        pthread_key_create(&ctrace_key, NULL);
+        prof_thread_name("main");
+    }
+#endif
+    if (!prof_on)
+    {
+        return;
+    }
+    prof_pid = getpid();
+    prof_thread = pthread_self();
+    atexit(prof_dump);
+}
+#endif
+#endif
+
+/* ---------- Status Messages ---------- */
+void editor_set_status_message(const char *fmt, ...)
+{
+    StatusMessage *msg;
+    va_list ap;
+    if (batch_mode)
+    {
+        fprintf(stderr, current_file[0] ? "ced: %s: " : "ced: ", current_file);
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        fputc('\n', stderr);
+        return;
+    }
+    if (status_count == STATUS_QUEUE_SIZE)
+    {
+        /* Queue full: drop the oldest message rather than block. */
+        status_head = (status_head + 1) % STATUS_QUEUE_SIZE;
+        status_count--;
+        status_queue[status_head].expires = 0;
+    }
+    msg = &status_queue[(status_head + status_count) % STATUS_QUEUE_SIZE];
+    va_start(ap, fmt);
+    vsnprintf(msg->text, sizeof(msg->text), fmt, ap);
+    va_end(ap);
+    msg->expires = 0;
+    status_count++;
+}
+
+/* Returns the message to show now (or NULL), retiring expired ones. */
+static const char *editor_current_status_message(void)
+{
+    long now = monotonic_ms();
+    while (status_count > 0)
+    {
+        StatusMessage *msg = &status_queue[status_head];
+        if (msg->expires == 0)
+        {
+            msg->expires = now + STATUS_MESSAGE_SECONDS * 1000L;
+        }
+        if (now < msg->expires)
+        {
+            return msg->text;
+        }
+        status_head = (status_head + 1) % STATUS_QUEUE_SIZE;
+        status_count--;
+    }
+    return NULL;
+}
+
 /* ---------- Word-Boundary Helpers for Syntax ---------- */
 static int is_word_char(char c)
 {
@@ -217,6 +1031,18 @@ void load_config(void)
                 {
                     config.auto_indent = (!strcasecmp(tvalue, "true"));
                 }
+                else if (!strcmp(tkey, "AUTOSAVE"))
+                {
+                    config.autosave_seconds = atoi(tvalue);
+                }
+                else if (!strcmp(tkey, "MAX_FPS"))
+                {
+                    config.max_fps = atoi(tvalue);
+                }
+                else if (!strcmp(tkey, "MEMORY_BUDGET"))
+                {
+                    config.memory_budget_mb = atoi(tvalue);
+                }
             }
         }
     }
@@ -233,50 +1059,125 @@ void init_editor(void)
     editor.row_offset = 0;
     editor.col_offset = 0;
     editor_mark_all_lines_dirty();
+    editor_buffer_replaced();
 }
 
 /* ---------- Undo/Redo ---------- */
-void save_state_undo(void)
+/* Packs the lines in use and the view into 'st'; returns 0 if out of memory. */
+static int undo_capture(EditorState *st)
+{
+    size_t size = 0, pos = 0;
+    int i;
+    for (i = 0; i < editor.num_lines; i++)
+    {
+        size += strlen(editor.text[i]) + 1;
+    }
+    st->text = (char *)malloc(size ? size : 1);
+    if (!st->text)
+    {
+        return 0;
+    }
+    for (i = 0; i < editor.num_lines; i++)
+    {
+        size_t len = strlen(editor.text[i]) + 1;
+        memcpy(st->text + pos, editor.text[i], len);
+        pos += len;
+    }
+    st->text_size = size;
+    st->num_lines = editor.num_lines;
+    st->cursor_x = editor.cursor_x;
+    st->cursor_y = editor.cursor_y;
+    st->row_offset = editor.row_offset;
+    st->col_offset = editor.col_offset;
+    return 1;
+}
+
+/* Unpacks 'st' into the buffer and releases its text. */
+static void undo_restore(EditorState *st)
+{
+    const char *p = st->text;
+    int i;
+    memset(editor.text, 0, sizeof(editor.text));
+    for (i = 0; i < st->num_lines; i++)
+    {
+        size_t len = strlen(p) + 1;
+        memcpy(editor.text[i], p, len);
+        p += len;
+    }
+    editor.num_lines = st->num_lines;
+    editor.cursor_x = st->cursor_x;
+    editor.cursor_y = st->cursor_y;
+    editor.row_offset = st->row_offset;
+    editor.col_offset = st->col_offset;
+    undo_bytes -= st->text_size;
+    free(st->text);
+    st->text = NULL;
+}
+
+/* Drops the oldest 'n' entries of a stack. */
+static void undo_drop_oldest(EditorState *stack, int *top, int n)
+{
+    int i;
+    if (n > *top)
+    {
+        n = *top;
+    }
+    for (i = 0; i < n; i++)
+    {
+        undo_bytes -= stack[i].text_size;
+        free(stack[i].text);
+    }
+    memmove(stack, stack + n, sizeof(EditorState) * (*top - n));
+    *top -= n;
+}
+
+/* Pushes the current buffer onto a stack, making room by dropping its oldest entry. */
+static void undo_push_current(EditorState *stack, int *top)
 {
     EditorState st;
-    if (undo_stack_top < UNDO_STACK_SIZE)
+    if (!undo_capture(&st))
+    {
+        return;
+    }
+    if (*top == UNDO_STACK_SIZE)
+    {
+        undo_drop_oldest(stack, top, 1);
+    }
+    undo_bytes += st.text_size;
+    stack[(*top)++] = st;
+}
+
+void save_state_undo(void)
+{
+    if (macro_replaying)
     {
-        memcpy(st.text, editor.text, sizeof(editor.text));
-        st.num_lines = editor.num_lines;
-        st.cursor_x = editor.cursor_x;
-        st.cursor_y = editor.cursor_y;
-        st.row_offset = editor.row_offset;
-        st.col_offset = editor.col_offset;
-        undo_stack[undo_stack_top++] = st;
+        /* The replay as a whole was already snapshotted once. */
+        return;
+    }
+    if (batch_mode)
+    {
+        /* Batch scripts have no undo. */
+        dirty = 1;
+        return;
     }
-    redo_stack_top = 0;
+    PROF_BEGIN(PROF_UNDO);
+    undo_push_current(undo_stack, &undo_stack_top);
+    undo_drop_oldest(redo_stack, &redo_stack_top, redo_stack_top);
     dirty = 1;
+    mem_enforce_budget();
+    PROF_END(PROF_UNDO);
 }
 
 void undo(void)
 {
     if (undo_stack_top > 0)
     {
-        EditorState st = undo_stack[--undo_stack_top];
-        if (redo_stack_top < UNDO_STACK_SIZE)
-        {
-            EditorState cur;
-            memcpy(cur.text, editor.text, sizeof(editor.text));
-            cur.num_lines = editor.num_lines;
-            cur.cursor_x = editor.cursor_x;
-            cur.cursor_y = editor.cursor_y;
-            cur.row_offset = editor.row_offset;
-            cur.col_offset = editor.col_offset;
-            redo_stack[redo_stack_top++] = cur;
-        }
-        memcpy(editor.text, st.text, sizeof(editor.text));
-        editor.num_lines = st.num_lines;
-        editor.cursor_x = st.cursor_x;
-        editor.cursor_y = st.cursor_y;
-        editor.row_offset = st.row_offset;
-        editor.col_offset = st.col_offset;
+        undo_push_current(redo_stack, &redo_stack_top);
+        undo_restore(&undo_stack[--undo_stack_top]);
         dirty = 1;
         editor_mark_all_lines_dirty();
+        editor_buffer_replaced();
+        mem_enforce_budget();
     }
 }
 
@@ -284,1338 +1185,7214 @@ void redo(void)
 {
     if (redo_stack_top > 0)
     {
-        EditorState st = redo_stack[--redo_stack_top];
-        if (undo_stack_top < UNDO_STACK_SIZE)
-        {
-            EditorState cur;
-            memcpy(cur.text, editor.text, sizeof(editor.text));
-            cur.num_lines = editor.num_lines;
-            cur.cursor_x = editor.cursor_x;
-            cur.cursor_y = editor.cursor_y;
-            cur.row_offset = editor.row_offset;
-            cur.col_offset = editor.col_offset;
-            undo_stack[undo_stack_top++] = cur;
-        }
-        memcpy(editor.text, st.text, sizeof(editor.text));
-        editor.num_lines = st.num_lines;
-        editor.cursor_x = st.cursor_x;
-        editor.cursor_y = st.cursor_y;
-        editor.row_offset = st.row_offset;
-        editor.col_offset = st.col_offset;
+        undo_push_current(undo_stack, &undo_stack_top);
+        undo_restore(&redo_stack[--redo_stack_top]);
         dirty = 1;
         editor_mark_all_lines_dirty();
+        editor_buffer_replaced();
+        mem_enforce_budget();
     }
 }
 
-/* ---------- Viewport ---------- */
-void update_viewport(void)
-{
-    int rows, cols;
-    getmaxyx(stdscr, rows, cols);
-
-    int shell_panel_height = shell_panel_open ? 10 : 0;
-    if (editor.cursor_y < editor.row_offset)
-    {
-        editor.row_offset = editor.cursor_y;
-        editor_mark_all_lines_dirty();
-    }
-    else if (editor.cursor_y >= editor.row_offset + (rows - 1 - shell_panel_height))
+/* ---------- Code Folding ---------- */
+/*
+    Folds are kept as a sorted array of disjoint intervals (binary searched),
+    and a Fenwick tree over per-line visibility maps buffer lines to screen
+    ranks and back in O(log n), so scrolling cost does not depend on how much
+    text is folded away.
+*/
+static void fold_bit_add(int line, int delta)
+{
+    int i;
+    for (i = line + 1; i <= MAX_LINES; i += i & -i)
     {
-        editor.row_offset = editor.cursor_y - ((rows - 1 - shell_panel_height) - 1);
-        editor_mark_all_lines_dirty();
+        fold_bit[i] += delta;
     }
+}
+
+/* Number of visible lines before 'line'. */
+static int fold_rank(int line)
+{
+    int i, sum = 0;
+    for (i = line; i > 0; i -= i & -i)
     {
-        int usable = cols - (show_line_numbers ? LINE_NUMBER_WIDTH : 0);
-        if (editor.cursor_x < editor.col_offset)
-        {
-            editor.col_offset = editor.cursor_x;
-            editor_mark_all_lines_dirty();
-        }
-        else if (editor.cursor_x >= editor.col_offset + usable)
-        {
-            editor.col_offset = editor.cursor_x - usable + 1;
-            editor_mark_all_lines_dirty();
-        }
+        sum += fold_bit[i];
     }
+    return sum;
 }
 
-/* ---------- Syntax ---------- */
-typedef struct SH_SyntaxDefinition SH_SyntaxDefinition;
-typedef struct SH_SyntaxDefinitions SH_SyntaxDefinitions;
-
-static int sh_count_tokens(const char *line)
+/* The visible line with the given rank (0-based). */
+static int fold_line_at_rank(int rank)
 {
-    int count = 0;
-    const char *p = line;
-    while ((p = strchr(p, '\"')) != NULL)
+    int pos = 0, step;
+    for (step = FOLD_BIT_TOP; step > 0; step >>= 1)
     {
-        p++;
+        if (pos + step <= MAX_LINES && fold_bit[pos + step] <= rank)
         {
-            char *end_quote = (char *)strchr(p, '\"');
-            if (!end_quote)
-            {
-                break;
-            }
+            pos += step;
+            rank -= fold_bit[pos];
         }
-        count++;
-        p++;
     }
-    return count;
+    return pos;
 }
 
-static int sh_parse_rule_line(char *line, SH_SyntaxRule *rule)
+static void fold_rebuild_index(void)
 {
-    rule->tokens = NULL;
-    rule->token_count = 0;
-    rule->r = rule->g = rule->b = 0;
+    int i, f;
+    memset(fold_hidden, 0, sizeof(fold_hidden));
+    for (f = 0; f < fold_count; f++)
     {
-        int count = sh_count_tokens(line);
-        if (count > 0)
+        for (i = folds[f].start + 1; i <= folds[f].end; i++)
         {
-            rule->tokens = (char **)malloc(sizeof(char *) * count);
-            rule->token_count = count;
-            {
-                int idx = 0;
-                char *p = line;
-                while ((p = strchr(p, '\"')) != NULL && idx < count)
-                {
-                    char *end_quote;
-                    p++;
-                    end_quote = strchr(p, '\"');
-                    if (!end_quote)
-                    {
-                        break;
-                    }
-                    {
-                        int len = (int)(end_quote - p);
-                        rule->tokens[idx] = (char *)malloc(len + 1);
-                        strncpy(rule->tokens[idx], p, len);
-                        rule->tokens[idx][len] = '\0';
-                    }
-                    idx++;
-                    p = end_quote + 1;
-                }
-            }
+            fold_hidden[i] = 1;
         }
     }
+    /* Linear-time Fenwick build. */
+    for (i = 1; i <= MAX_LINES; i++)
     {
-        char *eq = strchr(line, '=');
-        if (!eq)
-        {
-            return -1;
-        }
+        fold_bit[i] = !fold_hidden[i - 1];
+    }
+    for (i = 1; i <= MAX_LINES; i++)
+    {
+        int parent = i + (i & -i);
+        if (parent <= MAX_LINES)
         {
-            char *paren = strchr(eq, '(');
-            if (!paren)
-            {
-                return -1;
-            }
-            {
-                int r, g, b;
-                if ((sscanf(paren, " ( %d , %d , %d )", &r, &g, &b) < 3) &&
-                    (sscanf(paren, " (%d,%d,%d)", &r, &g, &b) < 3))
-                {
-                    return -1;
-                }
-                rule->r = r;
-                rule->g = g;
-                rule->b = b;
-            }
+            fold_bit[parent] += fold_bit[i];
         }
     }
-    return 0;
 }
 
-static SH_SyntaxDefinitions sh_load_syntax_definitions(const char *filename)
+/* Index of the fold whose interval [start, end] contains 'line', or -1. */
+static int fold_find(int line)
 {
-    SH_SyntaxDefinitions defs;
-    defs.definitions = NULL;
-    defs.count = 0;
+    int lo = 0, hi = fold_count - 1;
+    while (lo <= hi)
     {
-        FILE *fp = fopen(filename, "r");
-        if (!fp)
+        int mid = (lo + hi) / 2;
+        if (line < folds[mid].start)
         {
-            return defs;
+            hi = mid - 1;
         }
+        else if (line > folds[mid].end)
         {
-            char line[SH_MAX_LINE_LENGTH];
-            while (fgets(line, sizeof(line), fp))
-            {
-                char *trimmed = trim_whitespace(line);
-                if (!strncmp(trimmed, "SYNTAX", 6))
-                {
-                    SH_SyntaxDefinition def;
-                    def.extensions = NULL;
-                    def.ext_count = 0;
-                    def.rules = NULL;
-                    def.rule_count = 0;
-                    {
-                        char *p = trimmed + 6;
-                        while (*p)
-                        {
-                            if (*p == '\"')
-                            {
-                                p++;
-                                char *end = strchr(p, '\"');
-                                if (!end)
-                                {
-                                    break;
-                                }
-                                {
-                                    int ext_len = (int)(end - p);
-                                    if (ext_len > 0)
-                                    {
-                                        char *ext = (char *)malloc(ext_len + 1);
-                                        strncpy(ext, p, ext_len);
-                                        ext[ext_len] = '\0';
-                                        def.extensions = (char **)realloc(def.extensions, sizeof(char *) * (def.ext_count + 1));
-                                        def.extensions[def.ext_count++] = ext;
-                                    }
-                                }
-                                p = end + 1;
-                            }
-                            else
-                            {
-                                p++;
-                            }
-                        }
-                    }
-                    {
-                        if (!fgets(line, sizeof(line), fp))
-                        {
-                            break;
-                        }
-                        trimmed = trim_whitespace(line);
-                        if (trimmed[0] != '{')
-                        {
-                            continue;
-                        }
-                    }
-                    while (1)
-                    {
-                        char rulebuf[4 * SH_MAX_LINE_LENGTH];
-                        rulebuf[0] = '\0';
-                        {
-                            int done = 0, have_semicolon = 0;
-                            while (!have_semicolon)
-                            {
-                                if (!fgets(line, sizeof(line), fp))
-                                {
-                                    done = 1;
-                                    break;
-                                }
-                                trimmed = trim_whitespace(line);
-                                if (trimmed[0] == '}')
-                                {
-                                    done = 1;
-                                    break;
-                                }
-                                if (!strlen(trimmed))
-                                {
-                                    continue;
-                                }
-                                strncat(rulebuf, trimmed, sizeof(rulebuf) - strlen(rulebuf) - 2);
-                                strncat(rulebuf, " ", sizeof(rulebuf) - strlen(rulebuf) - 2);
-                                if (strchr(trimmed, ';'))
-                                {
-                                    have_semicolon = 1;
-                                    break;
-                                }
-                            }
-                            if (done)
-                            {
-                                break;
-                            }
-                        }
-                        {
-                            char *rtrim = trim_whitespace(rulebuf);
-                            if (!rtrim[0])
-                            {
-                                continue;
-                            }
-                            {
-                                SH_SyntaxRule rule;
-                                if (!sh_parse_rule_line(rtrim, &rule))
-                                {
-                                    def.rules = (SH_SyntaxRule *)realloc(def.rules, sizeof(SH_SyntaxRule) * (def.rule_count + 1));
-                                    def.rules[def.rule_count++] = rule;
-                                }
-                            }
-                        }
-                    }
-                    defs.definitions = (SH_SyntaxDefinition *)realloc(defs.definitions, sizeof(SH_SyntaxDefinition) * (defs.count + 1));
-                    defs.definitions[defs.count++] = def;
-                }
-            }
+            lo = mid + 1;
+        }
+        else
+        {
+            return mid;
         }
-        fclose(fp);
     }
-    return defs;
+    return -1;
 }
 
-void sh_free_syntax_definitions(SH_SyntaxDefinitions defs)
+/* Last hidden line of a fold starting at 'line', or -1 if no fold starts there. */
+static int fold_end_of(int line)
 {
-    int i, j, k, t;
-    for (i = 0; i < defs.count; i++)
+    int f = fold_count > 0 ? fold_find(line) : -1;
+    return (f >= 0 && folds[f].start == line) ? folds[f].end : -1;
+}
+
+static int fold_visible_line(int line)
+{
+    if (fold_count > 0 && line >= 0 && line < MAX_LINES && fold_hidden[line])
     {
-        SH_SyntaxDefinition d = defs.definitions[i];
-        for (j = 0; j < d.ext_count; j++)
-        {
-            free(d.extensions[j]);
-        }
-        free(d.extensions);
-        for (k = 0; k < d.rule_count; k++)
-        {
-            SH_SyntaxRule rr = d.rules[k];
-            for (t = 0; t < rr.token_count; t++)
-            {
-                free(rr.tokens[t]);
-            }
-            free(rr.tokens);
-        }
-        free(d.rules);
+        return folds[fold_find(line)].start;
     }
-    free(defs.definitions);
+    return line;
 }
 
-int sh_file_has_extension(const char *filename, SH_SyntaxDefinition def)
+static int fold_next_visible(int line)
 {
-    int i;
-    for (i = 0; i < def.ext_count; i++)
+    int end = fold_end_of(line);
+    return end >= 0 ? end + 1 : line + 1;
+}
+
+/* Moves 'delta' visible lines from 'line', clamped to the buffer. */
+static int fold_move_visible(int line, int delta)
+{
+    int rank = fold_rank(fold_visible_line(line)) + delta;
+    int total = fold_rank(editor.num_lines);
+    if (rank >= total)
     {
-        char *ext = def.extensions[i];
-        size_t elen = strlen(ext), flen = strlen(filename);
-        if (flen >= elen)
-        {
-            if (!strcmp(filename + flen - elen, ext))
-            {
-                return 1;
-            }
-        }
+        rank = total - 1;
     }
-    return 0;
+    if (rank < 0)
+    {
+        rank = 0;
+    }
+    return fold_line_at_rank(rank);
 }
 
-void sh_init_syntax_colors(SH_SyntaxDefinition *def)
+/* Moves the cursor 'delta' visible lines, keeping its column inside the new line. */
+static void editor_move_cursor_lines(int delta)
 {
-    short next_color_index = 16, next_pair_index = 1;
-    int i;
-    for (i = 0; i < def->rule_count; i++)
+    int ll;
+    editor.cursor_y = fold_move_visible(editor.cursor_y, delta);
+    ll = (int)strlen(editor.text[editor.cursor_y]);
+    if (editor.cursor_x > ll)
     {
-        SH_SyntaxRule *rule = &def->rules[i];
-        short color_num = next_color_index++;
-        short pair_idx = next_pair_index++;
-        short r_scaled = (short)((rule->r * 1000) / 255);
-        short g_scaled = (short)((rule->g * 1000) / 255);
-        short b_scaled = (short)((rule->b * 1000) / 255);
-        if (can_change_color())
-        {
-            init_color(color_num, r_scaled, g_scaled, b_scaled);
-        }
-        init_pair(pair_idx, color_num, -1);
-        rule->color_pair = pair_idx;
+        editor.cursor_x = ll;
     }
+    editor_mark_all_lines_dirty();
 }
 
-int compare_token_map(const void *a, const void *b)
+static void fold_remove(int f)
 {
-    const TokenMap *tm1 = (const TokenMap *)a;
-    const TokenMap *tm2 = (const TokenMap *)b;
-    return strcmp(tm1->token, tm2->token);
+    int i;
+    for (i = folds[f].start + 1; i <= folds[f].end; i++)
+    {
+        if (fold_hidden[i])
+        {
+            fold_hidden[i] = 0;
+            fold_bit_add(i, 1);
+        }
+    }
+    memmove(&folds[f], &folds[f + 1], sizeof(Fold) * (size_t)(fold_count - f - 1));
+    fold_count--;
+    editor_mark_all_lines_dirty();
 }
 
-void build_token_lookup(SH_SyntaxDefinition *def)
+/* Hides lines start+1..end; folds inside the new range are absorbed into it. */
+static void fold_add(int start, int end)
 {
-    int i, j, total = 0;
-    for (i = 0; i < def->rule_count; i++)
+    int f = 0, i;
+    if (fold_count >= MAX_FOLDS || end <= start)
     {
-        total += def->rules[i].token_count;
+        return;
     }
-    if (total <= 0)
+    while (f < fold_count && folds[f].start < start)
     {
-        token_lookup = NULL;
-        token_lookup_count = 0;
-        return;
+        f++;
     }
-    token_lookup = (TokenMap *)malloc(sizeof(TokenMap) * total);
-    token_lookup_count = 0;
-    for (i = 0; i < def->rule_count; i++)
+    while (f < fold_count && folds[f].start <= end)
     {
-        SH_SyntaxRule *r = &def->rules[i];
-        for (j = 0; j < r->token_count; j++)
+        if (folds[f].end > end)
         {
-            if (r->tokens[j])
-            {
-                token_lookup[token_lookup_count].token = r->tokens[j];
-                token_lookup[token_lookup_count].color_pair = r->color_pair;
-                token_lookup_count++;
-            }
+            end = folds[f].end;
         }
+        memmove(&folds[f], &folds[f + 1], sizeof(Fold) * (size_t)(fold_count - f - 1));
+        fold_count--;
     }
-    if (token_lookup_count > 0)
+    memmove(&folds[f + 1], &folds[f], sizeof(Fold) * (size_t)(fold_count - f));
+    folds[f].start = start;
+    folds[f].end = end;
+    fold_count++;
+    for (i = start + 1; i <= end; i++)
     {
-        qsort(token_lookup, token_lookup_count, sizeof(TokenMap), compare_token_map);
+        if (!fold_hidden[i])
+        {
+            fold_hidden[i] = 1;
+            fold_bit_add(i, -1);
+        }
     }
+    editor_mark_all_lines_dirty();
 }
 
-/* ---------- Shell Panel ---------- */
-void shell_panel_toggle(void)
+/* Makes 'line' visible by opening every fold that hides it. */
+void fold_reveal(int line)
 {
-    shell_panel_open = !shell_panel_open;
-    editor_mark_all_lines_dirty();
+    while (fold_count > 0 && line >= 0 && line < MAX_LINES && fold_hidden[line])
+    {
+        fold_remove(fold_find(line));
+    }
 }
 
-void shell_panel_run_command(void)
+static int fold_indent_of(const char *line)
 {
-    char cmd[PROMPT_BUFFER_SIZE];
-    editor_prompt("Shell command: ", cmd, sizeof(cmd));
-    if (!cmd[0])
+    int n = 0;
+    while (line[n] == ' ' || line[n] == '\t')
     {
-        return;
+        n++;
     }
-    shell_output_count = 0;
-    memset(shell_output, 0, sizeof(shell_output));
-    FILE *fp = popen(cmd, "r");
-    if (!fp)
+    return line[n] ? n : -1; /* -1: blank line */
+}
+
+/* F4: unfold the fold at the cursor, or fold the brace block / deeper-indented block below it. */
+void fold_toggle_at_cursor(void)
+{
+    int y = editor.cursor_y, end = -1, i, base;
+    const char *line = editor.text[y];
+    int f = fold_count > 0 ? fold_find(y) : -1;
+    if (f >= 0)
     {
-        snprintf(shell_output[0], MAX_COLS, "Error running command: %s", strerror(errno));
-        shell_output_count = 1;
+        fold_remove(f);
         return;
     }
-    while (fgets(shell_output[shell_output_count], MAX_COLS, fp))
+    /* Brace region: the last '{' on the line whose partner is on a later line. */
+    for (i = (int)strlen(line) - 1; i >= 0 && end < 0; i--)
     {
-        size_t ln = strlen(shell_output[shell_output_count]);
-        if (ln > 0 && shell_output[shell_output_count][ln - 1] == '\n')
+        int my, mx;
+        if (line[i] == '{' && bracket_find_match(y, i, &my, &mx) == 0 && my > y)
         {
-            shell_output[shell_output_count][ln - 1] = '\0';
+            end = my;
         }
-        shell_output_count++;
-        if (shell_output_count >= SHELL_PANEL_LINES)
+    }
+    /* Otherwise: following lines indented deeper than this one. */
+    if (end < 0 && (base = fold_indent_of(line)) >= 0)
+    {
+        for (i = y + 1; i < editor.num_lines; i++)
         {
-            break;
+            int ind = fold_indent_of(editor.text[i]);
+            if (ind >= 0 && ind <= base)
+            {
+                break;
+            }
+            if (ind > base)
+            {
+                end = i;
+            }
         }
     }
-    pclose(fp);
+    if (end <= y)
+    {
+        editor_set_status_message("Nothing to fold here.");
+        return;
+    }
+    fold_add(y, end);
 }
 
-static void shell_panel_draw(void)
+/* F3: open every fold. */
+void fold_unfold_all(void)
+{
+    fold_count = 0;
+    fold_rebuild_index();
+    editor_mark_all_lines_dirty();
+}
+
+/* Keeps folds attached to their text when lines are inserted or removed above them. */
+void fold_content_changed(int first, int last)
 {
-    int rows, cols;
-    getmaxyx(stdscr, rows, cols);
-    int panel_height = 10;
-    int start_line = rows - panel_height;
-    mvprintw(start_line, 0, "=== Shell Panel (Ctrl+W to close, Ctrl+E to run cmd) ===");
+    int delta = editor.num_lines - fold_known_lines, f, out = 0;
+    fold_known_lines = editor.num_lines;
+    if (last != LINES_TO_END)
     {
-        int line_in_panel = 1, i;
-        for (i = 0; i < shell_output_count && line_in_panel < panel_height; i++, line_in_panel++)
+        return;
+    }
+    if (fold_count == 0)
+    {
+        return;
+    }
+    for (f = 0; f < fold_count; f++)
+    {
+        Fold fd = folds[f];
+        if (fd.end < first)
         {
-            move(start_line + line_in_panel, 0);
-            clrtoeol();
-            mvprintw(start_line + line_in_panel, 0, "%s", shell_output[i]);
+            folds[out++] = fd;
         }
-        while (line_in_panel < panel_height)
+        else if (fd.start > first)
         {
-            move(start_line + line_in_panel, 0);
-            clrtoeol();
-            line_in_panel++;
+            fd.start += delta;
+            fd.end += delta;
+            if (fd.end >= editor.num_lines)
+            {
+                fd.end = editor.num_lines - 1;
+            }
+            /* A fold whose first line was deleted is dropped. */
+            if (fd.start >= first && fd.end > fd.start)
+            {
+                folds[out++] = fd;
+            }
         }
+        /* A fold containing the edit point is opened. */
     }
+    fold_count = out;
+    fold_rebuild_index();
 }
 
-/* ---------- Search & Replace ---------- */
-void init_search_color(void)
+/* ---------- Viewport ---------- */
+/* Rows left for text above the status bar (and the shell panel, when open). */
+static int viewport_text_rows(void)
 {
-    if (!search_color_pair_defined)
+    return screen_rows - 1 - (shell_panel_open ? SHELL_PANEL_HEIGHT : 0);
+}
+
+void update_viewport(void)
+{
+    int cols = screen_cols;
+    int text_rows = viewport_text_rows();
+    /* The cursor and the top row always sit on visible (unfolded) lines. */
+    editor.cursor_y = fold_visible_line(editor.cursor_y);
+    editor.row_offset = fold_visible_line(editor.row_offset);
+    if (editor.cursor_y < editor.row_offset)
     {
-        short color_num = 250;
-        if (can_change_color())
+        editor.row_offset = editor.cursor_y;
+        editor_mark_all_lines_dirty();
+    }
+    else if (fold_rank(editor.cursor_y) - fold_rank(editor.row_offset) >= text_rows)
+    {
+        editor.row_offset = fold_line_at_rank(fold_rank(editor.cursor_y) - (text_rows - 1));
+        editor_mark_all_lines_dirty();
+    }
+    {
+        int usable = cols - (show_line_numbers ? LINE_NUMBER_WIDTH : 0) - minimap_visible;
+        if (editor.cursor_x < editor.col_offset)
         {
-            init_color(color_num, 1000, 1000, 0);
+            editor.col_offset = editor.cursor_x;
+            editor_mark_all_lines_dirty();
+        }
+        else if (editor.cursor_x >= editor.col_offset + usable)
+        {
+            editor.col_offset = editor.cursor_x - usable + 1;
+            editor_mark_all_lines_dirty();
         }
-        init_pair(SEARCH_COLOR_PAIR, COLOR_BLACK, color_num);
-        search_color_pair_defined = 1;
     }
 }
 
-void editor_search(void)
+/* ---------- Screen Output ---------- */
+/*
+    All drawing goes through scr_*(). By default they are thin wrappers over
+    ncurses. With --vt the frame is drawn into a back grid of chtype cells
+    instead; scr_present() compares it against the front grid (what the
+    terminal shows) a row at a time, skipping unchanged rows with one memcmp,
+    and sends the changed runs as VT escape sequences in a single write().
+    ncurses still reads the keyboard and runs the prompt line.
+*/
+static void vt_resize_grids(void)
 {
-    char term[PROMPT_BUFFER_SIZE];
-    editor_prompt("Search term: ", term, sizeof(term));
-    if (!term[0])
+    size_t cells = (size_t)screen_rows * (size_t)screen_cols;
+    size_t i;
+    vt_rows = screen_rows;
+    vt_cols = screen_cols;
+    vt_front = (chtype *)realloc(vt_front, cells * sizeof(chtype));
+    vt_back = (chtype *)realloc(vt_back, cells * sizeof(chtype));
+    for (i = 0; i < cells; i++)
     {
-        g_searchActive = 0;
-        g_searchTerm[0] = '\0';
+        vt_back[i] = ' ';
+    }
+    memset(vt_front, 0, cells * sizeof(chtype));
+}
+
+/* Forgets what the terminal shows from row 'first' on, so the next frame repaints it. */
+static void scr_invalidate(int first)
+{
+    if (vt_backend && vt_front && first < vt_rows)
+    {
+        memset(vt_front + (size_t)first * vt_cols, 0, (size_t)(vt_rows - first) * vt_cols * sizeof(chtype));
+    }
+}
+
+static void scr_put(int y, int x, chtype c)
+{
+    if (!vt_backend)
+    {
+        mvaddch(y, x, c);
         return;
     }
-    strncpy(g_searchTerm, term, sizeof(g_searchTerm) - 1);
-    g_searchTerm[sizeof(g_searchTerm) - 1] = '\0';
-    g_searchActive = 1;
-    editor_mark_all_lines_dirty();
+    if (vt_rows != screen_rows || vt_cols != screen_cols)
+    {
+        vt_resize_grids();
+    }
+    if (y < 0 || y >= vt_rows || x < 0 || x >= vt_cols)
+    {
+        return;
+    }
+    /* One byte per cell: control and non-ASCII bytes would throw the column count off. */
+    if ((c & A_CHARTEXT) < 32 || (c & A_CHARTEXT) > 126)
+    {
+        c = (c & ~A_CHARTEXT) | ((c & A_CHARTEXT) == '\t' ? ' ' : '?');
+    }
+    vt_back[(size_t)y * vt_cols + x] = c;
 }
 
-void editor_replace_all(void)
+static void scr_print(int y, int x, attr_t attrs, const char *fmt, ...)
 {
-    char oldstr[PROMPT_BUFFER_SIZE], newstr[PROMPT_BUFFER_SIZE];
-    editor_prompt("Old text: ", oldstr, sizeof(oldstr));
-    if (!oldstr[0])
+    char buf[1024];
+    const char *p;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    for (p = buf; *p && x < screen_cols; p++, x++)
+    {
+        scr_put(y, x, (chtype)(unsigned char)*p | attrs);
+    }
+}
+
+static void scr_clear_to_eol(int y, int x)
+{
+    if (!vt_backend)
     {
+        move(y, x);
+        clrtoeol();
         return;
     }
-    editor_prompt("New text: ", newstr, sizeof(newstr));
+    for (; x < screen_cols; x++)
     {
-        int i;
-        for (i = 0; i < editor.num_lines; i++)
-        {
-            char *line = editor.text[i];
-            char buffer[MAX_COLS * 2], *out = buffer;
-            char *start = line;
-            size_t oldlen = strlen(oldstr), newlen = strlen(newstr);
-            buffer[0] = '\0';
-            while (1)
-            {
-                char *pos = strstr(start, oldstr);
-                if (!pos)
-                {
-                    strncat(out, start, sizeof(buffer) - strlen(out) - 1);
-                    break;
-                }
-                {
-                    size_t seg_len = (size_t)(pos - start);
-                    strncat(out, start, seg_len);
-                }
-                strncat(out, newstr, sizeof(buffer) - strlen(out) - 1);
-                start = pos + oldlen;
-            }
-            strncpy(line, buffer, MAX_COLS - 1);
-            line[MAX_COLS - 1] = '\0';
-            editor_mark_line_dirty(i);
-        }
+        scr_put(y, x, ' ');
     }
-    dirty = 1;
 }
 
-/* ---------- Draw line ---------- */
-static void draw_line(WINDOW *win, int row, int line_idx, int cols)
+static void scr_set_cursor(int y, int x)
 {
-    move(row, 0);
-    clrtoeol();
+    if (!vt_backend)
+    {
+        move(y, x);
+        return;
+    }
+    vt_cursor_y = y;
+    vt_cursor_x = x;
+}
 
-    char *line = editor.text[line_idx];
-    int len = (int)strlen(line);
-    int j = editor.col_offset;
+static void vt_append(const char *s, size_t n)
+{
+    if (vt_out_len + n > vt_out_cap)
+    {
+        vt_out_cap = (vt_out_len + n) * 2;
+        vt_out = (char *)realloc(vt_out, vt_out_cap);
+    }
+    memcpy(vt_out + vt_out_len, s, n);
+    vt_out_len += n;
+}
 
-    /* If line numbers are toggled on, print them. */
-    int start_col = 0;
-    if (show_line_numbers)
+static void vt_appendf(const char *fmt, ...)
+{
+    char buf[64];
+    va_list ap;
+    int n;
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    vt_append(buf, (size_t)n);
+}
+
+static void vt_color(int color, int base, int bright, int extended)
+{
+    if (color < 0)
     {
-        /* e.g. "   1 | " uses ~7-8 columns. */
-        mvwprintw(win, row, 0, "%4d | ", line_idx + 1);
-        start_col = LINE_NUMBER_WIDTH; /* e.g. 8 */
+        return;
+    }
+    if (color < 8)
+    {
+        vt_appendf(";%d", base + color);
+    }
+    else if (color < 16)
+    {
+        vt_appendf(";%d", bright + color - 8);
     }
+    else
+    {
+        vt_appendf(";%d;5;%d", extended, color);
+    }
+}
 
-    int col = start_col;
+/* SGR for a cell's attributes and colour pair, always from a reset so no state leaks between runs. */
+static void vt_sgr(chtype attrs)
+{
+    short fg, bg;
+    int pair = PAIR_NUMBER(attrs);
+    vt_append("\x1b[0", 3);
+    if (attrs & A_BOLD)
+    {
+        vt_append(";1", 2);
+    }
+    if (attrs & A_DIM)
+    {
+        vt_append(";2", 2);
+    }
+    if (attrs & A_UNDERLINE)
+    {
+        vt_append(";4", 2);
+    }
+    if (attrs & A_REVERSE)
+    {
+        vt_append(";7", 2);
+    }
+    if (pair > 0 && pair_content((short)pair, &fg, &bg) == OK)
+    {
+        vt_color(fg, 30, 90, 38);
+        vt_color(bg, 40, 100, 48);
+    }
+    vt_append("m", 1);
+}
 
-    while (j < len && col < cols)
+/* Emits the cells of row 'y' that differ from the front grid and copies them across. */
+static void vt_diff_row(int y, chtype *pen, int *at_y, int *at_x)
+{
+    chtype *back = vt_back + (size_t)y * vt_cols, *front = vt_front + (size_t)y * vt_cols;
+    int x = 0, last = vt_cols - 1;
+    while (last >= 0 && back[last] == ' ')
     {
-        /* Check if search highlighting applies first. */
-        if (g_searchActive && g_searchTerm[0])
+        last--;
+    }
+    while (x < vt_cols)
+    {
+        if (back[x] == front[x])
         {
-            size_t tlen = strlen(g_searchTerm);
-            if (j + (int)tlen <= len && strncmp(&line[j], g_searchTerm, tlen) == 0)
-            {
-                /* Found the search term. */
-                init_search_color();
-                wattron(win, COLOR_PAIR(SEARCH_COLOR_PAIR));
-                for (size_t k = 0; k < tlen && col < cols; k++, col++)
-                {
-                    mvwaddch(win, row, col, line[j + k]);
-                }
-                wattroff(win, COLOR_PAIR(SEARCH_COLOR_PAIR));
-                j += (int)tlen;
-                continue;
-            }
+            x++;
+            continue;
         }
-
-        /* If syntax highlighting is enabled, check for tokens with word-boundary. */
-        if (syntax_enabled && token_lookup_count > 0)
+        if (*at_y != y || *at_x != x)
+        {
+            vt_appendf("\x1b[%d;%dH", y + 1, x + 1);
+        }
+        if (x > last && vt_cols - x > 4)
         {
-            int token_matched = 0;
-            for (int i = 0; i < token_lookup_count; i++)
+            /* Only blanks from here on: erase the rest of the row instead of writing them. */
+            if (*pen != 0)
             {
-                int token_len = (int)strlen(token_lookup[i].token);
-                if (token_len > 0 &&
-                    j + token_len <= len &&
-                    strncmp(&line[j], token_lookup[i].token, token_len) == 0)
-                {
-                    /* Check word boundaries. */
-                    if (is_left_boundary(line, j) && is_right_boundary(line, j + token_len))
-                    {
-                        /* It's a valid match => highlight. */
-                        wattron(win, COLOR_PAIR(token_lookup[i].color_pair));
-                        for (int k = 0; k < token_len && col < cols; k++, col++)
-                        {
-                            mvwaddch(win, row, col, line[j + k]);
-                        }
-                        wattroff(win, COLOR_PAIR(token_lookup[i].color_pair));
-                        j += token_len;
-                        token_matched = 1;
-                        break;
-                    }
-                }
+                vt_append("\x1b[0m", 4);
+                *pen = 0;
             }
-            if (token_matched)
+            vt_append("\x1b[K", 3);
+            *at_y = y;
+            *at_x = x;
+            for (; x < vt_cols; x++)
             {
-                continue;
+                front[x] = ' ';
             }
+            break;
         }
-
-        /* No special highlight => just print the char. */
-        mvwaddch(win, row, col, line[j]);
-        col++;
-        j++;
-    }
-}
-
-/* ---------- Status line + partial redraw ---------- */
-void editor_refresh_screen(void)
-{
-    int rows, cols;
-    getmaxyx(stdscr, rows, cols);
-    int shell_panel_height = shell_panel_open ? 10 : 0;
-    int text_area_rows = rows - shell_panel_height - 1;
-
-    {
-        int i;
-        for (i = 0; i < text_area_rows; i++)
+        /* A changed run, bridging short stretches of unchanged cells (cheaper than a cursor move). */
+        while (x < vt_cols)
         {
-            int line_idx = editor.row_offset + i;
-            if (line_idx >= 0 && line_idx < editor.num_lines)
+            if (back[x] == front[x])
             {
-                if (line_dirty[line_idx])
+                int gap = x;
+                while (gap < vt_cols && gap - x < 4 && back[gap] == front[gap])
                 {
-                    draw_line(stdscr, i, line_idx, cols);
-                    line_dirty[line_idx] = 0;
+                    gap++;
+                }
+                if (gap == vt_cols || gap - x >= 4)
+                {
+                    break;
                 }
             }
-            else
+            if ((back[x] & ~A_CHARTEXT) != *pen)
             {
-                /* Clear leftover lines if the file is shorter than the window. */
-                move(i, 0);
-                clrtoeol();
+                *pen = back[x] & ~A_CHARTEXT;
+                vt_sgr(*pen);
             }
-        }
-    }
-    {
-        int i;
-        for (i = editor.num_lines - editor.row_offset; i < text_area_rows; i++)
-        {
-            if (i >= 0)
             {
-                move(i, 0);
-                clrtoeol();
+                char ch = (char)(back[x] & A_CHARTEXT);
+                vt_append(&ch, 1);
             }
+            front[x] = back[x];
+            x++;
         }
+        *at_y = y;
+        /* After the last column the terminal holds a pending wrap; force a cursor move next time. */
+        *at_x = x < vt_cols ? x : -1;
     }
+}
 
-    /* Status bar on the last line. */
+static void vt_flush(void)
+{
+    chtype pen = 0;
+    int y, at_y = -1, at_x = -1, changed = 0;
+    size_t done = 0;
+    if (vt_rows != screen_rows || vt_cols != screen_cols)
     {
-        int status_row = text_area_rows;
-        move(status_row, 0);
-        clrtoeol();
-        if (!show_help)
-        {
-            char status[256];
-            const char *fname = (current_file[0]) ? current_file : "Untitled";
-            snprintf(status, sizeof(status), "[%s] File: %s | Ln: %d, Col: %d%s",
-                     CED_VERSION, fname, editor.cursor_y + 1, editor.cursor_x + 1,
-                     (dirty ? " [Modified]" : ""));
-            mvprintw(status_row, 0, "%s (Press Ctrl+H for help)", status);
-        }
-        else
+        vt_resize_grids();
+    }
+    vt_out_len = 0;
+    vt_append("\x1b[?25l\x1b[0m", 10);
+    for (y = 0; y < vt_rows; y++)
+    {
+        chtype *back = vt_back + (size_t)y * vt_cols;
+        if (memcmp(back, vt_front + (size_t)y * vt_cols, (size_t)vt_cols * sizeof(chtype)) != 0)
         {
-            /* Show key bindings including new QoL shortcuts */
-            mvprintw(status_row, 0,
-                     "[HELP] Ctrl+Q:Quit  Ctrl+S:Save  Ctrl+O:Open  Ctrl+Z:Undo  Ctrl+Y:Redo  "
-                     "Ctrl+G:Goto  Ctrl+F:Search  Ctrl+R:Replace  Ctrl+W:ShellPanel  Ctrl+E:ShellCmd  "
-                     "Ctrl+H:HideHelp  Ctrl+D:DupLine  Ctrl+K:KillLine  Ctrl+T:ToggleLN  Ctrl+U:Top  Ctrl+L:Bottom");
+            vt_diff_row(y, &pen, &at_y, &at_x);
+            changed = 1;
         }
     }
-
-    if (shell_panel_open)
+    if (!changed && vt_cursor_y == vt_shown_y && vt_cursor_x == vt_shown_x)
     {
-        shell_panel_draw();
+        return;
     }
-
-    /* Place cursor where it belongs on screen. */
+    vt_shown_y = vt_cursor_y;
+    vt_shown_x = vt_cursor_x;
+    if (pen != 0)
     {
-        int scr_y = editor.cursor_y - editor.row_offset;
-        int scr_x = editor.cursor_x - editor.col_offset + (show_line_numbers ? LINE_NUMBER_WIDTH : 0);
-        if (scr_y >= 0 && scr_y < text_area_rows)
+        vt_append("\x1b[0m", 4);
+    }
+    vt_appendf("\x1b[%d;%dH\x1b[?25h", vt_cursor_y + 1, vt_cursor_x + 1);
+    while (done < vt_out_len)
+    {
+        ssize_t n = write(STDOUT_FILENO, vt_out + done, vt_out_len - done);
+        if (n < 0 && errno != EINTR)
         {
-            move(scr_y, scr_x);
+            break;
         }
+        done += n > 0 ? (size_t)n : 0;
     }
-    wnoutrefresh(stdscr);
-    doupdate();
 }
 
-/* ---------- Editor Ops ---------- */
-void editor_insert_char(int ch)
-{
+/*
+    Before ncurses writes to the terminal again (prompt, quit): it plans
+    relative cursor moves from where it believes the cursor is (curscr's
+    cursor), so put the real cursor back there first.
+*/
+static void scr_handover(void)
+{
+    char buf[32];
+    int y, x, n;
+    if (!vt_backend)
+    {
+        return;
+    }
+    getyx(curscr, y, x);
+    vt_shown_y = vt_shown_x = -1;
+    n = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    if (write(STDOUT_FILENO, buf, (size_t)n) < 0)
+    {
+        return;
+    }
+}
+
+/* Ends a frame: ncurses' own diff-and-refresh, or the VT backend's. */
+static void scr_present(void)
+{
+    if (!vt_backend)
+    {
+        wnoutrefresh(stdscr);
+        doupdate();
+        return;
+    }
+    vt_flush();
+}
+
+/* ---------- Syntax ---------- */
+typedef struct SH_SyntaxDefinition SH_SyntaxDefinition;
+typedef struct SH_SyntaxDefinitions SH_SyntaxDefinitions;
+
+static int sh_count_tokens(const char *line)
+{
+    int count = 0;
+    const char *p = line;
+    while ((p = strchr(p, '\"')) != NULL)
+    {
+        p++;
+        {
+            char *end_quote = (char *)strchr(p, '\"');
+            if (!end_quote)
+            {
+                break;
+            }
+            p = end_quote + 1;
+        }
+        count++;
+    }
+    return count;
+}
+
+static int sh_parse_rule_line(char *line, SH_SyntaxRule *rule)
+{
+    rule->tokens = NULL;
+    rule->token_count = 0;
+    rule->r = rule->g = rule->b = 0;
+    {
+        int count = sh_count_tokens(line);
+        if (count > 0)
+        {
+            rule->tokens = (char **)malloc(sizeof(char *) * count);
+            {
+                int idx = 0;
+                char *p = line;
+                while ((p = strchr(p, '\"')) != NULL && idx < count)
+                {
+                    char *end_quote;
+                    p++;
+                    end_quote = strchr(p, '\"');
+                    if (!end_quote)
+                    {
+                        break;
+                    }
+                    {
+                        int len = (int)(end_quote - p);
+                        rule->tokens[idx] = (char *)malloc(len + 1);
+                        strncpy(rule->tokens[idx], p, len);
+                        rule->tokens[idx][len] = '\0';
+                    }
+                    idx++;
+                    p = end_quote + 1;
+                }
+                rule->token_count = idx;
+            }
+        }
+    }
+    {
+        char *eq = strchr(line, '=');
+        if (!eq)
+        {
+            return -1;
+        }
+        {
+            char *paren = strchr(eq, '(');
+            if (!paren)
+            {
+                return -1;
+            }
+            {
+                int r, g, b;
+                if ((sscanf(paren, " ( %d , %d , %d )", &r, &g, &b) < 3) &&
+                    (sscanf(paren, " (%d,%d,%d)", &r, &g, &b) < 3))
+                {
+                    return -1;
+                }
+                rule->r = r;
+                rule->g = g;
+                rule->b = b;
+            }
+        }
+    }
+    return 0;
+}
+
+static SH_SyntaxDefinitions sh_parse_syntax_stream(FILE *fp)
+{
+    SH_SyntaxDefinitions defs;
+    defs.definitions = NULL;
+    defs.count = 0;
+    {
+        char line[SH_MAX_LINE_LENGTH];
+        while (fgets(line, sizeof(line), fp))
+        {
+            char *trimmed = trim_whitespace(line);
+            if (!strncmp(trimmed, "SYNTAX", 6))
+            {
+                SH_SyntaxDefinition def;
+                def.extensions = NULL;
+                def.ext_count = 0;
+                def.rules = NULL;
+                def.rule_count = 0;
+                {
+                    char *p = trimmed + 6;
+                    while (*p)
+                    {
+                        if (*p == '\"')
+                        {
+                            p++;
+                            char *end = strchr(p, '\"');
+                            if (!end)
+                            {
+                                break;
+                            }
+                            {
+                                int ext_len = (int)(end - p);
+                                if (ext_len > 0)
+                                {
+                                    char *ext = (char *)malloc(ext_len + 1);
+                                    strncpy(ext, p, ext_len);
+                                    ext[ext_len] = '\0';
+                                    def.extensions = (char **)realloc(def.extensions, sizeof(char *) * (def.ext_count + 1));
+                                    def.extensions[def.ext_count++] = ext;
+                                }
+                            }
+                            p = end + 1;
+                        }
+                        else
+                        {
+                            p++;
+                        }
+                    }
+                }
+                if (!fgets(line, sizeof(line), fp) || trim_whitespace(line)[0] != '{')
+                {
+                    /* A header without a body defines nothing. */
+                    int e;
+                    for (e = 0; e < def.ext_count; e++)
+                    {
+                        free(def.extensions[e]);
+                    }
+                    free(def.extensions);
+                    continue;
+                }
+                while (1)
+                {
+                    char rulebuf[4 * SH_MAX_LINE_LENGTH];
+                    rulebuf[0] = '\0';
+                    {
+                        int done = 0, have_semicolon = 0;
+                        while (!have_semicolon)
+                        {
+                            if (!fgets(line, sizeof(line), fp))
+                            {
+                                done = 1;
+                                break;
+                            }
+                            trimmed = trim_whitespace(line);
+                            if (trimmed[0] == '}')
+                            {
+                                done = 1;
+                                break;
+                            }
+                            if (!strlen(trimmed))
+                            {
+                                continue;
+                            }
+                            strncat(rulebuf, trimmed, sizeof(rulebuf) - strlen(rulebuf) - 2);
+                            strncat(rulebuf, " ", sizeof(rulebuf) - strlen(rulebuf) - 2);
+                            if (strchr(trimmed, ';'))
+                            {
+                                have_semicolon = 1;
+                                break;
+                            }
+                        }
+                        if (done)
+                        {
+                            break;
+                        }
+                    }
+                    {
+                        char *rtrim = trim_whitespace(rulebuf);
+                        if (!rtrim[0])
+                        {
+                            continue;
+                        }
+                        {
+                            SH_SyntaxRule rule;
+                            if (!sh_parse_rule_line(rtrim, &rule))
+                            {
+                                def.rules = (SH_SyntaxRule *)realloc(def.rules, sizeof(SH_SyntaxRule) * (def.rule_count + 1));
+                                def.rules[def.rule_count++] = rule;
+                            }
+                            else
+                            {
+                                int t;
+                                for (t = 0; t < rule.token_count; t++)
+                                {
+                                    free(rule.tokens[t]);
+                                }
+                                free(rule.tokens);
+                            }
+                        }
+                    }
+                }
+                defs.definitions = (SH_SyntaxDefinition *)realloc(defs.definitions, sizeof(SH_SyntaxDefinition) * (defs.count + 1));
+                defs.definitions[defs.count++] = def;
+            }
+        }
+    }
+    return defs;
+}
+
+#ifndef CED_FUZZ /* the fuzz target parses from memory instead */
+static SH_SyntaxDefinitions sh_load_syntax_definitions(const char *filename)
+{
+    SH_SyntaxDefinitions defs = {NULL, 0};
+    FILE *fp = fopen(filename, "r");
+    if (fp)
+    {
+        defs = sh_parse_syntax_stream(fp);
+        fclose(fp);
+    }
+    return defs;
+}
+#endif
+
+void sh_free_syntax_definitions(SH_SyntaxDefinitions defs)
+{
+    int i, j, k, t;
+    for (i = 0; i < defs.count; i++)
+    {
+        SH_SyntaxDefinition d = defs.definitions[i];
+        for (j = 0; j < d.ext_count; j++)
+        {
+            free(d.extensions[j]);
+        }
+        free(d.extensions);
+        for (k = 0; k < d.rule_count; k++)
+        {
+            SH_SyntaxRule rr = d.rules[k];
+            for (t = 0; t < rr.token_count; t++)
+            {
+                free(rr.tokens[t]);
+            }
+            free(rr.tokens);
+        }
+        free(d.rules);
+    }
+    free(defs.definitions);
+}
+
+int sh_file_has_extension(const char *filename, SH_SyntaxDefinition def)
+{
+    int i;
+    for (i = 0; i < def.ext_count; i++)
+    {
+        char *ext = def.extensions[i];
+        size_t elen = strlen(ext), flen = strlen(filename);
+        if (flen >= elen)
+        {
+            if (!strcmp(filename + flen - elen, ext))
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void sh_init_syntax_colors(SH_SyntaxDefinition *def)
+{
+    short next_color_index = 16, next_pair_index = 1;
+    int i;
+    for (i = 0; i < def->rule_count; i++)
+    {
+        SH_SyntaxRule *rule = &def->rules[i];
+        short color_num = next_color_index++;
+        short pair_idx = next_pair_index++;
+        short r_scaled = (short)((rule->r * 1000) / 255);
+        short g_scaled = (short)((rule->g * 1000) / 255);
+        short b_scaled = (short)((rule->b * 1000) / 255);
+        if (can_change_color())
+        {
+            init_color(color_num, r_scaled, g_scaled, b_scaled);
+        }
+        init_pair(pair_idx, color_num, -1);
+        rule->color_pair = pair_idx;
+    }
+}
+
+int compare_token_map(const void *a, const void *b)
+{
+    const TokenMap *tm1 = (const TokenMap *)a;
+    const TokenMap *tm2 = (const TokenMap *)b;
+    return strcmp(tm1->token, tm2->token);
+}
+
+void build_token_lookup(SH_SyntaxDefinition *def)
+{
+    int i, j, total = 0;
+    for (i = 0; i < def->rule_count; i++)
+    {
+        total += def->rules[i].token_count;
+    }
+    memset(token_bucket, 0, sizeof(token_bucket));
+    if (total <= 0)
+    {
+        token_lookup = NULL;
+        token_lookup_count = 0;
+        return;
+    }
+    token_lookup = (TokenMap *)malloc(sizeof(TokenMap) * total);
+    token_lookup_count = 0;
+    for (i = 0; i < def->rule_count; i++)
+    {
+        SH_SyntaxRule *r = &def->rules[i];
+        for (j = 0; j < r->token_count; j++)
+        {
+            if (r->tokens[j])
+            {
+                token_lookup[token_lookup_count].token = r->tokens[j];
+                token_lookup[token_lookup_count].len = (int)strlen(r->tokens[j]);
+                token_lookup[token_lookup_count].color_pair = r->color_pair;
+                token_lookup_count++;
+            }
+        }
+    }
+    if (token_lookup_count > 0)
+    {
+        qsort(token_lookup, token_lookup_count, sizeof(TokenMap), compare_token_map);
+    }
+    /* Count tokens per first byte, then turn the counts into start offsets. */
+    for (i = 0; i < token_lookup_count; i++)
+    {
+        token_bucket[(unsigned char)token_lookup[i].token[0] + 1]++;
+    }
+    for (i = 1; i <= 256; i++)
+    {
+        token_bucket[i] += token_bucket[i - 1];
+    }
+}
+
+/* Returns the token_lookup entry that matches a whole word at line[j], or -1. */
+static int token_match_linear(const char *line, int j, int len)
+{
+    int i;
+    for (i = 0; i < token_lookup_count; i++)
+    {
+        int token_len = (int)strlen(token_lookup[i].token);
+        if (token_len > 0 && j + token_len <= len && strncmp(&line[j], token_lookup[i].token, token_len) == 0 &&
+            is_left_boundary(line, j) && is_right_boundary(line, j + token_len))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Same result as token_match_linear, but only tries the tokens that start with line[j]. */
+static int token_match_indexed(const char *line, int j, int len)
+{
+    unsigned char c = (unsigned char)line[j];
+    int i;
+    if (token_bucket[c] == token_bucket[c + 1] || !is_left_boundary(line, j))
+    {
+        return -1;
+    }
+    for (i = token_bucket[c]; i < token_bucket[c + 1]; i++)
+    {
+        int token_len = token_lookup[i].len;
+        if (j + token_len <= len && strncmp(&line[j], token_lookup[i].token, token_len) == 0 &&
+            is_right_boundary(line, j + token_len))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* ---------- Shell Panel ---------- */
+void shell_panel_toggle(void)
+{
+    shell_panel_open = !shell_panel_open;
+    editor_mark_all_lines_dirty();
+}
+
+/* Reaps stopped commands that have exited and SIGKILLs the groups of those past their deadline. */
+static void shell_stopping_reap(void)
+{
+    long now = monotonic_ms();
+    int i = 0;
+    while (i < shell_stopping_count)
+    {
+        pid_t pid = shell_stopping_pid[i];
+        if (waitpid(pid, NULL, WNOHANG) != 0)
+        {
+            shell_stopping_count--;
+            shell_stopping_pid[i] = shell_stopping_pid[shell_stopping_count];
+            shell_stopping_deadline[i] = shell_stopping_deadline[shell_stopping_count];
+            continue;
+        }
+        /* The leader is still unreaped, so the group id cannot have been reused. */
+        if (shell_stopping_deadline[i] > 0 && now >= shell_stopping_deadline[i])
+        {
+            killpg(pid, SIGKILL);
+            shell_stopping_deadline[i] = 0;
+        }
+        i++;
+    }
+}
+
+/* Milliseconds until a stopped command is due for SIGKILL, or -1 if none is. */
+static long shell_stopping_wait_ms(void)
+{
+    long wait = -1, now = monotonic_ms();
+    int i;
+    for (i = 0; i < shell_stopping_count; i++)
+    {
+        long left = shell_stopping_deadline[i] - now;
+        if (shell_stopping_deadline[i] > 0 && (wait < 0 || left < wait))
+        {
+            wait = left < 0 ? 0 : left;
+        }
+    }
+    return wait;
+}
+
+/* Asks the command's whole process group to stop, without waiting for it. */
+static void shell_terminate(pid_t pid)
+{
+    killpg(pid, SIGTERM);
+    if (shell_stopping_count == SHELL_STOPPING_MAX)
+    {
+        /* Too many stragglers: make room by killing the oldest outright. */
+        killpg(shell_stopping_pid[0], SIGKILL);
+        shell_stopping_deadline[0] = 0;
+        waitpid(shell_stopping_pid[0], NULL, 0);
+        shell_stopping_count--;
+        shell_stopping_pid[0] = shell_stopping_pid[shell_stopping_count];
+        shell_stopping_deadline[0] = shell_stopping_deadline[shell_stopping_count];
+    }
+    shell_stopping_pid[shell_stopping_count] = pid;
+    shell_stopping_deadline[shell_stopping_count] = monotonic_ms() + SHELL_KILL_GRACE_MS;
+    shell_stopping_count++;
+    shell_stopping_reap();
+}
+
+/* Reaps the command once its output has ended and it has exited (retried on every SIGCHLD). */
+static void shell_panel_reap(void)
+{
+    int status;
+    pid_t reaped;
+    shell_stopping_reap();
+    if (shell_pid <= 0 || shell_fd >= 0)
+    {
+        return;
+    }
+    reaped = waitpid(shell_pid, &status, WNOHANG);
+    if (reaped == 0)
+    {
+        return;
+    }
+    if (reaped == shell_pid && WIFEXITED(status) && WEXITSTATUS(status) != 0)
+    {
+        editor_set_status_message("Shell command exited with status %d.", WEXITSTATUS(status));
+    }
+    shell_pid = 0;
+}
+
+/* The command's output stream has ended. */
+static void shell_panel_finish(void)
+{
+    event_unwatch_fd(shell_fd);
+    close(shell_fd);
+    shell_fd = -1;
+    if (shell_line_len > 0 && shell_output_count < SHELL_PANEL_LINES)
+    {
+        shell_output_count++; /* last line had no newline */
+    }
+    shell_line_len = 0;
+    shell_panel_reap();
+}
+
+/* Stops a command that is still running (or one that closed its output but has not exited); never blocks. */
+static void shell_panel_stop(void)
+{
+    if (shell_fd >= 0)
+    {
+        shell_panel_finish();
+    }
+    if (shell_pid > 0)
+    {
+        shell_terminate(shell_pid);
+        shell_pid = 0;
+    }
+}
+
+/* Empties the panel for new content, stopping whatever was still writing to it. */
+static void shell_panel_clear(void)
+{
+    shell_panel_stop();
+    shell_output_count = 0;
+    shell_line_len = 0;
+    memset(shell_output, 0, sizeof(shell_output));
+}
+
+/* Appends one formatted line; lines past the panel's capacity are dropped. */
+static void shell_panel_emit(const char *fmt, ...)
+{
+    va_list ap;
+    if (shell_output_count >= SHELL_PANEL_LINES)
+    {
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(shell_output[shell_output_count++], MAX_COLS, fmt, ap);
+    va_end(ap);
+}
+
+/* Output arrives in pieces from the event loop; a full panel stops the command. */
+static void shell_panel_on_output(int fd)
+{
+    char buf[4096];
+    ssize_t n, i;
+    PROF_BEGIN(PROF_SHELL_READ);
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        for (i = 0; i < n; i++)
+        {
+            if (shell_output_count >= SHELL_PANEL_LINES)
+            {
+                shell_panel_stop();
+                PROF_END(PROF_SHELL_READ);
+                return;
+            }
+            if (buf[i] == '\n')
+            {
+                shell_output_count++;
+                shell_line_len = 0;
+            }
+            else if (shell_line_len < MAX_COLS - 1)
+            {
+                shell_output[shell_output_count][shell_line_len++] = buf[i];
+            }
+        }
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EINTR))
+    {
+        shell_panel_finish();
+    }
+    PROF_END(PROF_SHELL_READ);
+}
+
+/* Runs the command in the background (stdin from /dev/null, stdout and stderr into the panel). */
+void shell_panel_run_command(void)
+{
+    char cmd[PROMPT_BUFFER_SIZE];
+    int fds[2];
+    pid_t pid;
+    editor_prompt("Shell command: ", cmd, sizeof(cmd));
+    if (!cmd[0])
+    {
+        return;
+    }
+    shell_panel_clear();
+    if (trace_replaying)
+    {
+        /* A replay must not have side effects outside the editor. */
+        shell_panel_emit("(not run during replay) %s", cmd);
+        shell_panel_open = 1;
+        return;
+    }
+    PROF_BEGIN(PROF_SHELL_RUN);
+    if (pipe(fds) == -1)
+    {
+        snprintf(shell_output[0], MAX_COLS, "Error running command: %s", strerror(errno));
+        shell_output_count = 1;
+        PROF_END(PROF_SHELL_RUN);
+        return;
+    }
+    pid = fork();
+    if (pid == -1)
+    {
+        snprintf(shell_output[0], MAX_COLS, "Error running command: %s", strerror(errno));
+        shell_output_count = 1;
+        close(fds[0]);
+        close(fds[1]);
+        PROF_END(PROF_SHELL_RUN);
+        return;
+    }
+    if (pid == 0)
+    {
+        int devnull = open("/dev/null", O_RDONLY);
+        setpgid(0, 0); /* its own group, so stopping it reaches whatever it started */
+        if (devnull >= 0)
+        {
+            dup2(devnull, 0);
+        }
+        dup2(fds[1], 1);
+        dup2(fds[1], 2);
+        close(fds[0]);
+        close(fds[1]);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    setpgid(pid, pid); /* also here, so killpg works even before the child has run */
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    shell_pid = pid;
+    shell_fd = fds[0];
+    event_watch_fd(shell_fd, shell_panel_on_output);
+    PROF_END(PROF_SHELL_RUN);
+}
+
+static void shell_panel_draw(void)
+{
+    int panel_height = SHELL_PANEL_HEIGHT;
+    int start_line = screen_rows - panel_height;
+    scr_print(start_line, 0, A_NORMAL, "=== Shell Panel (Ctrl+W to close, Ctrl+E to run cmd) ===");
+    {
+        int line_in_panel = 1, i;
+        for (i = 0; i < shell_output_count && line_in_panel < panel_height; i++, line_in_panel++)
+        {
+            scr_clear_to_eol(start_line + line_in_panel, 0);
+            scr_print(start_line + line_in_panel, 0, A_NORMAL, "%s", shell_output[i]);
+        }
+        while (line_in_panel < panel_height)
+        {
+            scr_clear_to_eol(start_line + line_in_panel, 0);
+            line_in_panel++;
+        }
+    }
+}
+
+/* ---------- Line Diff ---------- */
+/*
+    Linear-space Myers diff over arrays of line hashes: common prefix and
+    suffix are trimmed, then the middle snake found by a forward and a
+    reverse search splits the problem in two. The result is an edit script
+    with one 'E' (equal), 'D' (delete from a) or 'I' (insert from b) per line.
+*/
+static void diff_lines(const unsigned long *a, int n, const unsigned long *b, int m, char *ops, int *nops);
+
+static void diff_bisect(const unsigned long *a, int n, const unsigned long *b, int m, char *ops, int *nops)
+{
+    int max_d = (n + m + 1) / 2, v_offset = max_d, v_length = 2 * max_d + 2;
+    int delta = n - m, front = (delta % 2 != 0);
+    int k1start = 0, k1end = 0, k2start = 0, k2end = 0, d, k, i;
+    int split_x = -1, split_y = -1;
+    int *v1 = (int *)malloc(sizeof(int) * (size_t)v_length);
+    int *v2 = (int *)malloc(sizeof(int) * (size_t)v_length);
+    for (i = 0; i < v_length; i++)
+    {
+        v1[i] = v2[i] = -1;
+    }
+    v1[v_offset + 1] = 0;
+    v2[v_offset + 1] = 0;
+    for (d = 0; d < max_d && split_x < 0; d++)
+    {
+        for (k = -d + k1start; k <= d - k1end && split_x < 0; k += 2)
+        {
+            int ko = v_offset + k, x, y;
+            x = (k == -d || (k != d && v1[ko - 1] < v1[ko + 1])) ? v1[ko + 1] : v1[ko - 1] + 1;
+            y = x - k;
+            while (x < n && y < m && a[x] == b[y])
+            {
+                x++;
+                y++;
+            }
+            v1[ko] = x;
+            if (x > n)
+            {
+                k1end += 2;
+            }
+            else if (y > m)
+            {
+                k1start += 2;
+            }
+            else if (front)
+            {
+                int k2o = v_offset + delta - k;
+                if (k2o >= 0 && k2o < v_length && v2[k2o] != -1 && x >= n - v2[k2o])
+                {
+                    split_x = x;
+                    split_y = y;
+                }
+            }
+        }
+        for (k = -d + k2start; k <= d - k2end && split_x < 0; k += 2)
+        {
+            int ko = v_offset + k, x, y;
+            x = (k == -d || (k != d && v2[ko - 1] < v2[ko + 1])) ? v2[ko + 1] : v2[ko - 1] + 1;
+            y = x - k;
+            while (x < n && y < m && a[n - x - 1] == b[m - y - 1])
+            {
+                x++;
+                y++;
+            }
+            v2[ko] = x;
+            if (x > n)
+            {
+                k2end += 2;
+            }
+            else if (y > m)
+            {
+                k2start += 2;
+            }
+            else if (!front)
+            {
+                int k1o = v_offset + delta - k;
+                if (k1o >= 0 && k1o < v_length && v1[k1o] != -1)
+                {
+                    int x1 = v1[k1o];
+                    if (x1 >= n - x)
+                    {
+                        split_x = x1;
+                        split_y = v_offset + x1 - k1o;
+                    }
+                }
+            }
+        }
+    }
+    free(v1);
+    free(v2);
+    if (split_x < 0)
+    {
+        /* Nothing in common. */
+        for (i = 0; i < n; i++)
+        {
+            ops[(*nops)++] = 'D';
+        }
+        for (i = 0; i < m; i++)
+        {
+            ops[(*nops)++] = 'I';
+        }
+        return;
+    }
+    diff_lines(a, split_x, b, split_y, ops, nops);
+    diff_lines(a + split_x, n - split_x, b + split_y, m - split_y, ops, nops);
+}
+
+/* Appends the edit script turning a[0..n) into b[0..m) to ops (room for n + m entries). */
+static void diff_lines(const unsigned long *a, int n, const unsigned long *b, int m, char *ops, int *nops)
+{
+    int pre = 0, suf = 0, i;
+    while (pre < n && pre < m && a[pre] == b[pre])
+    {
+        ops[(*nops)++] = 'E';
+        pre++;
+    }
+    while (suf < n - pre && suf < m - pre && a[n - 1 - suf] == b[m - 1 - suf])
+    {
+        suf++;
+    }
+    if (pre == n)
+    {
+        for (i = pre; i < m - suf; i++)
+        {
+            ops[(*nops)++] = 'I';
+        }
+    }
+    else if (pre == m)
+    {
+        for (i = pre; i < n - suf; i++)
+        {
+            ops[(*nops)++] = 'D';
+        }
+    }
+    else
+    {
+        diff_bisect(a + pre, n - pre - suf, b + pre, m - pre - suf, ops, nops);
+    }
+    for (i = 0; i < suf; i++)
+    {
+        ops[(*nops)++] = 'E';
+    }
+}
+
+/* ---------- Change Gutter ---------- */
+/*
+    The line-number gutter marks lines added ('+'), modified ('~') or
+    followed by a deletion ('-') relative to the file's last committed
+    version (git show HEAD:file), or the on-disk copy outside git. The main
+    thread keeps one hash per buffer line, refreshing only changed lines, and
+    hands a snapshot of the hashes to a worker thread that diffs them against
+    the baseline's hashes.
+*/
+static unsigned long gutter_hash(const char *s)
+{
+    unsigned long h = 2166136261UL;
+    for (; *s; s++)
+    {
+        h = ((h ^ (unsigned char)*s) * 16777619UL) & 0xffffffffUL;
+    }
+    return h;
+}
+
+void gutter_invalidate(int first, int last)
+{
+    int i;
+    if (last == LINES_TO_END)
+    {
+        if (first < gutter_stale_from)
+        {
+            gutter_stale_from = first < 0 ? 0 : first;
+        }
+    }
+    else
+    {
+        for (i = first; i <= last && i < MAX_LINES; i++)
+        {
+            gutter_line_stale[i] = 1;
+        }
+    }
+    gutter_buffer_changed = 1;
+}
+
+/* Reads the baseline version of 'path' into an array of line hashes. */
+static unsigned long *gutter_load_baseline(const char *path, int *count)
+{
+    char cmd[PATH_MAX * 2 + 64], dir[PATH_MAX], line[MAX_COLS];
+    const char *slash = strrchr(path, '/');
+    unsigned long *hashes = NULL;
+    int n = 0, cap = 0, from_git = 0;
+    FILE *fp = NULL;
+
+    if (!strchr(path, '\'') && strlen(path) < PATH_MAX)
+    {
+        if (slash)
+        {
+            memcpy(dir, path, (size_t)(slash - path));
+            dir[slash - path] = '\0';
+        }
+        else
+        {
+            strcpy(dir, ".");
+        }
+        snprintf(cmd, sizeof(cmd), "git -C '%s' show 'HEAD:./%s' 2>/dev/null", dir[0] ? dir : "/",
+                 slash ? slash + 1 : path);
+        fp = popen(cmd, "r");
+        from_git = (fp != NULL);
+    }
+    while (1)
+    {
+        while (fp && fgets(line, sizeof(line), fp))
+        {
+            size_t ln = strlen(line);
+            if (ln > 0 && line[ln - 1] == '\n')
+            {
+                line[ln - 1] = '\0';
+            }
+            if (n == cap)
+            {
+                cap = cap ? cap * 2 : 256;
+                hashes = (unsigned long *)realloc(hashes, sizeof(unsigned long) * cap);
+            }
+            hashes[n++] = gutter_hash(line);
+        }
+        if (from_git)
+        {
+            /* Not tracked (or not a repository): fall back to the saved copy. */
+            if (pclose(fp) == 0)
+            {
+                break;
+            }
+            from_git = 0;
+            n = 0;
+            fp = fopen(path, "r");
+            continue;
+        }
+        if (fp)
+        {
+            fclose(fp);
+        }
+        break;
+    }
+    *count = n;
+    return hashes;
+}
+
+/* Turns an edit script (E/D/I per line, in order) into gutter marks for b[0..m); 'room' lines exist after b. */
+static void gutter_marks_from_script(const char *ops, int nops, int m, int room, char *marks)
+{
+    int i = 0, y = 0;
+    while (i < nops)
+    {
+        int dels = 0, ins = 0, first_y = y;
+        if (ops[i] == 'E')
+        {
+            i++;
+            y++;
+            continue;
+        }
+        for (; i < nops && ops[i] != 'E'; i++)
+        {
+            if (ops[i] == 'D')
+            {
+                dels++;
+            }
+            else
+            {
+                ins++;
+                y++;
+            }
+        }
+        {
+            int j;
+            for (j = 0; j < ins; j++)
+            {
+                marks[first_y + j] = j < dels ? '~' : '+';
+            }
+        }
+        if (dels > ins)
+        {
+            /* Deleted lines are flagged on the line that now follows them. */
+            if (y < m + room)
+            {
+                marks[y] = marks[y] ? marks[y] : '-';
+            }
+            else if (y > 0)
+            {
+                marks[y - 1] = marks[y - 1] ? marks[y - 1] : '-';
+            }
+        }
+    }
+}
+
+/* Diffs a[0..n) against b[0..m) and fills the gutter marks for b. */
+static void gutter_diff(const unsigned long *a, int n, const unsigned long *b, int m, int room, char *marks)
+{
+    int nops = 0;
+    char *ops;
+    if (n + m == 0)
+    {
+        return;
+    }
+    ops = (char *)malloc((size_t)(n + m));
+    diff_lines(a, n, b, m, ops, &nops);
+    gutter_marks_from_script(ops, nops, m, room, marks);
+    free(ops);
+}
+
+static void *gutter_worker(void *arg)
+{
+    unsigned long *base = NULL, *buf = NULL;
+    int base_n = 0;
+    char path[PROMPT_BUFFER_SIZE];
+    (void)arg;
+    prof_thread_name("gutter");
+    pthread_mutex_lock(&gutter_lock);
+    while (1)
+    {
+        int gen, buf_n, reload, pre = 0, suf = 0;
+        static char marks[MAX_LINES];
+        while (gutter_request_gen == gutter_done_gen)
+        {
+            pthread_cond_wait(&gutter_cond, &gutter_lock);
+        }
+        gen = gutter_request_gen;
+        reload = gutter_reload_baseline;
+        gutter_reload_baseline = 0;
+        strcpy(path, gutter_request_path);
+        buf_n = gutter_request_count;
+        buf = (unsigned long *)realloc(buf, sizeof(unsigned long) * (size_t)(buf_n + 1));
+        memcpy(buf, gutter_request_hashes, sizeof(unsigned long) * (size_t)buf_n);
+        pthread_mutex_unlock(&gutter_lock);
+        PROF_BEGIN(PROF_GUTTER);
+
+        if (reload)
+        {
+            free(base);
+            base = path[0] ? gutter_load_baseline(path, &base_n) : NULL;
+            if (!base)
+            {
+                base_n = 0;
+            }
+        }
+        memset(marks, 0, sizeof(marks));
+        if (path[0])
+        {
+            /* Only the region between the common prefix and suffix needs the diff. */
+            while (pre < base_n && pre < buf_n && base[pre] == buf[pre])
+            {
+                pre++;
+            }
+            while (suf < base_n - pre && suf < buf_n - pre && base[base_n - 1 - suf] == buf[buf_n - 1 - suf])
+            {
+                suf++;
+            }
+            gutter_diff(base + pre, base_n - pre - suf, buf + pre, buf_n - pre - suf, suf, marks + pre);
+        }
+
+        PROF_END(PROF_GUTTER);
+        pthread_mutex_lock(&gutter_lock);
+        gutter_done_gen = gen;
+        if (gen == gutter_request_gen)
+        {
+            memcpy(gutter_result, marks, sizeof(marks));
+            gutter_result_gen = gen;
+            event_wake();
+        }
+    }
+    return NULL;
+}
+
+/* Sends a new snapshot to the worker when the buffer changed; picks up finished results. */
+void gutter_poll(void)
+{
+    int i;
+    if (!gutter_started)
+    {
+        if (pthread_create(&gutter_thread, NULL, gutter_worker, NULL) != 0)
+        {
+            return;
+        }
+        pthread_detach(gutter_thread);
+        gutter_started = 1;
+    }
+    if (gutter_buffer_changed || gutter_baseline_changed)
+    {
+        for (i = 0; i < gutter_stale_from && i < editor.num_lines; i++)
+        {
+            if (gutter_line_stale[i])
+            {
+                gutter_line_stale[i] = 0;
+                gutter_line_hash[i] = gutter_hash(editor.text[i]);
+            }
+        }
+        for (i = gutter_stale_from; i < editor.num_lines; i++)
+        {
+            gutter_line_stale[i] = 0;
+            gutter_line_hash[i] = gutter_hash(editor.text[i]);
+        }
+        gutter_stale_from = MAX_LINES;
+        pthread_mutex_lock(&gutter_lock);
+        memcpy(gutter_request_hashes, gutter_line_hash, sizeof(unsigned long) * (size_t)editor.num_lines);
+        gutter_request_count = editor.num_lines;
+        if (gutter_baseline_changed)
+        {
+            snprintf(gutter_request_path, sizeof(gutter_request_path), "%s", current_file);
+            gutter_reload_baseline = 1;
+        }
+        gutter_request_gen++;
+        pthread_cond_signal(&gutter_cond);
+        pthread_mutex_unlock(&gutter_lock);
+        gutter_buffer_changed = 0;
+        gutter_baseline_changed = 0;
+    }
+    pthread_mutex_lock(&gutter_lock);
+    if (gutter_result_gen != gutter_shown_gen)
+    {
+        for (i = 0; i < MAX_LINES; i++)
+        {
+            if (gutter_marks[i] != gutter_result[i])
+            {
+                minimap_block_changes[i / MINIMAP_BLOCK_LINES] += (gutter_result[i] != 0) - (gutter_marks[i] != 0);
+                gutter_marks[i] = gutter_result[i];
+                editor_mark_line_dirty(i);
+            }
+        }
+        gutter_shown_gen = gutter_result_gen;
+    }
+    pthread_mutex_unlock(&gutter_lock);
+}
+
+/* ---------- Diff Against Saved ---------- */
+/* F8: list what changed since the last save in the shell panel. */
+void editor_diff_saved(void)
+{
+    char line[MAX_COLS];
+    char **saved = NULL;
+    unsigned long *saved_hash = NULL;
+    int n = 0, cap = 0, nops = 0, i, x = 0, y = 0, added = 0, removed = 0, last_shown = -2;
+    char *ops;
+    FILE *fp;
+
+    if (!current_file[0] || (fp = fopen(current_file, "r")) == NULL)
+    {
+        editor_set_status_message("No saved copy to compare against.");
+        return;
+    }
+    while (fgets(line, sizeof(line), fp))
+    {
+        size_t ln = strlen(line);
+        if (ln > 0 && line[ln - 1] == '\n')
+        {
+            line[ln - 1] = '\0';
+        }
+        if (n == cap)
+        {
+            cap = cap ? cap * 2 : 256;
+            saved = (char **)realloc(saved, sizeof(char *) * cap);
+            saved_hash = (unsigned long *)realloc(saved_hash, sizeof(unsigned long) * cap);
+        }
+        saved[n] = (char *)malloc(strlen(line) + 1);
+        strcpy(saved[n], line);
+        saved_hash[n] = gutter_hash(line);
+        n++;
+    }
+    fclose(fp);
+
+    /* The gutter already keeps the buffer's line hashes current. */
+    gutter_poll();
+    ops = (char *)malloc((size_t)(n + editor.num_lines) + 1);
+    diff_lines(saved_hash, n, gutter_line_hash, editor.num_lines, ops, &nops);
+
+    shell_panel_clear();
+    shell_panel_emit("");
+    for (i = 0; i < nops; i++)
+    {
+        if (ops[i] == 'E')
+        {
+            x++;
+            y++;
+            continue;
+        }
+        if (i != last_shown + 1)
+        {
+            shell_panel_emit("@@ line %d @@", y + 1);
+        }
+        last_shown = i;
+        if (ops[i] == 'D')
+        {
+            shell_panel_emit("-%s", saved[x++]);
+            removed++;
+        }
+        else
+        {
+            shell_panel_emit("+%s", editor.text[y++]);
+            added++;
+        }
+    }
+    snprintf(shell_output[0], MAX_COLS, "Changes since last save: %d added, %d removed%s", added, removed,
+             shell_output_count >= SHELL_PANEL_LINES ? " (truncated)" : "");
+    for (i = 0; i < n; i++)
+    {
+        free(saved[i]);
+    }
+    free(saved);
+    free(saved_hash);
+    free(ops);
+    shell_panel_open = 1;
+    editor_mark_all_lines_dirty();
+}
+
+/* ---------- Search & Replace ---------- */
+void init_search_color(void)
+{
+    if (!search_color_pair_defined)
+    {
+        short color_num = 250;
+        if (can_change_color())
+        {
+            init_color(color_num, 1000, 1000, 0);
+        }
+        init_pair(SEARCH_COLOR_PAIR, COLOR_BLACK, color_num);
+        search_color_pair_defined = 1;
+    }
+}
+
+void editor_search(void)
+{
+    char term[PROMPT_BUFFER_SIZE];
+    editor_prompt("Search term: ", term, sizeof(term));
+    if (!term[0])
+    {
+        g_searchActive = 0;
+        g_searchTerm[0] = '\0';
+        return;
+    }
+    strncpy(g_searchTerm, term, sizeof(g_searchTerm) - 1);
+    g_searchTerm[sizeof(g_searchTerm) - 1] = '\0';
+    g_searchActive = 1;
+    editor_mark_all_lines_dirty();
+}
+
+/*
+    Replaces every occurrence of 'oldstr' with 'newstr' in every line; returns the number of lines changed.
+    A line that would grow past MAX_COLS - 1 is cut there, like an over-long line on load.
+*/
+int editor_replace_all_with(const char *oldstr, const char *newstr)
+{
+    int changed = 0;
+    size_t oldlen = strlen(oldstr), newlen = strlen(newstr);
+    if (oldlen == 0)
+    {
+        return 0;
+    }
+    {
+        int i;
+        for (i = 0; i < editor.num_lines; i++)
+        {
+            char *line = editor.text[i];
+            char buffer[MAX_COLS];
+            size_t outlen = 0;
+            const char *start = line;
+            if (!strstr(line, oldstr))
+            {
+                continue;
+            }
+            while (outlen < MAX_COLS - 1)
+            {
+                const char *pos = strstr(start, oldstr);
+                size_t seg_len = pos ? (size_t)(pos - start) : strlen(start);
+                if (seg_len > MAX_COLS - 1 - outlen)
+                {
+                    seg_len = MAX_COLS - 1 - outlen;
+                }
+                memcpy(buffer + outlen, start, seg_len);
+                outlen += seg_len;
+                if (!pos)
+                {
+                    break;
+                }
+                seg_len = newlen < MAX_COLS - 1 - outlen ? newlen : MAX_COLS - 1 - outlen;
+                memcpy(buffer + outlen, newstr, seg_len);
+                outlen += seg_len;
+                start = pos + oldlen;
+            }
+            buffer[outlen] = '\0';
+            memcpy(line, buffer, outlen + 1);
+            if (i == editor.cursor_y && editor.cursor_x > (int)outlen)
+            {
+                editor.cursor_x = (int)outlen;
+            }
+            editor_mark_line_dirty(i);
+            editor_content_changed(i, i);
+            changed++;
+        }
+    }
+    if (changed)
+    {
+        dirty = 1;
+    }
+    return changed;
+}
+
+void editor_replace_all(void)
+{
+    char oldstr[PROMPT_BUFFER_SIZE], newstr[PROMPT_BUFFER_SIZE];
+    editor_prompt("Old text: ", oldstr, sizeof(oldstr));
+    if (!oldstr[0])
+    {
+        return;
+    }
+    editor_prompt("New text: ", newstr, sizeof(newstr));
+    editor_replace_all_with(oldstr, newstr);
+    dirty = 1;
+}
+
+/* Moves the cursor to the next occurrence of 'term' after the cursor; returns 0 if found. */
+int editor_find_next(const char *term)
+{
+    int y;
+    for (y = editor.cursor_y; y < editor.num_lines; y++)
+    {
+        const char *from = editor.text[y];
+        const char *hit;
+        if (y == editor.cursor_y)
+        {
+            int len = (int)strlen(from);
+            from += (editor.cursor_x + 1 <= len) ? editor.cursor_x + 1 : len;
+        }
+        hit = strstr(from, term);
+        if (hit)
+        {
+            fold_reveal(y);
+            editor.cursor_y = y;
+            editor.cursor_x = (int)(hit - editor.text[y]);
+            editor_mark_all_lines_dirty();
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* ---------- Overview Ruler ---------- */
+void minimap_invalidate(int first, int last)
+{
+    int i;
+    if (last == LINES_TO_END)
+    {
+        if (first < minimap_stale_from)
+        {
+            minimap_stale_from = first;
+        }
+        return;
+    }
+    for (i = first; i <= last && i < MAX_LINES; i++)
+    {
+        minimap_line_stale[i] = 1;
+    }
+}
+
+static int minimap_count_matches(const char *line)
+{
+    int count = 0;
+    size_t tlen = strlen(minimap_term);
+    const char *p = line;
+    if (tlen == 0)
+    {
+        return 0;
+    }
+    while ((p = strstr(p, minimap_term)) != NULL)
+    {
+        count++;
+        p += tlen;
+    }
+    return count;
+}
+
+static void minimap_set_line(int line, int matches)
+{
+    minimap_block_matches[line / MINIMAP_BLOCK_LINES] += matches - minimap_line_matches[line];
+    minimap_line_matches[line] = matches;
+}
+
+/* Recounts only the lines that changed since the last frame (everything when the search term changed). */
+static void minimap_refresh(void)
+{
+    const char *term = g_searchActive ? g_searchTerm : "";
+    int i, end;
+    if (strcmp(term, minimap_term) != 0)
+    {
+        snprintf(minimap_term, sizeof(minimap_term), "%s", term);
+        minimap_stale_from = 0;
+    }
+    for (i = 0; i < minimap_stale_from && i < editor.num_lines; i++)
+    {
+        if (minimap_line_stale[i])
+        {
+            minimap_line_stale[i] = 0;
+            minimap_set_line(i, minimap_count_matches(editor.text[i]));
+        }
+    }
+    end = editor.num_lines > minimap_counted_lines ? editor.num_lines : minimap_counted_lines;
+    for (i = minimap_stale_from; i < end; i++)
+    {
+        minimap_line_stale[i] = 0;
+        minimap_set_line(i, i < editor.num_lines ? minimap_count_matches(editor.text[i]) : 0);
+    }
+    minimap_stale_from = MAX_LINES;
+    minimap_counted_lines = editor.num_lines;
+}
+
+/* Totals over lines first..last: whole blocks come from the block sums, the ragged ends line by line. */
+static void minimap_range(int first, int last, int *matches, int *changes)
+{
+    int i = first;
+    *matches = 0;
+    *changes = 0;
+    while (i <= last)
+    {
+        if (i % MINIMAP_BLOCK_LINES == 0 && i + MINIMAP_BLOCK_LINES - 1 <= last)
+        {
+            *matches += minimap_block_matches[i / MINIMAP_BLOCK_LINES];
+            *changes += minimap_block_changes[i / MINIMAP_BLOCK_LINES];
+            i += MINIMAP_BLOCK_LINES;
+        }
+        else
+        {
+            *matches += minimap_line_matches[i];
+            *changes += gutter_marks[i] != 0;
+            i++;
+        }
+    }
+}
+
+/* First line covered by ruler row 'row'; files shorter than the window map one line per row. */
+static int minimap_row_line(int row, int text_rows)
+{
+    int span = editor.num_lines > text_rows ? editor.num_lines : text_rows;
+    return (int)((long)row * span / text_rows);
+}
+
+static void minimap_draw(int text_rows, int cols)
+{
+    int row, top = editor.row_offset;
+    int bottom = fold_line_at_rank(fold_rank(editor.row_offset) + text_rows - 1);
+    if (bottom >= editor.num_lines)
+    {
+        bottom = editor.num_lines - 1;
+    }
+    minimap_refresh();
+    for (row = 0; row < text_rows; row++)
+    {
+        int first = minimap_row_line(row, text_rows);
+        int last = minimap_row_line(row + 1, text_rows) - 1;
+        int matches = 0, changes = 0, in_view;
+        chtype cell = ' ';
+        if (last < first)
+        {
+            last = first;
+        }
+        if (last >= editor.num_lines)
+        {
+            last = editor.num_lines - 1;
+        }
+        if (first < editor.num_lines)
+        {
+            minimap_range(first, last, &matches, &changes);
+        }
+        in_view = first < editor.num_lines && first <= bottom && last >= top;
+        if (matches > 0)
+        {
+            init_search_color();
+            cell = (matches >= 4 ? '#' : matches >= 2 ? '=' : '-') | COLOR_PAIR(SEARCH_COLOR_PAIR);
+        }
+        else if (changes > 0)
+        {
+            cell = '~';
+        }
+        scr_put(row, cols - 1, cell | (in_view ? A_REVERSE : 0));
+    }
+}
+
+/* Mouse click on the ruler: jump to the lines that row summarises. */
+static void minimap_jump(int row, int text_rows)
+{
+    int line = minimap_row_line(row, text_rows);
+    if (line >= editor.num_lines)
+    {
+        line = editor.num_lines - 1;
+    }
+    fold_reveal(line);
+    editor.cursor_y = line;
+    editor.cursor_x = 0;
+    editor_mark_all_lines_dirty();
+}
+
+/* F9: show/hide the overview ruler. */
+void minimap_toggle(void)
+{
+    minimap_visible = !minimap_visible;
+    editor_mark_all_lines_dirty();
+}
+
+/* ---------- Selection & Clipboard ---------- */
+static void selection_bounds(int *y0, int *x0, int *y1, int *x1)
+{
+    int ay = selection_anchor_y, ax = selection_anchor_x;
+    int cy = editor.cursor_y, cx = editor.cursor_x;
+    if (ay >= editor.num_lines)
+    {
+        ay = editor.num_lines - 1;
+    }
+    if (selection_mode == SELECTION_RECT)
+    {
+        *y0 = ay < cy ? ay : cy;
+        *y1 = ay < cy ? cy : ay;
+        *x0 = ax < cx ? ax : cx;
+        *x1 = ax < cx ? cx : ax;
+        return;
+    }
+    if (ay < cy || (ay == cy && ax <= cx))
+    {
+        *y0 = ay; *x0 = ax; *y1 = cy; *x1 = cx;
+    }
+    else
+    {
+        *y0 = cy; *x0 = cx; *y1 = ay; *x1 = ax;
+    }
+}
+
+/* End column is exclusive for both stream and rectangular selections. */
+static int selection_contains(int y, int x)
+{
+    int y0, x0, y1, x1;
+    if (selection_mode == SELECTION_NONE)
+    {
+        return 0;
+    }
+    selection_bounds(&y0, &x0, &y1, &x1);
+    if (y < y0 || y > y1)
+    {
+        return 0;
+    }
+    if (selection_mode == SELECTION_RECT)
+    {
+        return x >= x0 && x < x1;
+    }
+    if (y == y0 && x < x0)
+    {
+        return 0;
+    }
+    if (y == y1 && x >= x1)
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/* Repaint only the rows whose selection state may have changed since the last frame. */
+static void selection_mark_dirty(void)
+{
+    static int last_y0 = -1, last_y1 = -1;
+    int y0 = -1, x0, y1 = -1, x1, i;
+    if (selection_mode != SELECTION_NONE)
+    {
+        selection_bounds(&y0, &x0, &y1, &x1);
+    }
+    if (y0 == last_y0 && y1 == last_y1 && selection_mode != SELECTION_RECT)
+    {
+        return;
+    }
+    for (i = last_y0; i >= 0 && i <= last_y1; i++)
+    {
+        editor_mark_line_dirty(i);
+    }
+    for (i = y0; i >= 0 && i <= y1; i++)
+    {
+        editor_mark_line_dirty(i);
+    }
+    last_y0 = y0;
+    last_y1 = y1;
+}
+
+void editor_selection_toggle(int mode)
+{
+    if (selection_mode == mode)
+    {
+        selection_mode = SELECTION_NONE;
+        editor_set_status_message("Selection cleared.");
+        return;
+    }
+    selection_mode = mode;
+    selection_anchor_x = editor.cursor_x;
+    selection_anchor_y = editor.cursor_y;
+    editor_set_status_message(mode == SELECTION_RECT ? "Rectangle mark set." : "Mark set.");
+}
+
+static void clipboard_clear(void)
+{
+    int i;
+    for (i = 0; i < clipboard.count; i++)
+    {
+        free(clipboard.lines[i]);
+    }
+    free(clipboard.lines);
+    clipboard.lines = NULL;
+    clipboard.count = 0;
+    clipboard.rectangular = 0;
+}
+
+static char *clipboard_slice(const char *line, int from, int to)
+{
+    int len = (int)strlen(line);
+    char *out;
+    if (to > len)
+    {
+        to = len;
+    }
+    if (from > to)
+    {
+        from = to;
+    }
+    out = (char *)malloc((size_t)(to - from) + 1);
+    if (!out)
+    {
+        return NULL;
+    }
+    memcpy(out, line + from, (size_t)(to - from));
+    out[to - from] = '\0';
+    return out;
+}
+
+/* Copies the selection to the clipboard; returns 0 if there is none or memory ran out. */
+int editor_copy_selection(void)
+{
+    int y0, x0, y1, x1, y;
+    if (selection_mode == SELECTION_NONE)
+    {
+        editor_set_status_message("No selection.");
+        return 0;
+    }
+    selection_bounds(&y0, &x0, &y1, &x1);
+    clipboard_clear();
+    clipboard.lines = (char **)malloc(sizeof(char *) * (size_t)(y1 - y0 + 1));
+    if (!clipboard.lines)
+    {
+        editor_set_status_message("Out of memory: nothing copied.");
+        return 0;
+    }
+    clipboard.rectangular = (selection_mode == SELECTION_RECT);
+    for (y = y0; y <= y1; y++)
+    {
+        int from = 0, to = MAX_COLS;
+        if (clipboard.rectangular)
+        {
+            from = x0;
+            to = x1;
+        }
+        else
+        {
+            if (y == y0)
+            {
+                from = x0;
+            }
+            if (y == y1)
+            {
+                to = x1;
+            }
+        }
+        clipboard.lines[clipboard.count] = clipboard_slice(editor.text[y], from, to);
+        if (!clipboard.lines[clipboard.count])
+        {
+            clipboard_clear();
+            editor_set_status_message("Out of memory: nothing copied.");
+            return 0;
+        }
+        clipboard.count++;
+    }
+    editor_set_status_message("Copied %d line(s).", clipboard.count);
+    return 1;
+}
+
+/* Removes the selected text without touching the undo stack. */
+static void editor_delete_selection(void)
+{
+    int y0, x0, y1, x1, y;
+    selection_bounds(&y0, &x0, &y1, &x1);
+    if (selection_mode == SELECTION_RECT)
+    {
+        for (y = y0; y <= y1; y++)
+        {
+            char *line = editor.text[y];
+            int len = (int)strlen(line);
+            if (x0 < len)
+            {
+                int end = x1 < len ? x1 : len;
+                memmove(line + x0, line + end, (size_t)(len - end) + 1);
+            }
+        }
+        editor_content_changed(y0, y1);
+        editor.cursor_y = y0;
+        editor.cursor_x = x0;
+    }
+    else
+    {
+        char *first = editor.text[y0];
+        const char *last = editor.text[y1];
+        int last_len = (int)strlen(last);
+        int tail = x1 < last_len ? x1 : last_len;
+        int tail_len = last_len - tail;
+        if ((int)strlen(first) < x0)
+        {
+            x0 = (int)strlen(first);
+        }
+        if (x0 + tail_len > MAX_COLS - 1)
+        {
+            tail_len = MAX_COLS - 1 - x0;
+        }
+        /* 'last' may be 'first' itself, so move rather than concatenate. */
+        memmove(first + x0, last + tail, (size_t)tail_len);
+        first[x0 + tail_len] = '\0';
+        /* Close the gap with a single block move. */
+        if (y1 > y0)
+        {
+            memmove(editor.text[y0 + 1], editor.text[y1 + 1],
+                    (size_t)(editor.num_lines - y1 - 1) * MAX_COLS);
+            editor.num_lines -= (y1 - y0);
+        }
+        editor_content_changed(y0, y1 > y0 ? LINES_TO_END : y0);
+        editor.cursor_y = y0;
+        editor.cursor_x = x0;
+    }
+    selection_mode = SELECTION_NONE;
+    editor_mark_all_lines_dirty();
+}
+
+void editor_cut_selection(void)
+{
+    if (selection_mode == SELECTION_NONE)
+    {
+        editor_set_status_message("No selection.");
+        return;
+    }
+    if (!editor_copy_selection())
+    {
+        return;
+    }
+    save_state_undo();
+    editor_delete_selection();
+}
+
+/* Inserts 'text' into 'line' at column x, padding with spaces if the line is shorter. */
+static void clipboard_insert_into_line(char *line, int x, const char *text)
+{
+    int len = (int)strlen(line);
+    int tlen = (int)strlen(text);
+    while (len < x && len < MAX_COLS - 1)
+    {
+        line[len++] = ' ';
+        line[len] = '\0';
+    }
+    if (x > len)
+    {
+        return;
+    }
+    if (len + tlen > MAX_COLS - 1)
+    {
+        tlen = MAX_COLS - 1 - len;
+    }
+    memmove(line + x + tlen, line + x, (size_t)(len - x) + 1);
+    memcpy(line + x, text, (size_t)tlen);
+}
+
+void editor_paste(void)
+{
+    int i, paste_y;
+    if (clipboard.count == 0)
+    {
+        editor_set_status_message("Clipboard is empty.");
+        return;
+    }
+    /* The whole paste (including replacing a selection) is one undo entry. */
+    save_state_undo();
+    if (selection_mode != SELECTION_NONE)
+    {
+        editor_delete_selection();
+    }
+    paste_y = editor.cursor_y;
+    if (clipboard.rectangular)
+    {
+        for (i = 0; i < clipboard.count; i++)
+        {
+            int y = editor.cursor_y + i;
+            if (y >= MAX_LINES)
+            {
+                break;
+            }
+            if (y >= editor.num_lines)
+            {
+                editor.text[y][0] = '\0';
+                editor.num_lines = y + 1;
+            }
+            clipboard_insert_into_line(editor.text[y], editor.cursor_x, clipboard.lines[i]);
+        }
+    }
+    else if (clipboard.count == 1)
+    {
+        clipboard_insert_into_line(editor.text[editor.cursor_y], editor.cursor_x, clipboard.lines[0]);
+        editor.cursor_x += (int)strlen(clipboard.lines[0]);
+        if (editor.cursor_x > MAX_COLS - 1)
+        {
+            editor.cursor_x = MAX_COLS - 1;
+        }
+    }
+    else
+    {
+        char tail[MAX_COLS];
+        int y = editor.cursor_y;
+        int extra = clipboard.count - 1;
+        if (editor.num_lines + extra > MAX_LINES)
+        {
+            extra = MAX_LINES - editor.num_lines;
+        }
+        strcpy(tail, editor.text[y] + editor.cursor_x);
+        editor.text[y][editor.cursor_x] = '\0';
+        strncat(editor.text[y], clipboard.lines[0], MAX_COLS - strlen(editor.text[y]) - 1);
+        /* Open room for all pasted lines with a single block move. */
+        memmove(editor.text[y + 1 + extra], editor.text[y + 1],
+                (size_t)(editor.num_lines - y - 1) * MAX_COLS);
+        for (i = 1; i <= extra; i++)
+        {
+            strncpy(editor.text[y + i], clipboard.lines[i], MAX_COLS - 1);
+            editor.text[y + i][MAX_COLS - 1] = '\0';
+        }
+        editor.num_lines += extra;
+        editor.cursor_y = y + extra;
+        editor.cursor_x = (int)strlen(editor.text[editor.cursor_y]);
+        strncat(editor.text[editor.cursor_y], tail, MAX_COLS - strlen(editor.text[editor.cursor_y]) - 1);
+    }
+    editor_content_changed(paste_y, (clipboard.count == 1 && !clipboard.rectangular) ? paste_y : LINES_TO_END);
+    editor_mark_all_lines_dirty();
+}
+
+/* ---------- Bracket Matching ---------- */
+/*
+    Each line is summarised per bracket kind by its net depth change, the
+    lowest running depth reading left-to-right (min_prefix) and the lowest
+    running "closers minus openers" reading right-to-left (min_suffix). A
+    segment tree over those summaries finds the line holding a partner in
+    O(log n); edits only invalidate leaves, which are refreshed on the next
+    query.
+*/
+static const char bracket_open_chars[BRACKET_KINDS] = {'(', '[', '{'};
+static const char bracket_close_chars[BRACKET_KINDS] = {')', ']', '}'};
+
+static void bracket_summarise(const char *line, int kind, BracketSummary *out)
+{
+    int d = 0, e = 0, i, len = (int)strlen(line);
+    out->net = 0;
+    out->min_prefix = 0;
+    out->min_suffix = 0;
+    for (i = 0; i < len; i++)
+    {
+        if (line[i] == bracket_open_chars[kind])
+        {
+            d++;
+        }
+        else if (line[i] == bracket_close_chars[kind])
+        {
+            d--;
+            if (d < out->min_prefix)
+            {
+                out->min_prefix = d;
+            }
+        }
+    }
+    for (i = len - 1; i >= 0; i--)
+    {
+        if (line[i] == bracket_close_chars[kind])
+        {
+            e++;
+        }
+        else if (line[i] == bracket_open_chars[kind])
+        {
+            e--;
+            if (e < out->min_suffix)
+            {
+                out->min_suffix = e;
+            }
+        }
+    }
+    out->net = d;
+}
+
+static void bracket_combine(BracketSummary *out, const BracketSummary *l, const BracketSummary *r)
+{
+    int via_left = l->net + r->min_prefix;
+    int via_right = -r->net + l->min_suffix;
+    out->net = l->net + r->net;
+    out->min_prefix = l->min_prefix < via_left ? l->min_prefix : via_left;
+    out->min_suffix = r->min_suffix < via_right ? r->min_suffix : via_right;
+}
+
+void bracket_index_invalidate(int first, int last)
+{
+    int i;
+    if (last == LINES_TO_END)
+    {
+        if (first < bracket_stale_from)
+        {
+            bracket_stale_from = first < 0 ? 0 : first;
+        }
+        return;
+    }
+    for (i = first; i <= last && i < MAX_LINES; i++)
+    {
+        bracket_leaf_stale[i] = 1;
+    }
+}
+
+/* Brings the tree up to date: single leaves are patched, a stale tail is rebuilt bottom-up. */
+static void bracket_index_refresh(void)
+{
+    int k, i;
+    for (i = 0; i < bracket_stale_from && i < MAX_LINES; i++)
+    {
+        if (bracket_leaf_stale[i])
+        {
+            bracket_leaf_stale[i] = 0;
+            for (k = 0; k < BRACKET_KINDS; k++)
+            {
+                int node = BRACKET_TREE_LEAVES + i;
+                bracket_summarise(editor.text[i], k, &bracket_tree[k][node]);
+                for (node /= 2; node >= 1; node /= 2)
+                {
+                    bracket_combine(&bracket_tree[k][node], &bracket_tree[k][2 * node], &bracket_tree[k][2 * node + 1]);
+                }
+            }
+        }
+    }
+    if (bracket_stale_from >= MAX_LINES)
+    {
+        return;
+    }
+    for (k = 0; k < BRACKET_KINDS; k++)
+    {
+        int lo = BRACKET_TREE_LEAVES + bracket_stale_from, hi = BRACKET_TREE_LEAVES + MAX_LINES - 1;
+        for (i = bracket_stale_from; i < MAX_LINES; i++)
+        {
+            BracketSummary *leaf = &bracket_tree[k][BRACKET_TREE_LEAVES + i];
+            if (i < editor.num_lines)
+            {
+                bracket_summarise(editor.text[i], k, leaf);
+            }
+            else
+            {
+                leaf->net = leaf->min_prefix = leaf->min_suffix = 0;
+            }
+        }
+        for (lo /= 2, hi /= 2; lo >= 1; lo /= 2, hi /= 2)
+        {
+            int node;
+            for (node = lo; node <= hi; node++)
+            {
+                bracket_combine(&bracket_tree[k][node], &bracket_tree[k][2 * node], &bracket_tree[k][2 * node + 1]);
+            }
+        }
+    }
+    for (i = bracket_stale_from; i < MAX_LINES; i++)
+    {
+        bracket_leaf_stale[i] = 0;
+    }
+    bracket_stale_from = MAX_LINES;
+}
+
+/* First line >= 'from' where the running depth (starting at *depth) reaches zero. */
+static int bracket_find_forward(int kind, int node, int lo, int hi, int from, int *depth)
+{
+    const BracketSummary *sum = &bracket_tree[kind][node];
+    int mid = (lo + hi) / 2, found;
+    if (hi < from)
+    {
+        return -1;
+    }
+    if (lo >= from && *depth + sum->min_prefix > 0)
+    {
+        *depth += sum->net;
+        return -1;
+    }
+    if (lo == hi)
+    {
+        return lo;
+    }
+    found = bracket_find_forward(kind, 2 * node, lo, mid, from, depth);
+    if (found >= 0)
+    {
+        return found;
+    }
+    return bracket_find_forward(kind, 2 * node + 1, mid + 1, hi, from, depth);
+}
+
+/* Last line <= 'to' where the running closer depth (reading backwards) reaches zero. */
+static int bracket_find_backward(int kind, int node, int lo, int hi, int to, int *depth)
+{
+    const BracketSummary *sum = &bracket_tree[kind][node];
+    int mid = (lo + hi) / 2, found;
+    if (lo > to)
+    {
+        return -1;
+    }
+    if (hi <= to && *depth + sum->min_suffix > 0)
+    {
+        *depth -= sum->net;
+        return -1;
+    }
+    if (lo == hi)
+    {
+        return lo;
+    }
+    found = bracket_find_backward(kind, 2 * node + 1, mid + 1, hi, to, depth);
+    if (found >= 0)
+    {
+        return found;
+    }
+    return bracket_find_backward(kind, 2 * node, lo, mid, to, depth);
+}
+
+/* Finds the partner of the bracket at (y, x); returns 0 and fills in my/mx if there is one. */
+int bracket_find_match(int y, int x, int *my, int *mx)
+{
+    const char *line = editor.text[y];
+    int kind, depth = 1, i, len = (int)strlen(line);
+    char c;
+    if (x < 0 || x >= len)
+    {
+        return -1;
+    }
+    c = line[x];
+    for (kind = 0; kind < BRACKET_KINDS; kind++)
+    {
+        if (c == bracket_open_chars[kind] || c == bracket_close_chars[kind])
+        {
+            break;
+        }
+    }
+    if (kind == BRACKET_KINDS)
+    {
+        return -1;
+    }
+    if (c == bracket_open_chars[kind])
+    {
+        /* Rest of this line first, then let the tree find the line, then scan it. */
+        for (i = x + 1; i < len; i++)
+        {
+            depth += (line[i] == bracket_open_chars[kind]) - (line[i] == bracket_close_chars[kind]);
+            if (depth == 0)
+            {
+                *my = y;
+                *mx = i;
+                return 0;
+            }
+        }
+        bracket_index_refresh();
+        y = bracket_find_forward(kind, 1, 0, BRACKET_TREE_LEAVES - 1, y + 1, &depth);
+        if (y < 0 || y >= editor.num_lines)
+        {
+            return -1;
+        }
+        line = editor.text[y];
+        for (i = 0; line[i]; i++)
+        {
+            depth += (line[i] == bracket_open_chars[kind]) - (line[i] == bracket_close_chars[kind]);
+            if (depth == 0)
+            {
+                *my = y;
+                *mx = i;
+                return 0;
+            }
+        }
+        return -1;
+    }
+    for (i = x - 1; i >= 0; i--)
+    {
+        depth += (line[i] == bracket_close_chars[kind]) - (line[i] == bracket_open_chars[kind]);
+        if (depth == 0)
+        {
+            *my = y;
+            *mx = i;
+            return 0;
+        }
+    }
+    if (y == 0)
+    {
+        return -1;
+    }
+    bracket_index_refresh();
+    y = bracket_find_backward(kind, 1, 0, BRACKET_TREE_LEAVES - 1, y - 1, &depth);
+    if (y < 0)
+    {
+        return -1;
+    }
+    line = editor.text[y];
+    for (i = (int)strlen(line) - 1; i >= 0; i--)
+    {
+        depth += (line[i] == bracket_close_chars[kind]) - (line[i] == bracket_open_chars[kind]);
+        if (depth == 0)
+        {
+            *my = y;
+            *mx = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Updates the highlighted bracket pair for the cursor, repainting only the affected lines. */
+static void bracket_update_highlight(void)
+{
+    int y = editor.cursor_y, x = editor.cursor_x, my = -1, mx = -1;
+    if (bracket_find_match(y, x, &my, &mx) != 0)
+    {
+        /* Also accept a bracket just left of the cursor (after typing it). */
+        x = editor.cursor_x - 1;
+        if (bracket_find_match(y, x, &my, &mx) != 0)
+        {
+            y = x = my = mx = -1;
+        }
+    }
+    if (y == bracket_hl_y && x == bracket_hl_x && my == bracket_match_y && mx == bracket_match_x)
+    {
+        return;
+    }
+    editor_mark_line_dirty(bracket_hl_y);
+    editor_mark_line_dirty(bracket_match_y);
+    bracket_hl_y = y;
+    bracket_hl_x = x;
+    bracket_match_y = my;
+    bracket_match_x = mx;
+    editor_mark_line_dirty(y);
+    editor_mark_line_dirty(my);
+}
+
+/* Ctrl+P: jump to the partner of the bracket under (or just left of) the cursor. */
+void editor_jump_to_bracket(void)
+{
+    int my, mx;
+    if (bracket_find_match(editor.cursor_y, editor.cursor_x, &my, &mx) != 0 &&
+        bracket_find_match(editor.cursor_y, editor.cursor_x - 1, &my, &mx) != 0)
+    {
+        editor_set_status_message("No matching bracket.");
+        return;
+    }
+    fold_reveal(my);
+    editor.cursor_y = my;
+    editor.cursor_x = mx;
+    editor_mark_all_lines_dirty();
+}
+
+/* ---------- Draw line ---------- */
+static void draw_line(int row, int line_idx, int cols)
+{
+    PROF_BEGIN(PROF_DRAW_LINE);
+    scr_clear_to_eol(row, 0);
+
+    char *line = editor.text[line_idx];
+    int len = (int)strlen(line);
+    int j = editor.col_offset;
+
+    /* If line numbers are toggled on, print them. */
+    int start_col = 0;
+    if (show_line_numbers)
+    {
+        /* e.g. "   1 | " uses ~7-8 columns. */
+        scr_print(row, 0, A_NORMAL, "%4d%c| ", line_idx + 1, gutter_marks[line_idx] ? gutter_marks[line_idx] : ' ');
+        start_col = LINE_NUMBER_WIDTH; /* e.g. 8 */
+    }
+
+    int col = start_col;
+
+    while (j < len && col < cols)
+    {
+        /* Selected text and extra cursors are drawn in reverse video and take precedence. */
+        if ((selection_mode != SELECTION_NONE && selection_contains(line_idx, j)) ||
+            (extra_cursor_count > 0 && extra_cursor_at(line_idx, j)))
+        {
+            scr_put(row, col, (chtype)(unsigned char)line[j] | A_REVERSE);
+            col++;
+            j++;
+            continue;
+        }
+
+        /* The bracket at the cursor and its partner are drawn bold and underlined. */
+        if ((line_idx == bracket_hl_y && j == bracket_hl_x) ||
+            (line_idx == bracket_match_y && j == bracket_match_x))
+        {
+            scr_put(row, col, (chtype)(unsigned char)line[j] | A_BOLD | A_UNDERLINE);
+            col++;
+            j++;
+            continue;
+        }
+
+        /* Check if search highlighting applies first. */
+        if (g_searchActive && g_searchTerm[0])
+        {
+            size_t tlen = strlen(g_searchTerm);
+            if (j + (int)tlen <= len && strncmp(&line[j], g_searchTerm, tlen) == 0)
+            {
+                /* Found the search term. */
+                init_search_color();
+                for (size_t k = 0; k < tlen && col < cols; k++, col++)
+                {
+                    scr_put(row, col, (chtype)(unsigned char)line[j + k] | COLOR_PAIR(SEARCH_COLOR_PAIR));
+                }
+                j += (int)tlen;
+                continue;
+            }
+        }
+
+        /* If syntax highlighting is enabled, check for tokens with word-boundary. */
+        if (syntax_enabled && token_lookup_count > 0)
+        {
+            int i = highlight_strategy == HIGHLIGHT_INDEXED ? token_match_indexed(line, j, len)
+                                                            : token_match_linear(line, j, len);
+            if (i >= 0)
+            {
+                int k;
+                for (k = 0; k < token_lookup[i].len && col < cols; k++, col++)
+                {
+                    scr_put(row, col, (chtype)(unsigned char)line[j + k] | COLOR_PAIR(token_lookup[i].color_pair));
+                }
+                j += token_lookup[i].len;
+                continue;
+            }
+        }
+
+        /* No special highlight => just print the char. */
+        scr_put(row, col, (chtype)(unsigned char)line[j]);
+        col++;
+        j++;
+    }
+
+    /* A fold header shows how much is hidden under it. */
+    if (fold_count > 0 && fold_end_of(line_idx) >= 0 && col < cols)
+    {
+        scr_print(row, col, A_DIM, " [+%d lines]", fold_end_of(line_idx) - line_idx);
+    }
+
+    /* An extra cursor at end of line has no character under it. */
+    if (extra_cursor_count > 0 && j == len && col < cols && extra_cursor_at(line_idx, len))
+    {
+        scr_put(row, col, ' ' | A_REVERSE);
+    }
+    PROF_END(PROF_DRAW_LINE);
+}
+
+/* ---------- Status line + partial redraw ---------- */
+void editor_refresh_screen(int frame)
+{
+    int cols = screen_cols;
+    int text_area_rows = viewport_text_rows();
+
+    PROF_BEGIN(PROF_REFRESH);
+    update_viewport();
+    if (frame == FRAME_FULL)
+    {
+        gutter_poll();
+        bracket_update_highlight();
+    }
+    selection_mark_dirty();
+    {
+        int i, line_idx = editor.row_offset;
+        for (i = 0; i < text_area_rows; i++)
+        {
+            if (line_idx >= 0 && line_idx < editor.num_lines)
+            {
+                if (line_dirty[line_idx] && (frame == FRAME_FULL || line_idx == editor.cursor_y))
+                {
+                    draw_line(i, line_idx, cols - minimap_visible);
+                    line_dirty[line_idx] = 0;
+                }
+                line_idx = fold_next_visible(line_idx);
+            }
+            else if (frame == FRAME_FULL)
+            {
+                /* Clear leftover lines if the file is shorter than the window. */
+                scr_clear_to_eol(i, 0);
+            }
+        }
+    }
+
+    if (minimap_visible && frame == FRAME_FULL)
+    {
+        minimap_draw(text_area_rows, cols);
+    }
+
+    /* Status bar on the last line. */
+    {
+        int status_row = text_area_rows;
+        scr_clear_to_eol(status_row, 0);
+        const char *message = editor_current_status_message();
+        if (message)
+        {
+            scr_print(status_row, 0, A_NORMAL, "%s", message);
+        }
+        else if (!show_help)
+        {
+            char status[256];
+            const char *fname = (current_file[0]) ? current_file : "Untitled";
+            snprintf(status, sizeof(status), "[%s] File: %s | Ln: %d, Col: %d%s%s",
+                     CED_VERSION, fname, editor.cursor_y + 1, editor.cursor_x + 1,
+                     (dirty ? " [Modified]" : ""), (macro_recording ? " [REC]" : ""));
+            scr_print(status_row, 0, A_NORMAL, "%s (Press Ctrl+H for help)", status);
+        }
+        else
+        {
+            /* Show key bindings including new QoL shortcuts */
+            scr_print(status_row, 0, A_NORMAL,
+                     "[HELP] Ctrl+Q:Quit  Ctrl+S:Save  Ctrl+O:Open  Ctrl+Z:Undo  Ctrl+Y:Redo  "
+                     "Ctrl+G:Goto  Ctrl+F:Search  Ctrl+R:Replace  Ctrl+W:ShellPanel  Ctrl+E:ShellCmd  "
+                     "Ctrl+H:HideHelp  Ctrl+D:DupLine  Ctrl+K:KillLine  Ctrl+T:ToggleLN  Ctrl+U:Top  Ctrl+L:Bottom  "
+                     "Ctrl+N:Complete  Ctrl+]:GotoDef  Ctrl+P:MatchBracket  Ctrl+B:Mark  Ctrl+A:RectMark  Ctrl+C:Copy  Ctrl+X:Cut  Ctrl+V:Paste  F2:AddCursor  Esc:ClearCursors  "
+                     "F5:RecordMacro  F6:PlayMacro  F7:PlayMacroN  F4:Fold  F3:UnfoldAll  F8:DiffSaved  F9:Minimap  F11:Memory");
+        }
+    }
+
+    if (shell_panel_open && frame == FRAME_FULL)
+    {
+        shell_panel_draw();
+    }
+
+    /* Place cursor where it belongs on screen. */
+    {
+        int scr_y = fold_rank(editor.cursor_y) - fold_rank(editor.row_offset);
+        int scr_x = editor.cursor_x - editor.col_offset + (show_line_numbers ? LINE_NUMBER_WIDTH : 0);
+        if (scr_y >= 0 && scr_y < text_area_rows)
+        {
+            scr_set_cursor(scr_y, scr_x);
+        }
+    }
+    scr_present();
+    PROF_END(PROF_REFRESH);
+}
+
+/* ---------- Render Scheduler ---------- */
+/*
+    Keys already queued (key repeat, a paste, a burst from the terminal) are
+    handled before anything is drawn. While they keep coming, at most one
+    frame per 1000 / MAX_FPS ms is drawn, and only the cursor line and the
+    status bar; the other dirty lines, the gutter diff, the overview ruler
+    and bracket highlighting wait for the full frame that is drawn as soon
+    as the queue is empty. Repaints asked for by background work (shell
+    output, worker results, timers) are held to the same frame rate.
+*/
+static int input_pending(void)
+{
+    int ch = getch(); /* getch() never blocks outside the prompt: timeout(0) */
+    if (ch == ERR)
+    {
+        return 0;
+    }
+    ungetch(ch);
+    return 1;
+}
+
+/* Draws whatever frame is due; returns 1 when a key is already queued (so there is no need to wait). */
+int render_schedule(void)
+{
+    long now = monotonic_ms();
+    long frame_ms = config.max_fps > 0 ? 1000L / config.max_fps : 0;
+    int pending = input_pending();
+    if (pending && frame_ms > 0)
+    {
+        if (now - render_last_frame >= frame_ms)
+        {
+            editor_refresh_screen(FRAME_PRIORITY);
+            render_last_frame = now;
+        }
+        return 1;
+    }
+    if (!pending && !render_after_key && now - render_last_frame < frame_ms)
+    {
+        render_deferred = 1;
+        return 0;
+    }
+    editor_refresh_screen(FRAME_FULL);
+    render_last_frame = now;
+    render_deferred = 0;
+    render_after_key = 0;
+    return pending;
+}
+
+/* ---------- Editor Ops ---------- */
+void editor_insert_char(int ch)
+{
+    char *line = editor.text[editor.cursor_y];
+    int len = (int)strlen(line);
+    int i;
+    if (len >= MAX_COLS - 1)
+    {
+        return;
+    }
+    for (i = len; i >= editor.cursor_x; i--)
+    {
+        line[i + 1] = line[i];
+    }
+    line[editor.cursor_x] = (char)ch;
+    editor.cursor_x++;
+    editor_mark_line_dirty(editor.cursor_y);
+    editor_content_changed(editor.cursor_y, editor.cursor_y);
+}
+
+/* Delete char to the left of the cursor */
+void editor_delete_char(void)
+{
+    if (editor.cursor_x == 0)
+    {
+        if (editor.cursor_y == 0)
+        {
+            return;
+        }
+        else
+        {
+            int prev_len = (int)strlen(editor.text[editor.cursor_y - 1]);
+            if (prev_len + (int)strlen(editor.text[editor.cursor_y]) > MAX_COLS - 1)
+            {
+                editor_set_status_message("Joined line would exceed %d columns.", MAX_COLS - 1);
+                return;
+            }
+            strcat(editor.text[editor.cursor_y - 1], editor.text[editor.cursor_y]);
+            {
+                int i;
+                for (i = editor.cursor_y; i < editor.num_lines - 1; i++)
+                {
+                    strcpy(editor.text[i], editor.text[i + 1]);
+                }
+            }
+            editor.num_lines--;
+            editor.cursor_y--;
+            editor.cursor_x = prev_len;
+            editor_mark_all_lines_dirty();
+            editor_content_changed(editor.cursor_y, LINES_TO_END);
+        }
+    }
+    else
+    {
+        char *line = editor.text[editor.cursor_y];
+        int len = (int)strlen(line);
+        int i;
+        for (i = editor.cursor_x - 1; i < len; i++)
+        {
+            line[i] = line[i + 1];
+        }
+        editor.cursor_x--;
+        editor_mark_line_dirty(editor.cursor_y);
+        editor_content_changed(editor.cursor_y, editor.cursor_y);
+    }
+}
+
+/* Delete char at the cursor */
+void editor_delete_at_cursor(void)
+{
     char *line = editor.text[editor.cursor_y];
     int len = (int)strlen(line);
+    if (editor.cursor_x == len)
+    {
+        /* Join with next line, if any */
+        if (editor.cursor_y == editor.num_lines - 1)
+        {
+            return;
+        }
+        if (len + (int)strlen(editor.text[editor.cursor_y + 1]) > MAX_COLS - 1)
+        {
+            editor_set_status_message("Joined line would exceed %d columns.", MAX_COLS - 1);
+            return;
+        }
+        strcat(line, editor.text[editor.cursor_y + 1]);
+        {
+            int i;
+            for (i = editor.cursor_y + 1; i < editor.num_lines - 1; i++)
+            {
+                strcpy(editor.text[i], editor.text[i + 1]);
+            }
+        }
+        editor.num_lines--;
+        editor_mark_all_lines_dirty();
+        editor_content_changed(editor.cursor_y, LINES_TO_END);
+    }
+    else
+    {
+        int i;
+        for (i = editor.cursor_x; i < len; i++)
+        {
+            line[i] = line[i + 1];
+        }
+        editor_mark_line_dirty(editor.cursor_y);
+        editor_content_changed(editor.cursor_y, editor.cursor_y);
+    }
+}
+
+void editor_insert_newline(void)
+{
+    if (editor.num_lines >= MAX_LINES)
+    {
+        return;
+    }
+    {
+        char *line = editor.text[editor.cursor_y];
+        int len = (int)strlen(line);
+        char remainder[MAX_COLS];
+        strcpy(remainder, line + editor.cursor_x);
+        line[editor.cursor_x] = '\0';
+        {
+            int i;
+            for (i = editor.num_lines; i > editor.cursor_y + 1; i--)
+            {
+                strcpy(editor.text[i], editor.text[i - 1]);
+            }
+        }
+        if (config.auto_indent)
+        {
+            int indent = 0;
+            while (line[indent] == ' ' && indent < MAX_COLS - 1)
+            {
+                indent++;
+            }
+            {
+                char new_line[MAX_COLS];
+                memset(new_line, ' ', indent);
+                new_line[indent] = '\0';
+                strncat(new_line, remainder, MAX_COLS - indent - 1);
+                strcpy(editor.text[editor.cursor_y + 1], new_line);
+            }
+            editor.cursor_x = indent;
+        }
+        else
+        {
+            strcpy(editor.text[editor.cursor_y + 1], remainder);
+            editor.cursor_x = 0;
+        }
+        editor.num_lines++;
+        editor.cursor_y++;
+        editor_mark_all_lines_dirty();
+        editor_content_changed(editor.cursor_y - 1, LINES_TO_END);
+    }
+}
+
+/* ---------- QoL: Duplicate current line (Ctrl+D) ---------- */
+void editor_duplicate_line(void)
+{
+    if (editor.num_lines >= MAX_LINES)
+    {
+        return;
+    }
+    save_state_undo();
+    int y = editor.cursor_y;
+    /* shift lines down from the bottom if needed */
+    for (int i = editor.num_lines; i > y + 1; i--)
+    {
+        strcpy(editor.text[i], editor.text[i - 1]);
+    }
+    strcpy(editor.text[y + 1], editor.text[y]);
+    editor.num_lines++;
+    editor.cursor_y++;
+    editor_mark_all_lines_dirty();
+    editor_content_changed(y, LINES_TO_END);
+}
+
+/* ---------- QoL: Kill (delete) entire current line (Ctrl+K) ---------- */
+void editor_kill_line(void)
+{
+    if (editor.num_lines == 1 && editor.cursor_y == 0)
+    {
+        /* If there's only one line, just clear it. */
+        editor.text[0][0] = '\0';
+        editor.cursor_x = 0;
+        editor_mark_line_dirty(0);
+        editor_content_changed(0, 0);
+        return;
+    }
+    save_state_undo();
+    for (int i = editor.cursor_y; i < editor.num_lines - 1; i++)
+    {
+        strcpy(editor.text[i], editor.text[i + 1]);
+    }
+    editor.num_lines--;
+    editor_content_changed(editor.cursor_y, LINES_TO_END);
+    if (editor.cursor_y >= editor.num_lines)
+    {
+        editor.cursor_y = editor.num_lines - 1;
+    }
+    if (editor.cursor_y < 0)
+    {
+        editor.cursor_y = 0;
+    }
+    editor.cursor_x = 0;
+    editor_mark_all_lines_dirty();
+}
+
+/* ---------- Multiple Cursors ---------- */
+static int compare_cursor_pos(const void *a, const void *b)
+{
+    const CursorPos *c1 = (const CursorPos *)a;
+    const CursorPos *c2 = (const CursorPos *)b;
+    if (c1->y != c2->y)
+    {
+        return c1->y - c2->y;
+    }
+    return c1->x - c2->x;
+}
+
+/* Returns 1 if an extra cursor sits at (y, x) (binary search over the sorted list). */
+static int extra_cursor_at(int y, int x)
+{
+    int lo = 0, hi = extra_cursor_count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (extra_cursors[mid].y < y || (extra_cursors[mid].y == y && extra_cursors[mid].x < x))
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo < extra_cursor_count && extra_cursors[lo].y == y && extra_cursors[lo].x == x;
+}
+
+void editor_clear_extra_cursors(void)
+{
+    int i;
+    for (i = 0; i < extra_cursor_count; i++)
+    {
+        editor_mark_line_dirty(extra_cursors[i].y);
+    }
+    extra_cursor_count = 0;
+}
+
+/* F2: add a cursor on the line below the lowest cursor, at the primary cursor's column. */
+void editor_add_cursor_below(void)
+{
+    int y = editor.cursor_y, x, len;
+    if (extra_cursor_count > 0 && extra_cursors[extra_cursor_count - 1].y > y)
+    {
+        y = extra_cursors[extra_cursor_count - 1].y;
+    }
+    y = fold_next_visible(y);
+    if (y >= editor.num_lines || extra_cursor_count >= MAX_LINES)
+    {
+        return;
+    }
+    len = (int)strlen(editor.text[y]);
+    x = editor.cursor_x < len ? editor.cursor_x : len;
+    extra_cursors[extra_cursor_count].y = y;
+    extra_cursors[extra_cursor_count].x = x;
+    extra_cursor_count++;
+    qsort(extra_cursors, extra_cursor_count, sizeof(CursorPos), compare_cursor_pos);
+    editor_mark_line_dirty(y);
+}
+
+/*
+    Applies one edit at every cursor in a single ascending pass. Cursors on the
+    same line are adjusted by the running column shift of the edits before them,
+    so the whole keystroke costs one sort and one repaint. Callers push the
+    single undo entry for the keystroke.
+*/
+void editor_multi_apply(int op, int ch)
+{
+    static CursorPos all[MAX_LINES + 1];
+    int n = 0, i, primary = -1, shift = 0, prev_y = -1, out = 0;
+
+    for (i = 0; i < extra_cursor_count; i++)
+    {
+        all[n++] = extra_cursors[i];
+    }
+    all[n].y = editor.cursor_y;
+    all[n].x = editor.cursor_x;
+    n++;
+    qsort(all, n, sizeof(CursorPos), compare_cursor_pos);
+
+    for (i = 0; i < n; i++)
+    {
+        char *line = editor.text[all[i].y];
+        int len = (int)strlen(line);
+        int x;
+        if (all[i].y != prev_y)
+        {
+            shift = 0;
+            prev_y = all[i].y;
+            editor_mark_line_dirty(all[i].y);
+            if (op != MULTI_MOVE)
+            {
+                editor_content_changed(all[i].y, all[i].y);
+            }
+        }
+        if (primary < 0 && all[i].y == editor.cursor_y && all[i].x == editor.cursor_x)
+        {
+            primary = i;
+        }
+        /* Deletes earlier on the same line shift later cursors left, possibly past column 0. */
+        x = all[i].x + shift;
+        if (x < 0)
+        {
+            x = 0;
+        }
+        if (x > len)
+        {
+            x = len;
+        }
+        switch (op)
+        {
+            case MULTI_INSERT:
+                if (len < MAX_COLS - 1)
+                {
+                    memmove(line + x + 1, line + x, (size_t)(len - x) + 1);
+                    line[x] = (char)ch;
+                    x++;
+                    shift++;
+                }
+                break;
+            case MULTI_BACKSPACE:
+                if (x > 0)
+                {
+                    memmove(line + x - 1, line + x, (size_t)(len - x) + 1);
+                    x--;
+                    shift--;
+                }
+                break;
+            case MULTI_DELETE:
+                if (x < len)
+                {
+                    memmove(line + x, line + x + 1, (size_t)(len - x));
+                    shift--;
+                }
+                break;
+            case MULTI_MOVE:
+                x += ch;
+                if (x < 0)
+                {
+                    x = 0;
+                }
+                if (x > len)
+                {
+                    x = len;
+                }
+                break;
+        }
+        all[i].x = x;
+    }
+
+    /* Write back: the primary cursor keeps its identity, duplicates collapse. */
+    editor.cursor_y = all[primary].y;
+    editor.cursor_x = all[primary].x;
+    for (i = 0; i < n; i++)
+    {
+        if (i == primary)
+        {
+            continue;
+        }
+        if (all[i].y == editor.cursor_y && all[i].x == editor.cursor_x)
+        {
+            continue;
+        }
+        if (out > 0 && all[i].y == extra_cursors[out - 1].y && all[i].x == extra_cursors[out - 1].x)
+        {
+            continue;
+        }
+        extra_cursors[out++] = all[i];
+    }
+    extra_cursor_count = out;
+}
+
+/* ---------- QoL: Toggle line numbers (Ctrl+T) ---------- */
+void editor_toggle_line_numbers(void)
+{
+    show_line_numbers = !show_line_numbers;
+    editor_mark_all_lines_dirty();
+}
+
+/* ---------- QoL: Jump to top (Ctrl+U) ---------- */
+void editor_goto_top(void)
+{
+    editor.cursor_y = 0;
+    editor.cursor_x = 0;
+    editor_mark_all_lines_dirty();
+}
+
+/* ---------- QoL: Jump to bottom (Ctrl+L) ---------- */
+void editor_goto_bottom(void)
+{
+    editor.cursor_y = editor.num_lines - 1;
+    if (editor.cursor_y < 0)
+    {
+        editor.cursor_y = 0;
+    }
+    editor.cursor_x = (int)strlen(editor.text[editor.cursor_y]);
+    editor_mark_all_lines_dirty();
+}
+
+/* ---------- Key Traces ---------- */
+/*
+    A trace is a text file: a header line
+
+        ced-trace VERSION ROWS COLS HASH CURSOR_Y CURSOR_X ROW_OFFSET COL_OFFSET PATH
+
+    (the buffer hash and view right after the file was opened) and then one
+    event per line, "MS KIND ARGS", MS counted from the start of recording.
+    Whatever a handler reads besides the key itself (prompt answers, mouse
+    positions) is logged where it is read, so on replay the same handler
+    takes it from the trace instead.
+*/
+#ifdef CED_REPLAY
+static unsigned long editor_buffer_hash(void)
+{
+    unsigned long h = 14695981039346656037UL;
+    int i;
+    const char *p;
+    for (i = 0; i < editor.num_lines; i++)
+    {
+        for (p = editor.text[i]; *p; p++)
+        {
+            h = (h ^ (unsigned char)*p) * 1099511628211UL;
+        }
+        h = (h ^ '\n') * 1099511628211UL;
+    }
+    return h;
+}
+
+static void trace_record(const char *fmt, ...)
+{
+    va_list ap;
+    if (!trace_out)
+    {
+        return;
+    }
+    fprintf(trace_out, "%ld ", monotonic_ms() - trace_start);
+    va_start(ap, fmt);
+    vfprintf(trace_out, fmt, ap);
+    va_end(ap);
+    fputc('\n', trace_out);
+    fflush(trace_out); /* a crashed session still leaves a usable trace */
+}
+
+/* Called once the starting file is loaded: the header pins down what replay starts from. */
+static void trace_record_header(void)
+{
+    trace_start = monotonic_ms();
+    fprintf(trace_out, "%s %d %d %d %lu %d %d %d %d %s\n", TRACE_MAGIC, TRACE_VERSION, screen_rows, screen_cols,
+            editor_buffer_hash(), editor.cursor_y, editor.cursor_x, editor.row_offset, editor.col_offset,
+            current_file);
+    fflush(trace_out);
+}
+
+static void trace_record_quit(void)
+{
+    if (trace_out)
+    {
+        trace_record("Q %lu", editor_buffer_hash());
+        fclose(trace_out);
+        trace_out = NULL;
+    }
+}
+
+/* The next replayed event, if it is of the kind a handler expects. */
+static TraceEvent *trace_take(char kind)
+{
+    if (trace_next < trace_event_count && trace_events[trace_next].kind == kind)
+    {
+        return &trace_events[trace_next++];
+    }
+    trace_desyncs++;
+    return NULL;
+}
+
+/* editor_process_key(), logged with its handling time (prompt waits left out) when recording. */
+static void trace_process_key(int ch)
+{
+    long start = monotonic_us();
+    trace_prompt_us = 0;
+    trace_record("K %d", ch);
+    editor_process_key(ch);
+    trace_record("D %ld", monotonic_us() - start - trace_prompt_us);
+}
+#else
+static void trace_record(const char *fmt, ...)
+{
+    (void)fmt;
+}
+
+#define trace_record_quit() ((void)0)
+#endif
+
+/* getmouse(), logged when recording and taken from the trace when replaying. */
+static int input_getmouse(MEVENT *event)
+{
+#ifdef CED_REPLAY
+    if (trace_replaying)
+    {
+        TraceEvent *ev = trace_take('M');
+        if (!ev)
+        {
+            return ERR;
+        }
+        memset(event, 0, sizeof(*event));
+        event->x = ev->a;
+        event->y = ev->b;
+        event->bstate = (mmask_t)ev->c;
+        return OK;
+    }
+#endif
+    if (getmouse(event) != OK)
+    {
+        return ERR;
+    }
+    trace_record("M %d %d %lu", event->x, event->y, (unsigned long)event->bstate);
+    return OK;
+}
+
+/* ---------- Editor Prompt ---------- */
+static void editor_prompt(char *prompt, char *buffer, size_t bufsize)
+{
+    int resized;
+#ifdef CED_REPLAY
+    long waited;
+#endif
+    if (macro_replaying)
+    {
+        /* Prompts are not recorded; prompting commands are cancelled on replay. */
+        buffer[0] = '\0';
+        return;
+    }
+#ifdef CED_REPLAY
+    if (trace_replaying)
+    {
+        TraceEvent *ev = trace_take('P');
+        snprintf(buffer, bufsize, "%s", ev ? ev->text : "");
+        return;
+    }
+#endif
+    if (vt_backend)
+    {
+        /* ncurses did not draw what is on that row; have it repaint the row in full. */
+        wredrawln(stdscr, screen_rows - 1, 1);
+        scr_handover();
+    }
+    move(screen_rows - 1, 0);
+    clrtoeol();
+    mvprintw(screen_rows - 1, 0, "%s", prompt);
+    echo();
+    curs_set(1);
+    timeout(-1);
+#ifdef CED_REPLAY
+    waited = monotonic_us();
+#endif
+    PROF_BEGIN(PROF_PROMPT);
+    resized = getnstr(buffer, (int)bufsize - 1) == KEY_RESIZE;
+    PROF_END(PROF_PROMPT);
+#ifdef CED_REPLAY
+    trace_prompt_us += monotonic_us() - waited;
+#endif
+    if (resized)
+    {
+        /* Resized while prompting: the answer is cut short, the layout is redone. */
+        getmaxyx(stdscr, screen_rows, screen_cols);
+        editor_mark_all_lines_dirty();
+    }
+    timeout(0);
+    noecho();
+    curs_set(1);
+    scr_invalidate(screen_rows - 1);
+    trace_record("P %s", buffer);
+    if (resized)
+    {
+        trace_record("R %d %d", screen_rows, screen_cols);
+    }
+}
+
+/* ---------- Goto Line ---------- */
+void editor_goto_line_number(int ln)
+{
+    if (ln < 1)
+    {
+        ln = 1;
+    }
+    if (ln > editor.num_lines)
+    {
+        ln = editor.num_lines;
+    }
+    fold_reveal(ln - 1);
+    editor.cursor_y = ln - 1;
+    editor.cursor_x = 0;
+    editor_mark_all_lines_dirty();
+}
+
+void editor_goto_line(void)
+{
+    char line_str[PROMPT_BUFFER_SIZE];
+    editor_prompt("Goto line: ", line_str, sizeof(line_str));
+    if (!line_str[0])
+    {
+        return;
+    }
+    editor_goto_line_number(atoi(line_str));
+}
+
+/* ---------- Save File ---------- */
+/*
+    Writes the buffer to a temporary file beside 'path' and renames it into
+    place, so a crash or a full disk mid-write never leaves a truncated file.
+    The original file's permissions are kept; a symlink's target is replaced.
+    Returns 0 on success and clears the dirty flag.
+*/
+int editor_write_file(const char *path)
+{
+    char real[PATH_MAX], tmp[PATH_MAX + 16];
+    const char *target = realpath(path, real) ? real : path;
+    struct stat st;
+    FILE *fp;
+    int i, fd, failed;
+
+    if (trace_replaying)
+    {
+        /* Replays never touch the disk; the save counts as done. */
+        dirty = 0;
+        return 0;
+    }
+    PROF_BEGIN(PROF_SAVE);
+    snprintf(tmp, sizeof(tmp), "%s.ced-XXXXXX", target);
+    fd = mkstemp(tmp);
+    if (fd < 0 || (fp = fdopen(fd, "w")) == NULL)
+    {
+        editor_set_status_message("Error opening file: %s", strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(tmp);
+        }
+        PROF_END(PROF_SAVE);
+        return -1;
+    }
+    if (stat(target, &st) == 0)
+    {
+        fchmod(fd, st.st_mode & 07777);
+    }
+    else
+    {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask);
+    }
+    for (i = 0; i < editor.num_lines; i++)
+    {
+        fprintf(fp, "%s\n", editor.text[i]);
+    }
+    failed = fflush(fp) != 0 || ferror(fp) || fsync(fd) != 0;
+    failed = (fclose(fp) != 0) || failed;
+    if (failed || rename(tmp, target) != 0)
+    {
+        editor_set_status_message("Error writing file: %s", strerror(errno));
+        unlink(tmp);
+        PROF_END(PROF_SAVE);
+        return -1;
+    }
+    dirty = 0;
+    file_watch_note();
+    PROF_END(PROF_SAVE);
+    return 0;
+}
+
+void editor_save_file(void)
+{
+    char filename[PROMPT_BUFFER_SIZE];
+    char filepath[PROMPT_BUFFER_SIZE];
+    if (current_file[0])
+    {
+        /* Already a real path (from "saves/", the prompt or the command line). */
+        strncpy(filename, current_file, PROMPT_BUFFER_SIZE);
+    }
+    else
+    {
+        editor_prompt("Save as: ", filename, PROMPT_BUFFER_SIZE);
+        if (!filename[0])
+        {
+            return;
+        }
+    }
+
+    /* If user typed no slash, assume "saves/filename" */
+    if (!current_file[0] && !strchr(filename, '/'))
+    {
+        struct stat stt;
+        if (stat("saves", &stt) == -1)
+        {
+            if (mkdir("saves", 0777) == -1)
+            {
+                editor_set_status_message("Error creating 'saves' dir: %s", strerror(errno));
+                return;
+            }
+        }
+        snprintf(filepath, PROMPT_BUFFER_SIZE, "saves/%s", filename);
+        strncpy(current_file, filepath, PROMPT_BUFFER_SIZE);
+    }
+    else
+    {
+        /* user typed a path with slash => open from that path */
+        strncpy(current_file, filename, PROMPT_BUFFER_SIZE);
+    }
+
+    if (editor_write_file(current_file) == 0)
+    {
+        /* Outside git the saved copy is the baseline. */
+        gutter_baseline_changed = 1;
+        file_watch_update();
+        editor_set_status_message("File saved as %s.", current_file);
+    }
+}
+
+/* ---------- Autosave ---------- */
+/*
+    Milliseconds left before an idle autosave is due, or -1 when none is pending.
+    A truncated load is never autosaved: only an explicit save may overwrite it.
+*/
+static int autosave_wait_ms(void)
+{
+    long left;
+    if (config.autosave_seconds <= 0 || !dirty || !current_file[0] || load_truncated)
+    {
+        return -1;
+    }
+    left = autosave_last_input + config.autosave_seconds * 1000L - monotonic_ms();
+    return left > 0 ? (int)left : 0;
+}
+
+/* Called when input has gone quiet: writes the buffer once the idle period has passed. */
+static void autosave_poll(void)
+{
+    if (autosave_wait_ms() != 0)
+    {
+        return;
+    }
+    if (editor_write_file(current_file) == 0)
+    {
+        gutter_baseline_changed = 1;
+        editor_set_status_message("Autosaved %s.", current_file);
+    }
+    else
+    {
+        /* Retry after another idle period rather than on every wake-up. */
+        autosave_last_input = monotonic_ms();
+    }
+}
+
+/* ---------- Session ---------- */
+static const SessionHeader *session_header(void)
+{
+    return (const SessionHeader *)session_map_data;
+}
+
+static const SessionFile *session_mapped_file(int i)
+{
+    return (const SessionFile *)(session_map_data + sizeof(SessionHeader)) + i;
+}
+
+/*
+    Puts the working directory's session file in 'buf':
+    $XDG_STATE_HOME (default ~/.local/state) / SESSION_DIR / a hash of the
+    directory's path. With 'create' set, the directories are made (0700).
+    Returns 0, or -1 if there is no usable location.
+*/
+static int session_path(char *buf, size_t bufsize, int create)
+{
+    char cwd[PATH_MAX];
+    const char *state = getenv("XDG_STATE_HOME");
+    const char *home = getenv("HOME");
+    unsigned long h = 14695981039346656037UL;
+    const char *p;
+    size_t base_len;
+    if (!getcwd(cwd, sizeof(cwd)))
+    {
+        return -1;
+    }
+    if (state && state[0] == '/')
+    {
+        snprintf(buf, bufsize, "%s/%s", state, SESSION_DIR);
+    }
+    else if (home && home[0])
+    {
+        snprintf(buf, bufsize, "%s/.local/state/%s", home, SESSION_DIR);
+    }
+    else
+    {
+        return -1;
+    }
+    base_len = strlen(buf);
+    if (create)
+    {
+        /* mkdir -p, one component at a time. */
+        char *slash;
+        for (slash = strchr(buf + 1, '/'); slash; slash = strchr(slash + 1, '/'))
+        {
+            *slash = '\0';
+            mkdir(buf, 0700);
+            *slash = '/';
+        }
+        if (mkdir(buf, 0700) == -1 && errno != EEXIST)
+        {
+            return -1;
+        }
+    }
+    for (p = cwd; *p; p++)
+    {
+        h = (h ^ (unsigned char)*p) * 1099511628211UL;
+    }
+    if ((size_t)snprintf(buf + base_len, bufsize - base_len, "/%016lx", h) >= bufsize - base_len)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Maps the session file; nothing in it is read until a file is opened or the session is resumed. */
+static void session_map(void)
+{
+    struct stat st;
+    char path[PATH_MAX];
+    int fd = session_path(path, sizeof(path), 0) == 0 ? open(path, O_RDONLY) : -1;
+    if (fd < 0)
+    {
+        return;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(SessionHeader))
+    {
+        char *map = (char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            const SessionHeader *hdr = (const SessionHeader *)map;
+            if (hdr->magic == SESSION_MAGIC && hdr->version == SESSION_VERSION &&
+                hdr->file_count >= 0 && hdr->file_count <= SESSION_MAX_FILES &&
+                hdr->shell_count >= 0 && hdr->shell_count <= SHELL_PANEL_LINES && hdr->shell_bytes >= 0 &&
+                sizeof(SessionHeader) + hdr->file_count * sizeof(SessionFile) + (size_t)hdr->shell_bytes <=
+                    (size_t)st.st_size)
+            {
+                session_map_data = map;
+            }
+            else
+            {
+                munmap(map, (size_t)st.st_size);
+            }
+        }
+    }
+    close(fd);
+}
+
+/* The saved view for 'path': this run's record if the file was left earlier, else the mapped one. */
+static const SessionFile *session_find(const char *path)
+{
+    int i;
+    for (i = 0; i < session_visited_count; i++)
+    {
+        if (!strcmp(session_visited[i].path, path))
+        {
+            return &session_visited[i];
+        }
+    }
+    for (i = 0; session_map_data && i < session_header()->file_count; i++)
+    {
+        const SessionFile *f = session_mapped_file(i);
+        if (memchr(f->path, '\0', sizeof(f->path)) && !strcmp(f->path, path))
+        {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+/* Records the current file's cursor and viewport (before another file replaces it, and on quit). */
+static void session_remember(void)
+{
+    SessionFile f;
+    int i, n = session_visited_count;
+    if (!current_file[0])
+    {
+        return;
+    }
+    memset(&f, 0, sizeof(f));
+    snprintf(f.path, sizeof(f.path), "%s", current_file);
+    f.cursor_x = editor.cursor_x;
+    f.cursor_y = editor.cursor_y;
+    f.row_offset = editor.row_offset;
+    f.col_offset = editor.col_offset;
+    for (i = 0; i < session_visited_count; i++)
+    {
+        if (!strcmp(session_visited[i].path, f.path))
+        {
+            n = i;
+            break;
+        }
+    }
+    if (n == SESSION_MAX_FILES)
+    {
+        n--;
+    }
+    memmove(&session_visited[1], &session_visited[0], sizeof(SessionFile) * (size_t)n);
+    session_visited[0] = f;
+    if (n == session_visited_count)
+    {
+        session_visited_count++;
+    }
+}
+
+/* Puts the cursor back where it was when 'path' was last left; the file may have shrunk since. */
+static void session_restore_file(const char *path)
+{
+    const SessionFile *f = session_find(path);
+    int len;
+    if (!f)
+    {
+        return;
+    }
+    editor.cursor_y = f->cursor_y < 0 ? 0 : f->cursor_y >= editor.num_lines ? editor.num_lines - 1 : f->cursor_y;
+    len = (int)strlen(editor.text[editor.cursor_y]);
+    editor.cursor_x = f->cursor_x < 0 ? 0 : f->cursor_x > len ? len : f->cursor_x;
+    editor.row_offset = f->row_offset < 0 ? 0 : f->row_offset > editor.cursor_y ? editor.cursor_y : f->row_offset;
+    editor.col_offset = f->col_offset < 0 ? 0 : f->col_offset > editor.cursor_x ? editor.cursor_x : f->col_offset;
+}
+
+/* Restores the view settings and shell panel; returns the file that was active at quit, if any. */
+static const char *session_resume(void)
+{
+    const SessionHeader *hdr = session_header();
+    const char *p, *end;
+    if (!session_map_data)
+    {
+        return NULL;
+    }
+    shell_panel_open = hdr->shell_panel_open;
+    show_line_numbers = hdr->show_line_numbers;
+    minimap_visible = hdr->minimap_visible;
+    if (memchr(hdr->search_term, '\0', sizeof(hdr->search_term)))
+    {
+        snprintf(g_searchTerm, sizeof(g_searchTerm), "%s", hdr->search_term);
+        g_searchActive = hdr->search_active && g_searchTerm[0];
+    }
+    p = (const char *)session_mapped_file(hdr->file_count);
+    end = p + hdr->shell_bytes;
+    shell_output_count = 0;
+    while (shell_output_count < hdr->shell_count && p < end)
+    {
+        size_t n = strnlen(p, (size_t)(end - p));
+        snprintf(shell_output[shell_output_count++], MAX_COLS, "%.*s", (int)n, p);
+        p += n + 1;
+    }
+    if (hdr->file_count > 0 && memchr(session_mapped_file(0)->path, '\0', PROMPT_BUFFER_SIZE))
+    {
+        return session_mapped_file(0)->path;
+    }
+    return NULL;
+}
+
+/* Writes this run's files first, then the older mapped ones, then the shell panel (tmp + rename). */
+static void session_save(void)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    SessionHeader hdr;
+    FILE *fp;
+    int i, fd, shell_bytes = 0, mapped = session_map_data ? session_header()->file_count : 0;
+
+    session_remember();
+    if (session_visited_count == 0 && mapped == 0)
+    {
+        return;
+    }
+    for (i = 0; i < mapped && session_visited_count < SESSION_MAX_FILES; i++)
+    {
+        const SessionFile *f = session_mapped_file(i);
+        if (memchr(f->path, '\0', sizeof(f->path)) && session_find(f->path) == f)
+        {
+            session_visited[session_visited_count++] = *f;
+        }
+    }
+    for (i = 0; i < shell_output_count; i++)
+    {
+        shell_bytes += (int)strlen(shell_output[i]) + 1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SESSION_MAGIC;
+    hdr.version = SESSION_VERSION;
+    hdr.file_count = session_visited_count;
+    hdr.shell_count = shell_output_count;
+    hdr.shell_bytes = shell_bytes;
+    hdr.shell_panel_open = shell_panel_open;
+    hdr.show_line_numbers = show_line_numbers;
+    hdr.minimap_visible = minimap_visible;
+    hdr.search_active = g_searchActive;
+    snprintf(hdr.search_term, sizeof(hdr.search_term), "%s", g_searchTerm);
+
+    if (session_path(path, sizeof(path), 1) != 0)
+    {
+        return;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0 || (fp = fdopen(fd, "w")) == NULL)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(tmp);
+        }
+        return;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    fwrite(session_visited, sizeof(SessionFile), (size_t)session_visited_count, fp);
+    for (i = 0; i < shell_output_count; i++)
+    {
+        fwrite(shell_output[i], 1, strlen(shell_output[i]) + 1, fp);
+    }
+    if (fclose(fp) != 0 || rename(tmp, path) != 0)
+    {
+        unlink(tmp);
+    }
+}
+
+/* ---------- Load File ---------- */
+/* Reads 'filepath' into the buffer and makes it the current file; returns 0 on success. */
+int editor_open_path(const char *filepath)
+{
+    FILE *fp = fopen(filepath, "r");
+    if (!fp)
+    {
+        editor_set_status_message("Error opening %s: %s", filepath, strerror(errno));
+        return -1;
+    }
+    editor_load_stream(fp, filepath);
+    fclose(fp);
+    return 0;
+}
+
+/* Reads the buffer from an already open stream (a file or a daemon-cached copy). */
+void editor_load_stream(FILE *fp, const char *filepath)
+{
+    char line_buffer[MAX_COLS];
+    PROF_BEGIN(PROF_LOAD);
+    if (!batch_mode)
+    {
+        session_remember();
+    }
+    memset(editor.text, 0, sizeof(editor.text));
+    editor.num_lines = 0;
+    load_truncated = 0;
+    while (fgets(line_buffer, MAX_COLS, fp))
+    {
+        size_t ln = strlen(line_buffer);
+        if (editor.num_lines == MAX_LINES)
+        {
+            load_truncated = 1;
+            break;
+        }
+        if (ln > 0 && line_buffer[ln - 1] == '\n')
+        {
+            line_buffer[ln - 1] = '\0';
+        }
+        else if (ln == MAX_COLS - 1)
+        {
+            /* Full buffer: the line either ends right here or is too long and gets split. */
+            int c = getc(fp);
+            if (c != '\n' && c != EOF)
+            {
+                ungetc(c, fp);
+                load_truncated = 1;
+            }
+        }
+        strncpy(editor.text[editor.num_lines], line_buffer, MAX_COLS - 1);
+        editor.num_lines++;
+    }
+
+    /* Ensure there is at least one line */
+    if (editor.num_lines == 0)
+    {
+        editor.num_lines = 1;
+        editor.text[0][0] = '\0';
+    }
+
+    /* Reset viewport and cursor */
+    editor.cursor_x = 0;
+    editor.cursor_y = 0;
+    editor.row_offset = 0;
+    editor.col_offset = 0;
+
+    strncpy(current_file, filepath, PROMPT_BUFFER_SIZE - 1);
+    current_file[PROMPT_BUFFER_SIZE - 1] = '\0';
+    if (load_truncated)
+    {
+        editor_set_status_message("File exceeds %d lines or %d columns; saving will not preserve it (autosave is off).",
+                                  MAX_LINES, MAX_COLS - 1);
+    }
+    if (!batch_mode)
+    {
+        session_restore_file(current_file);
+        file_watch_update();
+    }
+    gutter_baseline_changed = 1;
+    dirty = 0;
+    editor_mark_all_lines_dirty();
+    editor_buffer_replaced();
+    PROF_END(PROF_LOAD);
+}
+
+/* Initialize syntax highlighting for the current file, if applicable. */
+static void editor_select_syntax(void)
+{
+    int i;
+    syntax_enabled = 0;
+    for (i = 0; i < global_syntax_defs.count; i++)
+    {
+        if (sh_file_has_extension(current_file, global_syntax_defs.definitions[i]))
+        {
+            selected_syntax = &global_syntax_defs.definitions[i];
+            syntax_enabled = 1;
+            if (selected_syntax->rule_count > 0)
+            {
+                if (token_lookup)
+                {
+                    free(token_lookup);
+                    token_lookup = NULL;
+                    token_lookup_count = 0;
+                }
+                sh_init_syntax_colors(selected_syntax);
+                build_token_lookup(selected_syntax);
+            }
+            break;
+        }
+    }
+}
+
+void editor_load_file(void)
+{
+    char filename[PROMPT_BUFFER_SIZE];
+    char filepath[PROMPT_BUFFER_SIZE];
+    editor_prompt("Open file: ", filename, PROMPT_BUFFER_SIZE);
+    if (!filename[0])
+    {
+        return;
+    }
+
+    /* If user typed no slash, assume "saves/filename" */
+    if (!strchr(filename, '/'))
+    {
+        snprintf(filepath, PROMPT_BUFFER_SIZE, "saves/%s", filename);
+    }
+    else
+    {
+        strncpy(filepath, filename, PROMPT_BUFFER_SIZE);
+    }
+
+    if (editor_open_path(filepath) != 0)
+    {
+        return;
+    }
+    editor_select_syntax();
+    editor_set_status_message("File loaded from %s.", current_file);
+}
+
+/* ---------- Word Completion ---------- */
+/*
+    Identifiers in the buffer are counted in a prefix trie (first-child /
+    next-sibling nodes). Each line remembers the words it contributed, so a
+    changed line only removes its old words and adds its new ones; the trie
+    is brought up to date lazily when a completion is requested.
+*/
+static int completion_child(int node, char ch, int create)
+{
+    int c;
+    for (c = completion_nodes[node].child; c; c = completion_nodes[c].sibling)
+    {
+        if (completion_nodes[c].ch == ch)
+        {
+            return c;
+        }
+    }
+    if (!create)
+    {
+        return 0;
+    }
+    if (completion_node_count == completion_node_cap)
+    {
+        completion_node_cap = completion_node_cap ? completion_node_cap * 2 : 1024;
+        completion_nodes = (CompletionNode *)realloc(completion_nodes, sizeof(CompletionNode) * completion_node_cap);
+    }
+    c = completion_node_count++;
+    completion_nodes[c].ch = ch;
+    completion_nodes[c].count = 0;
+    completion_nodes[c].child = 0;
+    completion_nodes[c].sibling = completion_nodes[node].child;
+    completion_nodes[node].child = c;
+    return c;
+}
+
+static void completion_count_word(const char *word, int delta)
+{
+    int node = 0;
+    for (; *word; word++)
+    {
+        node = completion_child(node, *word, delta > 0);
+        if (!node)
+        {
+            return;
+        }
+    }
+    completion_nodes[node].count += delta;
+}
+
+/* Drops the words line 'i' contributed earlier. */
+static void completion_forget_line(int i)
+{
+    const char *w = completion_line_words[i];
+    if (!w)
+    {
+        return;
+    }
+    for (; *w; w += strlen(w) + 1)
+    {
+        completion_count_word(w, -1);
+    }
+    completion_word_bytes -= (size_t)(w - completion_line_words[i]) + 1;
+    free(completion_line_words[i]);
+    completion_line_words[i] = NULL;
+}
+
+/* Indexes the identifiers of line 'i', stored as "w1\0w2\0\0". */
+static void completion_index_line(int i)
+{
+    const char *line = editor.text[i];
+    char words[MAX_COLS + 2];
+    int j = 0, n = 0;
+    while (line[j])
+    {
+        int start = j;
+        if (!is_word_char(line[j]))
+        {
+            j++;
+            continue;
+        }
+        while (is_word_char(line[j]))
+        {
+            j++;
+        }
+        if (j - start >= COMPLETION_MIN_WORD && !isdigit((unsigned char)line[start]))
+        {
+            memcpy(words + n, line + start, (size_t)(j - start));
+            n += j - start;
+            words[n++] = '\0';
+            words[n] = '\0';
+            completion_count_word(words + n - (j - start) - 1, 1);
+        }
+    }
+    if (n > 0)
+    {
+        words[n++] = '\0';
+        completion_line_words[i] = (char *)malloc((size_t)n);
+        memcpy(completion_line_words[i], words, (size_t)n);
+        completion_word_bytes += (size_t)n;
+    }
+}
+
+void completion_index_invalidate(int first, int last)
+{
+    int i;
+    if (last == LINES_TO_END)
+    {
+        if (first < completion_stale_from)
+        {
+            completion_stale_from = first < 0 ? 0 : first;
+        }
+        return;
+    }
+    for (i = first; i <= last && i < MAX_LINES; i++)
+    {
+        completion_line_stale[i] = 1;
+    }
+}
+
+static void completion_index_refresh(void)
+{
+    int i;
+    if (completion_stale_from == 0)
+    {
+        /* Everything changed: start from an empty trie instead of decrementing. */
+        for (i = 0; i < MAX_LINES; i++)
+        {
+            free(completion_line_words[i]);
+            completion_line_words[i] = NULL;
+        }
+        completion_word_bytes = 0;
+        if (completion_node_cap == 0)
+        {
+            completion_node_cap = 1024;
+            completion_nodes = (CompletionNode *)malloc(sizeof(CompletionNode) * completion_node_cap);
+        }
+        memset(&completion_nodes[0], 0, sizeof(CompletionNode)); /* root */
+        completion_node_count = 1;
+    }
+    for (i = 0; i < completion_stale_from && i < editor.num_lines; i++)
+    {
+        if (completion_line_stale[i])
+        {
+            completion_line_stale[i] = 0;
+            completion_forget_line(i);
+            completion_index_line(i);
+        }
+    }
+    for (i = completion_stale_from; i < MAX_LINES; i++)
+    {
+        completion_line_stale[i] = 0;
+        completion_forget_line(i);
+        if (i < editor.num_lines)
+        {
+            completion_index_line(i);
+        }
+    }
+    completion_stale_from = MAX_LINES;
+}
+
+/* Frees the whole index; the next completion rebuilds it from scratch. */
+void completion_index_drop(void)
+{
+    int i;
+    for (i = 0; i < MAX_LINES; i++)
+    {
+        free(completion_line_words[i]);
+        completion_line_words[i] = NULL;
+    }
+    completion_word_bytes = 0;
+    free(completion_nodes);
+    completion_nodes = NULL;
+    completion_node_count = 0;
+    completion_node_cap = 0;
+    completion_stale_from = 0;
+}
+
+static int compare_completion_candidate(const void *a, const void *b)
+{
+    const CompletionCandidate *c1 = (const CompletionCandidate *)a;
+    const CompletionCandidate *c2 = (const CompletionCandidate *)b;
+    if (c1->count != c2->count)
+    {
+        return c2->count - c1->count;
+    }
+    return strcmp(c1->word, c2->word);
+}
+
+/*
+    Offers a word to the candidate list, which keeps the best
+    COMPLETION_MAX_CANDIDATES as a heap with the worst kept one at the root,
+    so every match can be walked and the most frequent still win.
+*/
+static void completion_offer(const char *word, int len, int count)
+{
+    CompletionCandidate cand;
+    int i = 0;
+    memcpy(cand.word, word, (size_t)len);
+    cand.word[len] = '\0';
+    cand.count = count;
+    if (completion_candidate_count < COMPLETION_MAX_CANDIDATES)
+    {
+        /* Sift up from the new leaf. */
+        i = completion_candidate_count++;
+        while (i > 0 && compare_completion_candidate(&completion_candidates[(i - 1) / 2], &cand) < 0)
+        {
+            completion_candidates[i] = completion_candidates[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        completion_candidates[i] = cand;
+        return;
+    }
+    if (compare_completion_candidate(&cand, &completion_candidates[0]) >= 0)
+    {
+        return;
+    }
+    /* Replace the worst and sift down. */
+    while (1)
+    {
+        int child = 2 * i + 1;
+        if (child >= completion_candidate_count)
+        {
+            break;
+        }
+        if (child + 1 < completion_candidate_count &&
+            compare_completion_candidate(&completion_candidates[child + 1], &completion_candidates[child]) > 0)
+        {
+            child++;
+        }
+        if (compare_completion_candidate(&completion_candidates[child], &cand) <= 0)
+        {
+            break;
+        }
+        completion_candidates[i] = completion_candidates[child];
+        i = child;
+    }
+    completion_candidates[i] = cand;
+}
+
+static void completion_collect(int node, char *word, int depth, int prefix_len)
+{
+    int c;
+    if (depth >= COMPLETION_MAX_WORD - 1)
+    {
+        return;
+    }
+    if (completion_nodes[node].count > 0 && depth > prefix_len)
+    {
+        completion_offer(word, depth, completion_nodes[node].count);
+    }
+    for (c = completion_nodes[node].child; c; c = completion_nodes[c].sibling)
+    {
+        word[depth] = completion_nodes[c].ch;
+        completion_collect(c, word, depth + 1, prefix_len);
+    }
+}
+
+/* Replaces the previously inserted completion suffix with candidate 'idx'. */
+static void completion_apply(int idx)
+{
+    const char *suffix = completion_candidates[idx].word + completion_prefix_len;
+    while (completion_inserted_len > 0)
+    {
+        editor_delete_char();
+        completion_inserted_len--;
+    }
+    for (; *suffix && editor.cursor_x < MAX_COLS - 1; suffix++)
+    {
+        editor_insert_char(*suffix);
+        completion_inserted_len++;
+    }
+    editor_set_status_message("Completion %d/%d: %s", idx + 1, completion_candidate_count,
+                              completion_candidates[idx].word);
+}
+
+/* Ctrl+N: complete the identifier left of the cursor; press again to cycle. */
+void editor_complete_word(void)
+{
+    const char *line = editor.text[editor.cursor_y];
+    char word[COMPLETION_MAX_WORD];
+    int start = editor.cursor_x, node = 0, i;
+
+    if (completion_cycling && completion_candidate_count > 0)
+    {
+        completion_index = (completion_index + 1) % completion_candidate_count;
+        completion_apply(completion_index);
+        return;
+    }
+    while (start > 0 && is_word_char(line[start - 1]))
+    {
+        start--;
+    }
+    completion_prefix_len = editor.cursor_x - start;
+    if (completion_prefix_len == 0 || completion_prefix_len >= COMPLETION_MAX_WORD)
+    {
+        editor_set_status_message("Nothing to complete.");
+        return;
+    }
+    completion_index_refresh();
+    memcpy(word, line + start, (size_t)completion_prefix_len);
+    for (i = 0; i < completion_prefix_len && node >= 0; i++)
+    {
+        node = completion_child(node, word[i], 0);
+        if (!node)
+        {
+            node = -1;
+        }
+    }
+    completion_candidate_count = 0;
+    if (node > 0)
+    {
+        completion_collect(node, word, completion_prefix_len, completion_prefix_len);
+    }
+    if (completion_candidate_count == 0)
+    {
+        editor_set_status_message("No completions.");
+        return;
+    }
+    qsort(completion_candidates, completion_candidate_count, sizeof(CompletionCandidate),
+          compare_completion_candidate);
+    save_state_undo();
+    completion_inserted_len = 0;
+    completion_index = 0;
+    completion_cycling = 1;
+    completion_apply(0);
+}
+
+/* ---------- Tags / Jump to Definition ---------- */
+/*
+    A ctags-format text blob (the mmap'd "tags" file, or one produced by the
+    built-in C scanner) is indexed once by sorting the offsets of its lines by
+    tag name; lookups are then a binary search over that offset array.
+*/
+static int tag_name_cmp(const char *a, const char *b)
+{
+    while (*a != '\t' && *a != '\n' && *a == *b)
+    {
+        a++;
+        b++;
+    }
+    if ((*a == '\t' || *a == '\n') && (*b == '\t' || *b == '\n' || *b == '\0'))
+    {
+        return 0;
+    }
+    return (unsigned char)(*a == '\t' || *a == '\n' ? 0 : *a) - (unsigned char)(*b == '\t' || *b == '\n' ? 0 : *b);
+}
+
+static int compare_tag_offset(const void *a, const void *b)
+{
+    return tag_name_cmp(tags_data + *(const size_t *)a, tags_data + *(const size_t *)b);
+}
+
+/* Indexes every tag line of 'data'; takes ownership of the blob. */
+static void tags_build_index(char *data, size_t size, int mapped)
+{
+    size_t pos = 0;
+    int cap = 0;
+    tags_data = data;
+    tags_size = size;
+    tags_mapped = mapped;
+    tags_count = 0;
+    while (pos < size)
+    {
+        const char *nl = (const char *)memchr(data + pos, '\n', size - pos);
+        size_t next = nl ? (size_t)(nl - data) + 1 : size;
+        /* Skip "!_TAG_" pseudo-tags and malformed lines. */
+        if (data[pos] != '!' && memchr(data + pos, '\t', next - pos))
+        {
+            if (tags_count == cap)
+            {
+                cap = cap ? cap * 2 : 1024;
+                tags_offsets = (size_t *)realloc(tags_offsets, sizeof(size_t) * cap);
+            }
+            tags_offsets[tags_count++] = pos;
+        }
+        pos = next;
+    }
+    if (tags_count > 0)
+    {
+        qsort(tags_offsets, tags_count, sizeof(size_t), compare_tag_offset);
+    }
+}
+
+static void tags_scan_append(char **buf, size_t *len, size_t *cap, const char *name, int name_len,
+                             const char *file, int line)
+{
+    char entry[PATH_MAX + 128];
+    int n = snprintf(entry, sizeof(entry), "%.*s\t%s\t%d;\"\n", name_len, name, file, line);
+    if (n <= 0 || n >= (int)sizeof(entry))
+    {
+        return;
+    }
+    if (*len + (size_t)n > *cap)
+    {
+        *cap = (*cap + (size_t)n) * 2;
+        *buf = (char *)realloc(*buf, *cap);
+    }
+    memcpy(*buf + *len, entry, (size_t)n);
+    *len += (size_t)n;
+}
+
+/*
+    Background scanner for C sources in the working directory. Recognises
+    function definitions (identifier followed by '(' on a line starting in
+    column 0 and not ending in ';'), #define macros and struct/union/enum tags.
+    It only reads files from disk, never the editor buffer.
+*/
+static void *tags_scan_thread(void *arg)
+{
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    DIR *dir = opendir(".");
+    struct dirent *de;
+    (void)arg;
+    prof_thread_name("tags");
+    PROF_BEGIN(PROF_TAGS_SCAN);
+    while (dir && (de = readdir(dir)) != NULL)
+    {
+        size_t nlen = strlen(de->d_name);
+        FILE *fp;
+        char line[SH_MAX_LINE_LENGTH];
+        int ln = 0;
+        if (nlen < 3 || (strcmp(de->d_name + nlen - 2, ".c") && strcmp(de->d_name + nlen - 2, ".h")))
+        {
+            continue;
+        }
+        fp = fopen(de->d_name, "r");
+        while (fp && fgets(line, sizeof(line), fp))
+        {
+            const char *p = line, *name = NULL;
+            int name_len = 0;
+            ln++;
+            if (!strncmp(p, "#define", 7) && isspace((unsigned char)p[7]))
+            {
+                p += 7;
+                while (isspace((unsigned char)*p))
+                {
+                    p++;
+                }
+                name = p;
+                while (is_word_char(*p))
+                {
+                    p++;
+                }
+                name_len = (int)(p - name);
+            }
+            else if (is_word_char(line[0]) && strchr(line, '(') && !strchr(line, ';'))
+            {
+                /* The identifier right before the first '('. */
+                const char *paren = strchr(line, '(');
+                const char *end = paren;
+                while (end > line && isspace((unsigned char)end[-1]))
+                {
+                    end--;
+                }
+                name = end;
+                while (name > line && is_word_char(name[-1]))
+                {
+                    name--;
+                }
+                name_len = (int)(end - name);
+            }
+            else if ((p = strstr(line, "struct ")) != NULL || (p = strstr(line, "union ")) != NULL ||
+                     (p = strstr(line, "enum ")) != NULL)
+            {
+                p = strchr(p, ' ');
+                while (isspace((unsigned char)*p))
+                {
+                    p++;
+                }
+                name = p;
+                while (is_word_char(*p))
+                {
+                    p++;
+                }
+                name_len = (int)(p - name);
+                /* Only definitions: "struct Name" followed by an opening brace. */
+                while (isspace((unsigned char)*p))
+                {
+                    p++;
+                }
+                if (*p != '{' && *p != '\0')
+                {
+                    name_len = 0;
+                }
+            }
+            if (name && name_len > 0 && !isdigit((unsigned char)name[0]))
+            {
+                tags_scan_append(&buf, &len, &cap, name, name_len, de->d_name, ln);
+            }
+        }
+        if (fp)
+        {
+            fclose(fp);
+        }
+    }
+    if (dir)
+    {
+        closedir(dir);
+    }
+    pthread_mutex_lock(&tags_lock);
+    tags_build_index(buf, len, 0);
+    tags_state = TAGS_READY;
+    pthread_mutex_unlock(&tags_lock);
+    PROF_END(PROF_TAGS_SCAN);
+    return NULL;
+}
+
+/* Maps ./tags if present, otherwise starts the background C scanner. */
+void tags_prepare(void)
+{
+    int fd;
+    struct stat st;
+    if (tags_state != TAGS_NONE)
+    {
+        return;
+    }
+    fd = open("tags", O_RDONLY);
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map != MAP_FAILED)
+        {
+            tags_build_index((char *)map, (size_t)st.st_size, 1);
+            tags_state = TAGS_READY;
+            return;
+        }
+    }
+    else if (fd != -1)
+    {
+        close(fd);
+    }
+    tags_state = TAGS_BUILDING;
+    if (pthread_create(&tags_thread, NULL, tags_scan_thread, NULL) != 0)
+    {
+        tags_state = TAGS_NONE;
+        return;
+    }
+    pthread_detach(tags_thread);
+}
+
+/* Releases a loaded index; the next jump loads or rescans it again. Returns 1 if one was loaded. */
+int tags_drop(void)
+{
+    int dropped = 0;
+    pthread_mutex_lock(&tags_lock);
+    if (tags_state == TAGS_READY)
+    {
+        if (tags_mapped)
+        {
+            munmap(tags_data, tags_size);
+        }
+        else
+        {
+            free(tags_data);
+        }
+        free(tags_offsets);
+        tags_data = NULL;
+        tags_offsets = NULL;
+        tags_size = 0;
+        tags_count = 0;
+        tags_state = TAGS_NONE;
+        dropped = 1;
+    }
+    pthread_mutex_unlock(&tags_lock);
+    return dropped;
+}
+
+/* Binary search for 'name'; returns the entry's offset or -1. */
+static long tags_lookup(const char *name)
+{
+    int lo = 0, hi = tags_count - 1;
+    char key[COMPLETION_MAX_WORD + 1];
+    snprintf(key, sizeof(key), "%s\t", name);
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        int c = tag_name_cmp(tags_data + tags_offsets[mid], key);
+        if (c == 0)
+        {
+            return (long)tags_offsets[mid];
+        }
+        if (c < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    return -1;
+}
+
+/* Finds the line matching a ctags /^pattern$/ address in the loaded buffer. */
+static int tags_find_pattern(const char *pat, size_t len)
+{
+    char want[MAX_COLS];
+    size_t i, n = 0;
+    int anchored_end = 0, y;
+    if (len > 0 && pat[0] == '^')
+    {
+        pat++;
+        len--;
+    }
+    if (len > 0 && pat[len - 1] == '$')
+    {
+        len--;
+        anchored_end = 1;
+    }
+    for (i = 0; i < len && n < sizeof(want) - 1; i++)
+    {
+        if (pat[i] == '\\' && i + 1 < len)
+        {
+            i++;
+        }
+        want[n++] = pat[i];
+    }
+    want[n] = '\0';
+    for (y = 0; y < editor.num_lines; y++)
+    {
+        if (!strncmp(editor.text[y], want, n) && (!anchored_end || editor.text[y][n] == '\0'))
+        {
+            return y + 1;
+        }
+    }
+    return 1;
+}
+
+/* Ctrl+]: open the definition of the identifier under the cursor. */
+void editor_jump_to_definition(void)
+{
+    const char *line = editor.text[editor.cursor_y];
+    char word[COMPLETION_MAX_WORD], file[PATH_MAX];
+    int start = editor.cursor_x, end = editor.cursor_x, state;
+    long off;
+    const char *p, *q, *eol;
+
+    while (start > 0 && is_word_char(line[start - 1]))
+    {
+        start--;
+    }
+    while (is_word_char(line[end]))
+    {
+        end++;
+    }
+    if (end == start || end - start >= COMPLETION_MAX_WORD)
+    {
+        editor_set_status_message("No identifier under cursor.");
+        return;
+    }
+    memcpy(word, line + start, (size_t)(end - start));
+    word[end - start] = '\0';
+
+    tags_prepare();
+    pthread_mutex_lock(&tags_lock);
+    state = tags_state;
+    off = state == TAGS_READY ? tags_lookup(word) : -1;
+    pthread_mutex_unlock(&tags_lock);
+    if (state == TAGS_BUILDING)
+    {
+        editor_set_status_message("Tag index is still being built...");
+        return;
+    }
+    if (off < 0)
+    {
+        editor_set_status_message("Tag not found: %s", word);
+        return;
+    }
+
+    /* name \t file \t address [;" extensions]; a mapped tags file need not end in '\n' or '\0'. */
+    eol = (const char *)memchr(tags_data + off, '\n', tags_size - (size_t)off);
+    if (!eol)
+    {
+        eol = tags_data + tags_size;
+    }
+    p = (const char *)memchr(tags_data + off, '\t', (size_t)(eol - (tags_data + off)));
+    q = p ? (const char *)memchr(p + 1, '\t', (size_t)(eol - (p + 1))) : NULL;
+    if (!q || (size_t)(q - (p + 1)) >= sizeof(file))
+    {
+        editor_set_status_message("Malformed tag line for %s.", word);
+        return;
+    }
+    p++;
+    memcpy(file, p, (size_t)(q - p));
+    file[q - p] = '\0';
+    p = q + 1;
+
+    if (strcmp(file, current_file) != 0)
+    {
+        if (dirty)
+        {
+            editor_set_status_message("Unsaved changes; save before jumping to %s.", file);
+            return;
+        }
+        if (editor_open_path(file) != 0)
+        {
+            return;
+        }
+        editor_select_syntax();
+    }
+    if (p < eol && isdigit((unsigned char)*p))
+    {
+        int n = 0;
+        for (; p < eol && isdigit((unsigned char)*p) && n < MAX_LINES; p++)
+        {
+            n = n * 10 + (*p - '0');
+        }
+        editor_goto_line_number(n);
+    }
+    else if (p < eol && (*p == '/' || *p == '?'))
+    {
+        char delim = *p++;
+        q = p;
+        while (q < eol && !(*q == delim && q[-1] != '\\'))
+        {
+            q++;
+        }
+        editor_goto_line_number(tags_find_pattern(p, (size_t)(q - p)));
+    }
+    editor_set_status_message("%s: %s:%d", word, file, editor.cursor_y + 1);
+}
+
+/* ---------- Memory Accounting ---------- */
+/*
+    Bytes held per subsystem: fixed tables at their full size, heap data at
+    what it currently holds. MEMORY_BUDGET covers the heap data only, since
+    nothing can shrink the fixed tables; edits that push it over the budget
+    evict the caches that can be rebuilt on demand (completion index, tags
+    index) first, then the oldest redo and undo snapshots.
+*/
+static size_t mem_text_used(void)
+{
+    size_t bytes = 0;
+    int i;
+    for (i = 0; i < editor.num_lines; i++)
+    {
+        bytes += strlen(editor.text[i]) + 1;
+    }
+    return bytes;
+}
+
+static size_t mem_completion_bytes(void)
+{
+    return sizeof(CompletionNode) * (size_t)completion_node_cap + completion_word_bytes;
+}
+
+static size_t mem_tags_bytes(void)
+{
+    size_t bytes;
+    pthread_mutex_lock(&tags_lock);
+    bytes = tags_state == TAGS_READY ? tags_size + sizeof(size_t) * (size_t)tags_count : 0;
+    pthread_mutex_unlock(&tags_lock);
+    return bytes;
+}
+
+static size_t mem_clipboard_bytes(void)
+{
+    size_t bytes = sizeof(char *) * (size_t)clipboard.count;
+    int i;
+    for (i = 0; i < clipboard.count; i++)
+    {
+        bytes += strlen(clipboard.lines[i]) + 1;
+    }
+    return bytes;
+}
+
+/* Per-line tables kept next to the buffer: folds, redraw flags, brackets, gutter, ruler, cursors, stacks. */
+static size_t mem_index_bytes(void)
+{
+    return sizeof(folds) + sizeof(fold_hidden) + sizeof(fold_bit) + sizeof(line_dirty) + sizeof(bracket_tree) +
+           sizeof(bracket_leaf_stale) + sizeof(completion_line_words) + sizeof(completion_line_stale) +
+           sizeof(gutter_line_hash) + sizeof(gutter_line_stale) + sizeof(gutter_marks) +
+           sizeof(gutter_request_hashes) + sizeof(gutter_result) + sizeof(minimap_line_matches) +
+           sizeof(minimap_line_stale) + sizeof(minimap_block_matches) + sizeof(minimap_block_changes) +
+           sizeof(extra_cursors) + sizeof(undo_stack) + sizeof(redo_stack);
+}
+
+static size_t mem_screen_bytes(void)
+{
+    return vt_backend ? 2 * sizeof(chtype) * (size_t)vt_rows * (size_t)vt_cols + vt_out_cap : 0;
+}
+
+static size_t mem_daemon_bytes(void)
+{
+    size_t bytes = sizeof(DaemonFile) * (size_t)daemon_file_count;
+    int i;
+    for (i = 0; i < daemon_file_count; i++)
+    {
+        bytes += daemon_files[i].size + 1;
+    }
+    return bytes;
+}
+
+/* Sized at startup (or by the terminal) and never evicted; not counted against MEMORY_BUDGET. */
+static size_t mem_fixed_bytes(void)
+{
+    return sizeof(editor.text) + sizeof(shell_output) + mem_index_bytes() + mem_screen_bytes();
+}
+
+/* What grows with use; this is what MEMORY_BUDGET limits. */
+static size_t mem_heap_bytes(void)
+{
+    return undo_bytes + mem_completion_bytes() + mem_tags_bytes() + mem_clipboard_bytes() + mem_daemon_bytes();
+}
+
+static size_t mem_total(void)
+{
+    return mem_fixed_bytes() + mem_heap_bytes();
+}
+
+void mem_enforce_budget(void)
+{
+    size_t budget = (size_t)config.memory_budget_mb * 1024 * 1024;
+    if (budget == 0 || mem_heap_bytes() <= budget)
+    {
+        return;
+    }
+    if (completion_node_cap > 0)
+    {
+        completion_index_drop();
+        mem_evicted_caches++;
+    }
+    if (mem_heap_bytes() > budget && tags_drop())
+    {
+        mem_evicted_caches++;
+    }
+    while (mem_heap_bytes() > budget && redo_stack_top > 0)
+    {
+        undo_drop_oldest(redo_stack, &redo_stack_top, 1);
+        mem_evicted_snapshots++;
+    }
+    /* The newest undo step is always kept. */
+    while (mem_heap_bytes() > budget && undo_stack_top > 1)
+    {
+        undo_drop_oldest(undo_stack, &undo_stack_top, 1);
+        mem_evicted_snapshots++;
+    }
+}
+
+static const char *mem_format(size_t bytes, char *buf, size_t bufsize)
+{
+    if (bytes < 1024)
+    {
+        snprintf(buf, bufsize, "%lu B", (unsigned long)bytes);
+    }
+    else if (bytes < 1024 * 1024)
+    {
+        snprintf(buf, bufsize, "%.1f KB", bytes / 1024.0);
+    }
+    else
+    {
+        snprintf(buf, bufsize, "%.1f MB", bytes / (1024.0 * 1024.0));
+    }
+    return buf;
+}
+
+/* F11: list what each part of the editor holds in the shell panel. */
+void mem_report(void)
+{
+    char a[32], b[32], c[32];
+    shell_panel_clear();
+    if (config.memory_budget_mb > 0)
+    {
+        shell_panel_emit("Memory: %s; heap %s of %d MB budget, plus %s fixed (evicted %d caches, %d undo snapshots)",
+                         mem_format(mem_total(), a, sizeof(a)), mem_format(mem_heap_bytes(), b, sizeof(b)),
+                         config.memory_budget_mb, mem_format(mem_fixed_bytes(), c, sizeof(c)), mem_evicted_caches,
+                         mem_evicted_snapshots);
+    }
+    else
+    {
+        shell_panel_emit("Memory: %s; heap %s, plus %s fixed (no MEMORY_BUDGET set)",
+                         mem_format(mem_total(), a, sizeof(a)), mem_format(mem_heap_bytes(), b, sizeof(b)),
+                         mem_format(mem_fixed_bytes(), c, sizeof(c)));
+    }
+    shell_panel_emit("  Buffer text        %10s  (%s in %d lines)", mem_format(sizeof(editor.text), a, sizeof(a)),
+                     mem_format(mem_text_used(), b, sizeof(b)), editor.num_lines);
+    shell_panel_emit("  Undo/redo          %10s  (%d undo, %d redo snapshots)", mem_format(undo_bytes, a, sizeof(a)),
+                     undo_stack_top, redo_stack_top);
+    shell_panel_emit("  Completion cache   %10s  (%d trie nodes)", mem_format(mem_completion_bytes(), a, sizeof(a)),
+                     completion_node_count);
+    shell_panel_emit("  Tags cache         %10s  (%d tags%s)", mem_format(mem_tags_bytes(), a, sizeof(a)), tags_count,
+                     tags_mapped && tags_state == TAGS_READY ? ", mapped" : "");
+    shell_panel_emit("  Clipboard          %10s  (%d lines)", mem_format(mem_clipboard_bytes(), a, sizeof(a)),
+                     clipboard.count);
+    shell_panel_emit("  Shell panel        %10s", mem_format(sizeof(shell_output), a, sizeof(a)));
+    shell_panel_emit("  Line indexes       %10s", mem_format(mem_index_bytes(), a, sizeof(a)));
+    if (vt_backend)
+    {
+        shell_panel_emit("  Screen grids       %10s", mem_format(mem_screen_bytes(), a, sizeof(a)));
+    }
+    if (daemon_file_count > 0)
+    {
+        shell_panel_emit("  Daemon file cache  %10s  (%d files)", mem_format(mem_daemon_bytes(), a, sizeof(a)),
+                         daemon_file_count);
+    }
+    shell_panel_open = 1;
+    editor_mark_all_lines_dirty();
+}
+
+/* ---------- Keyboard Macros ---------- */
+void macro_toggle_recording(void)
+{
+    if (macro_replaying)
+    {
+        return;
+    }
+    macro_recording = !macro_recording;
+    if (macro_recording)
+    {
+        macro_length = 0;
+        editor_set_status_message("Recording macro... (F5 to stop)");
+    }
+    else
+    {
+        editor_set_status_message("Macro recorded: %d key(s).", macro_length);
+    }
+}
+
+static void macro_record_key(int ch)
+{
+    if (!macro_recording || macro_replaying)
+    {
+        return;
+    }
+    /* Macro control keys and mouse events are not part of the macro. */
+    if (ch == KEY_F(5) || ch == KEY_F(6) || ch == KEY_F(7) || ch == KEY_MOUSE)
+    {
+        return;
+    }
+    if (macro_length < MACRO_MAX_KEYS)
+    {
+        macro_keys[macro_length++] = ch;
+    }
+}
+
+/*
+    Replays the macro 'times' times, or until the cursor reaches the last line
+    when 'times' is 0. Keys are fed straight to editor_process_key() without a
+    screen refresh in between, per-key undo snapshots are suppressed and the
+    whole replay is a single undo entry followed by one full repaint.
+*/
+void macro_replay(int times)
+{
+    int pass;
+    if (macro_recording || macro_replaying)
+    {
+        return;
+    }
+    if (macro_length == 0)
+    {
+        editor_set_status_message("No macro recorded.");
+        return;
+    }
+    save_state_undo();
+    macro_replaying = 1;
+    for (pass = 0; times == 0 || pass < times; pass++)
+    {
+        int k, start_y = editor.cursor_y;
+        for (k = 0; k < macro_length; k++)
+        {
+            editor_process_key(macro_keys[k]);
+        }
+        /* Running to end of file stops once the macro no longer advances. */
+        if (times == 0 && (editor.cursor_y <= start_y || pass >= MAX_LINES))
+        {
+            pass++;
+            break;
+        }
+    }
+    macro_replaying = 0;
+    dirty = 1;
+    editor_mark_all_lines_dirty();
+    editor_set_status_message("Macro applied %d time(s).", pass);
+}
+
+void macro_replay_prompt(void)
+{
+    char count_str[PROMPT_BUFFER_SIZE];
+    editor_prompt("Replay macro how many times (empty = to end of file): ", count_str, sizeof(count_str));
+    macro_replay(count_str[0] ? (atoi(count_str) > 0 ? atoi(count_str) : 1) : 0);
+}
+
+/* ---------- Process Key & Mouse ---------- */
+/*
+    KEY_RESIZE (ncurses' SIGWINCH handler has already resized stdscr): a
+    window drag delivers a burst of these, so any that are already queued
+    are swallowed and the size is read once, followed by one full repaint.
+*/
+static void editor_handle_resize(void)
+{
+    int ch;
+    timeout(0);
+    while ((ch = getch()) == KEY_RESIZE)
+    {
+    }
+    if (ch != ERR)
+    {
+        ungetch(ch);
+    }
+    getmaxyx(stdscr, screen_rows, screen_cols);
+    trace_record("R %d %d", screen_rows, screen_cols);
+    if (vt_backend)
+    {
+        /* Let ncurses flush its own post-resize repaint now, not over our next frame. */
+        refresh();
+        scr_invalidate(0);
+    }
+    editor_mark_all_lines_dirty();
+}
+
+void process_keypress(void)
+{
+    int ch = getch();
+    if (ch == ERR)
+    {
+        /* Woken by something other than a key. */
+        return;
+    }
+    if (ch == KEY_RESIZE)
+    {
+        editor_handle_resize();
+        return;
+    }
+    autosave_last_input = monotonic_ms();
+    render_after_key = 1;
+    macro_record_key(ch);
+    PROF_BEGIN(PROF_KEYPRESS);
+#ifdef CED_REPLAY
+    if (trace_out)
+    {
+        trace_process_key(ch);
+    }
+    else
+#endif
+    {
+        editor_process_key(ch);
+    }
+    PROF_END(PROF_KEYPRESS);
+}
+
+void editor_process_key(int ch)
+{
+    if (ch != 14)
+    {
+        /* Any key other than Ctrl+N ends completion cycling. */
+        completion_cycling = 0;
+    }
+    if (extra_cursor_count > 0)
+    {
+        /* With extra cursors active, edits and in-line moves apply at every cursor. */
+        switch (ch)
+        {
+            case KEY_F(2):
+            case KEY_F(5):
+            case KEY_F(6):
+            case KEY_F(7):
+                break;
+            case '\t':
+            {
+                int i, n = config.tab_four_spaces ? 4 : 1;
+                save_state_undo();
+                for (i = 0; i < n; i++)
+                {
+                    editor_multi_apply(MULTI_INSERT, config.tab_four_spaces ? ' ' : '\t');
+                }
+                return;
+            }
+            case KEY_BACKSPACE:
+            case 127:
+                save_state_undo();
+                editor_multi_apply(MULTI_BACKSPACE, 0);
+                return;
+            case KEY_DC:
+                save_state_undo();
+                editor_multi_apply(MULTI_DELETE, 0);
+                return;
+            case KEY_LEFT:
+                editor_multi_apply(MULTI_MOVE, -1);
+                return;
+            case KEY_RIGHT:
+                editor_multi_apply(MULTI_MOVE, 1);
+                return;
+            case KEY_HOME:
+                editor_multi_apply(MULTI_MOVE, -MAX_COLS);
+                return;
+            case KEY_END:
+                editor_multi_apply(MULTI_MOVE, MAX_COLS);
+                return;
+            default:
+                if (ch >= 32 && ch <= 126)
+                {
+                    save_state_undo();
+                    editor_multi_apply(MULTI_INSERT, ch);
+                    return;
+                }
+                /* Any other key drops back to a single cursor. */
+                editor_clear_extra_cursors();
+                if (ch == 27)
+                {
+                    return;
+                }
+                break;
+        }
+    }
+    if (ch == KEY_MOUSE)
+    {
+        MEVENT event;
+        if (input_getmouse(&event) == OK)
+        {
+            if ((event.bstate & BUTTON1_CLICKED) && minimap_visible && event.x == screen_cols - 1 &&
+                event.y < viewport_text_rows())
+            {
+                minimap_jump(event.y, viewport_text_rows());
+            }
+            else if (event.bstate & BUTTON1_CLICKED)
+            {
+                int new_y = fold_line_at_rank(fold_rank(editor.row_offset) + event.y);
+                int new_x = new_y >= 0 && new_y < editor.num_lines
+                            ? (event.x - (show_line_numbers ? LINE_NUMBER_WIDTH : 0) + editor.col_offset)
+                            : 0;
+                if (new_y >= editor.num_lines)
+                {
+                    new_y = editor.num_lines - 1;
+                }
+                if (new_y < 0)
+                {
+                    new_y = 0;
+                }
+                {
+                    int ll = (int)strlen(editor.text[new_y]);
+                    if (new_x < 0)
+                    {
+                        new_x = 0;
+                    }
+                    if (new_x > ll)
+                    {
+                        new_x = ll;
+                    }
+                }
+                editor.cursor_y = new_y;
+                editor.cursor_x = new_x;
+                editor_mark_all_lines_dirty();
+            }
+            else if (event.bstate & BUTTON4_PRESSED)
+            {
+                editor_move_cursor_lines(-3);
+            }
+            else if (event.bstate & BUTTON5_PRESSED)
+            {
+                editor_move_cursor_lines(3);
+            }
+        }
+        return;
+    }
+
+    switch (ch)
+    {
+        case 8: /* Ctrl+H: toggle help */
+            show_help = !show_help;
+            editor_mark_all_lines_dirty();
+            break;
+        case 23: /* Ctrl+W: shell panel toggle */
+            shell_panel_toggle();
+            break;
+        case 5: /* Ctrl+E: run command in shell panel */
+            shell_panel_run_command();
+            break;
+        case 6: /* Ctrl+F: search */
+            editor_search();
+            break;
+        case 18: /* Ctrl+R: replace */
+            editor_replace_all();
+            editor_mark_all_lines_dirty();
+            break;
+        case 7: /* Ctrl+G: goto line */
+            editor_goto_line();
+            break;
+        case 17: /* Ctrl+Q: quit */
+            trace_record_quit();
+            session_save();
+            scr_handover();
+            endwin();
+            exit(0);
+            break;
+        case 26: /* Ctrl+Z: undo */
+            undo();
+            break;
+        case 25: /* Ctrl+Y: redo */
+            redo();
+            break;
+        case 19: /* Ctrl+S: save */
+            editor_save_file();
+            break;
+        case 15: /* Ctrl+O: open */
+            editor_load_file();
+            break;
+        case 4: /* Ctrl+D: Duplicate line */
+            editor_duplicate_line();
+            break;
+        case 11: /* Ctrl+K: Kill line */
+            editor_kill_line();
+            break;
+        case 20: /* Ctrl+T: Toggle line numbers */
+            editor_toggle_line_numbers();
+            break;
+        case 21: /* Ctrl+U: goto top */
+            editor_goto_top();
+            break;
+        case 12: /* Ctrl+L: goto bottom */
+            editor_goto_bottom();
+            break;
+        case 2: /* Ctrl+B: set/clear stream selection mark */
+            editor_selection_toggle(SELECTION_STREAM);
+            break;
+        case 1: /* Ctrl+A: set/clear rectangular selection mark */
+            editor_selection_toggle(SELECTION_RECT);
+            break;
+        case 3: /* Ctrl+C: copy selection */
+            editor_copy_selection();
+            selection_mode = SELECTION_NONE;
+            break;
+        case 24: /* Ctrl+X: cut selection */
+            editor_cut_selection();
+            break;
+        case 22: /* Ctrl+V: paste */
+            editor_paste();
+            break;
+        case 29: /* Ctrl+]: jump to definition */
+            editor_jump_to_definition();
+            break;
+        case 14: /* Ctrl+N: complete word */
+            editor_complete_word();
+            break;
+        case 16: /* Ctrl+P: jump to matching bracket */
+            editor_jump_to_bracket();
+            break;
+        case KEY_F(8): /* F8: diff against saved file */
+            editor_diff_saved();
+            break;
+        case KEY_F(9): /* F9: overview ruler */
+            minimap_toggle();
+            break;
+        case KEY_F(11): /* F11: memory report */
+            mem_report();
+            break;
+        case KEY_F(4): /* F4: fold/unfold at cursor */
+            fold_toggle_at_cursor();
+            break;
+        case KEY_F(3): /* F3: unfold all */
+            fold_unfold_all();
+            break;
+        case KEY_F(2): /* F2: add a cursor on the next line */
+            editor_add_cursor_below();
+            break;
+        case KEY_F(5): /* F5: start/stop macro recording */
+            macro_toggle_recording();
+            break;
+        case KEY_F(6): /* F6: replay macro once */
+            macro_replay(1);
+            break;
+        case KEY_F(7): /* F7: replay macro N times / to end of file */
+            macro_replay_prompt();
+            break;
+        case 27: /* Esc: clear selection */
+            selection_mode = SELECTION_NONE;
+            break;
+        case KEY_HOME:
+            editor.cursor_x = 0;
+            editor_mark_line_dirty(editor.cursor_y);
+            break;
+        case KEY_END:
+        {
+            int ln = (int)strlen(editor.text[editor.cursor_y]);
+            editor.cursor_x = ln;
+            editor_mark_line_dirty(editor.cursor_y);
+            break;
+        }
+        case KEY_PPAGE:
+            editor_move_cursor_lines(-5);
+            break;
+        case KEY_NPAGE:
+            editor_move_cursor_lines(5);
+            break;
+        case '\t':
+        {
+            int i;
+            save_state_undo();
+            if (config.tab_four_spaces)
+            {
+                for (i = 0; i < 4; i++)
+                {
+                    editor_insert_char(' ');
+                }
+            }
+            else
+            {
+                editor_insert_char('\t');
+            }
+            break;
+        }
+        case KEY_LEFT:
+            if (editor.cursor_x > 0)
+            {
+                editor.cursor_x--;
+                editor_mark_line_dirty(editor.cursor_y);
+            }
+            else if (editor.cursor_y > 0)
+            {
+                editor.cursor_y = fold_move_visible(editor.cursor_y, -1);
+                editor.cursor_x = (int)strlen(editor.text[editor.cursor_y]);
+                editor_mark_all_lines_dirty();
+            }
+            break;
+        case KEY_RIGHT:
+        {
+            int length = (int)strlen(editor.text[editor.cursor_y]);
+            if (editor.cursor_x < length)
+            {
+                editor.cursor_x++;
+                editor_mark_line_dirty(editor.cursor_y);
+            }
+            else if (fold_move_visible(editor.cursor_y, 1) != editor.cursor_y)
+            {
+                editor.cursor_y = fold_move_visible(editor.cursor_y, 1);
+                editor.cursor_x = 0;
+                editor_mark_all_lines_dirty();
+            }
+            break;
+        }
+        case KEY_UP:
+            if (editor.cursor_y > 0)
+            {
+                editor_move_cursor_lines(-1);
+            }
+            break;
+        case KEY_DOWN:
+            if (editor.cursor_y < editor.num_lines - 1)
+            {
+                editor_move_cursor_lines(1);
+            }
+            break;
+        case KEY_BACKSPACE:
+        case 127:
+            save_state_undo();
+            editor_delete_char();
+            break;
+        case KEY_DC:
+            save_state_undo();
+            editor_delete_at_cursor();
+            break;
+        case '\n':
+        case '\r':
+            save_state_undo();
+            editor_insert_newline();
+            break;
+        default:
+            /* Printable ASCII? Insert it. */
+            if (ch >= 32 && ch <= 126)
+            {
+                save_state_undo();
+                editor_insert_char(ch);
+            }
+            break;
+    }
+}
+
+/* ---------- Event Loop ---------- */
+/*
+    The editor waits in one poll() on the tty plus whatever else is
+    registered here: the wake-up pipe worker threads write to, a running
+    shell command's output and the file watch. The timeout is the nearest
+    timer (status message expiry, autosave, a deferred frame, a stopped
+    shell command due for SIGKILL), or none at all, so an idle editor does
+    not wake up.
+*/
+void event_watch_fd(int fd, EventHandler handler)
+{
+    if (event_watch_count < EVENT_MAX_WATCHES)
+    {
+        event_watches[event_watch_count].fd = fd;
+        event_watches[event_watch_count].handler = handler;
+        event_watch_count++;
+    }
+}
+
+void event_unwatch_fd(int fd)
+{
+    int i;
+    for (i = 0; i < event_watch_count; i++)
+    {
+        if (event_watches[i].fd == fd)
+        {
+            event_watches[i] = event_watches[--event_watch_count];
+            return;
+        }
+    }
+}
+
+/* Called from worker threads when they have a result for the main loop. */
+void event_wake(void)
+{
+    char byte = 1;
+    if (event_wake_pipe[1] >= 0 && write(event_wake_pipe[1], &byte, 1) < 0)
+    {
+        /* Pipe full: a wake-up is already pending. */
+    }
+}
+
+static void event_on_wake(int fd)
+{
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0)
+    {
+    }
+    shell_panel_reap();
+}
+
+/* A child exited: wake the loop so the shell command can be reaped (popen'd children are left to pclose). */
+static void event_on_sigchld(int sig)
+{
+    int saved = errno;
+    (void)sig;
+    event_wake();
+    errno = saved;
+}
+
+/* Remembers the current file as we last read or wrote it, so our own saves are not reported. */
+void file_watch_note(void)
+{
+    if (!current_file[0] || stat(current_file, &watch_known) != 0)
+    {
+        memset(&watch_known, 0, sizeof(watch_known));
+    }
+}
+
+/* Watches the current file's directory: saves by rename replace the file, so the name is what is watched. */
+void file_watch_update(void)
+{
+#ifdef __linux__
+    char dir[PROMPT_BUFFER_SIZE];
+    const char *slash = strrchr(current_file, '/');
+    if (watch_fd < 0)
+    {
+        return;
+    }
+    if (watch_wd >= 0)
+    {
+        inotify_rm_watch(watch_fd, watch_wd);
+        watch_wd = -1;
+    }
+    if (!current_file[0])
+    {
+        return;
+    }
+    if (slash)
+    {
+        snprintf(dir, sizeof(dir), "%.*s", slash == current_file ? 1 : (int)(slash - current_file), current_file);
+    }
+    else
+    {
+        snprintf(dir, sizeof(dir), ".");
+    }
+    snprintf(watch_name, sizeof(watch_name), "%s", slash ? slash + 1 : current_file);
+    watch_wd = inotify_add_watch(watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+#endif
+    file_watch_note();
+}
+
+#ifdef __linux__
+static void file_watch_on_event(int fd)
+{
+    union
+    {
+        struct inotify_event ev;
+        char bytes[4096];
+    } buf;
+    struct stat st;
+    ssize_t n;
+    int touched = 0;
+    while ((n = read(fd, &buf, sizeof(buf))) > 0)
+    {
+        char *p = buf.bytes;
+        while (p < buf.bytes + n)
+        {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->wd == watch_wd && ev->len > 0 && !strcmp(ev->name, watch_name))
+            {
+                touched = 1;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    if (touched && stat(current_file, &st) == 0 &&
+        (st.st_ino != watch_known.st_ino || st.st_size != watch_known.st_size ||
+         st.st_mtim.tv_sec != watch_known.st_mtim.tv_sec || st.st_mtim.tv_nsec != watch_known.st_mtim.tv_nsec))
+    {
+        watch_known = st;
+        /* Outside git the file on disk is the gutter's baseline. */
+        gutter_baseline_changed = 1;
+        editor_set_status_message("%s was changed on disk%s.", current_file,
+                                  dirty ? " (the buffer has unsaved edits)" : "");
+    }
+}
+#endif
+
+static void event_init(void)
+{
+    struct sigaction sa;
+    if (pipe(event_wake_pipe) == 0)
+    {
+        fcntl(event_wake_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(event_wake_pipe[1], F_SETFL, O_NONBLOCK);
+        fcntl(event_wake_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(event_wake_pipe[1], F_SETFD, FD_CLOEXEC);
+        event_watch_fd(event_wake_pipe[0], event_on_wake);
+    }
+    else
+    {
+        event_wake_pipe[0] = event_wake_pipe[1] = -1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = event_on_sigchld;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+#ifdef __linux__
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd >= 0)
+    {
+        event_watch_fd(watch_fd, file_watch_on_event);
+    }
+#endif
+}
+
+static void event_shrink_timeout(long *wait, long ms)
+{
+    if (ms < 0)
+    {
+        ms = 0;
+    }
+    if (*wait < 0 || ms < *wait)
+    {
+        *wait = ms;
+    }
+}
+
+/* Milliseconds until the nearest timer, or -1 when nothing is scheduled. */
+static int event_timeout_ms(void)
+{
+    long now = monotonic_ms(), wait = -1;
+    if (status_count > 0 && status_queue[status_head].expires > 0)
+    {
+        event_shrink_timeout(&wait, status_queue[status_head].expires - now);
+    }
+    if (autosave_wait_ms() >= 0)
+    {
+        event_shrink_timeout(&wait, autosave_wait_ms());
+    }
+    if (render_deferred && config.max_fps > 0)
+    {
+        event_shrink_timeout(&wait, render_last_frame + 1000L / config.max_fps - now);
+    }
+    if (shell_stopping_wait_ms() >= 0)
+    {
+        event_shrink_timeout(&wait, shell_stopping_wait_ms());
+    }
+    return (int)wait;
+}
+
+/* Sleeps until the tty is readable, a watched descriptor fires or a timer is due, then dispatches. */
+static void event_wait(void)
+{
+    struct pollfd pfd[1 + EVENT_MAX_WATCHES];
+    EventWatch ready[EVENT_MAX_WATCHES];
+    int i, n = 0, count = event_watch_count;
+    pfd[0].fd = STDIN_FILENO;
+    pfd[0].events = POLLIN;
+    for (i = 0; i < count; i++)
+    {
+        ready[i] = event_watches[i];
+        pfd[1 + i].fd = event_watches[i].fd;
+        pfd[1 + i].events = POLLIN;
+    }
+    /* EINTR (SIGWINCH) is fine: ncurses has noted the resize and getch() reports it. */
+    if (poll(pfd, (nfds_t)(1 + count), event_timeout_ms()) > 0)
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (pfd[1 + i].revents)
+            {
+                ready[n++] = ready[i];
+            }
+        }
+        /* Handlers may unwatch descriptors, so they run from the snapshot taken above. */
+        for (i = 0; i < n; i++)
+        {
+            ready[i].handler(ready[i].fd);
+        }
+    }
+    autosave_poll();
+    if (shell_stopping_count > 0)
+    {
+        shell_stopping_reap();
+    }
+}
+
+/* ---------- Batch Mode ---------- */
+/*
+    ced --batch [-jN] script file...
+
+    Runs the editor commands in 'script' (one per line, '#' starts a comment)
+    against every file without starting ncurses:
+        goto N | top | bottom | search TEXT | replace /OLD/NEW/ |
+        kill | dup | insert TEXT | newline | save [PATH]
+    A failed search stops the script for that file (nothing after it, including
+    save, runs). Files are processed by a pool of N worker processes; the editor
+    state is global, so each file is handled in its own forked worker.
+*/
+#define BATCH_MAX_COMMANDS 1024
+static char *batch_commands[BATCH_MAX_COMMANDS];
+static int batch_command_count = 0;
+
+static int batch_load_script(const char *path)
+{
+    char line[SH_MAX_LINE_LENGTH];
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        fprintf(stderr, "ced: cannot open script %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) && batch_command_count < BATCH_MAX_COMMANDS)
+    {
+        size_t ln = strlen(line);
+        if (ln > 0 && line[ln - 1] == '\n')
+        {
+            line[ln - 1] = '\0';
+        }
+        {
+            char *p = line;
+            while (*p == ' ' || *p == '\t')
+            {
+                p++;
+            }
+            if (*p == '\0' || *p == '#')
+            {
+                continue;
+            }
+            batch_commands[batch_command_count] = (char *)malloc(strlen(p) + 1);
+            strcpy(batch_commands[batch_command_count], p);
+            batch_command_count++;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* Runs one script command; returns 0 to continue, 1 to stop quietly, -1 on error. */
+static int batch_run_command(char *cmd)
+{
+    char *arg = strchr(cmd, ' ');
+    if (arg)
+    {
+        *arg++ = '\0';
+    }
+    else
+    {
+        arg = cmd + strlen(cmd);
+    }
+    if (!strcmp(cmd, "goto"))
+    {
+        editor_goto_line_number(atoi(arg));
+    }
+    else if (!strcmp(cmd, "top"))
+    {
+        editor_goto_top();
+    }
+    else if (!strcmp(cmd, "bottom"))
+    {
+        editor_goto_bottom();
+    }
+    else if (!strcmp(cmd, "search"))
+    {
+        if (editor_find_next(arg) != 0)
+        {
+            return 1;
+        }
+    }
+    else if (!strcmp(cmd, "replace"))
+    {
+        char delim = arg[0];
+        char *oldstr = arg + 1, *newstr, *end;
+        newstr = delim ? strchr(oldstr, delim) : NULL;
+        if (!newstr || newstr == oldstr)
+        {
+            editor_set_status_message("bad replace syntax, expected /old/new/");
+            return -1;
+        }
+        *newstr++ = '\0';
+        end = strchr(newstr, delim);
+        if (end)
+        {
+            *end = '\0';
+        }
+        editor_replace_all_with(oldstr, newstr);
+    }
+    else if (!strcmp(cmd, "kill"))
+    {
+        editor_kill_line();
+    }
+    else if (!strcmp(cmd, "dup"))
+    {
+        editor_duplicate_line();
+    }
+    else if (!strcmp(cmd, "insert"))
+    {
+        while (*arg)
+        {
+            editor_insert_char(*arg++);
+        }
+        dirty = 1;
+    }
+    else if (!strcmp(cmd, "newline"))
+    {
+        editor_insert_newline();
+        dirty = 1;
+    }
+    else if (!strcmp(cmd, "save"))
+    {
+        return editor_write_file(*arg ? arg : current_file);
+    }
+    else
+    {
+        editor_set_status_message("unknown command '%s'", cmd);
+        return -1;
+    }
+    return 0;
+}
+
+static int batch_process_file(const char *path)
+{
+    char cmd[SH_MAX_LINE_LENGTH];
+    int i;
+    init_editor();
+    if (editor_open_path(path) != 0)
+    {
+        return 1;
+    }
+    if (load_truncated)
+    {
+        /* Saving would write back a cut-down copy. */
+        return 1;
+    }
+    for (i = 0; i < batch_command_count; i++)
+    {
+        int rc;
+        strncpy(cmd, batch_commands[i], sizeof(cmd) - 1);
+        cmd[sizeof(cmd) - 1] = '\0';
+        rc = batch_run_command(cmd);
+        if (rc < 0)
+        {
+            return 1;
+        }
+        if (rc > 0)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+int batch_main(int argc, char **argv)
+{
+    int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int argi = 0, running = 0, failed = 0, next;
+    batch_mode = 1;
+    if (argi < argc && !strncmp(argv[argi], "-j", 2))
+    {
+        jobs = atoi(argv[argi] + 2);
+        argi++;
+    }
+    if (jobs < 1)
+    {
+        jobs = 1;
+    }
+    if (argc - argi < 2)
+    {
+        fprintf(stderr, "usage: ced --batch [-jN] script file...\n");
+        return 2;
+    }
+    load_config();
+    if (batch_load_script(argv[argi++]) != 0)
+    {
+        return 2;
+    }
+    for (next = argi; next < argc || running > 0;)
+    {
+        int status;
+        if (next < argc && running < jobs)
+        {
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                int status = batch_process_file(argv[next]);
+                prof_dump(); /* _exit skips atexit */
+                _exit(status);
+            }
+            if (pid < 0)
+            {
+                fprintf(stderr, "ced: fork failed: %s\n", strerror(errno));
+                failed++;
+            }
+            else
+            {
+                running++;
+            }
+            next++;
+            continue;
+        }
+        if (wait(&status) > 0)
+        {
+            running--;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+                failed++;
+            }
+        }
+    }
+    if (failed)
+    {
+        fprintf(stderr, "ced: %d of %d file(s) failed\n", failed, argc - argi);
+    }
+    return failed ? 1 : 0;
+}
+
+/* ---------- Headless Screen ---------- */
+#if defined(CED_BENCH) || defined(CED_REPLAY)
+/*
+    For --bench and --replay: a real ncurses screen (colour pairs, stdscr,
+    the VT presenter all work) whose output goes to /dev/null. stdout is
+    pointed at /dev/null while it runs and restored by headless_stop(), so
+    reports printed afterwards reach the caller.
+*/
+static SCREEN *headless_screen = NULL;
+static FILE *headless_in = NULL;
+static int headless_saved_stdout = -1;
+
+static int headless_start(int rows, int cols)
+{
+    const char *term = getenv("TERM");
+    int null_fd;
+    fflush(stdout);
+    headless_saved_stdout = dup(STDOUT_FILENO);
+    null_fd = open("/dev/null", O_RDWR);
+    headless_in = fopen("/dev/null", "r");
+    if (headless_saved_stdout < 0 || null_fd < 0 || !headless_in || dup2(null_fd, STDOUT_FILENO) < 0)
+    {
+        fprintf(stderr, "ced: cannot redirect output to /dev/null: %s\n", strerror(errno));
+        return -1;
+    }
+    close(null_fd);
+    headless_screen = newterm(term && term[0] ? term : "xterm", stdout, headless_in);
+    if (!headless_screen)
+    {
+        dup2(headless_saved_stdout, STDOUT_FILENO);
+        fprintf(stderr, "ced: cannot start ncurses for terminal type %s\n", term && term[0] ? term : "xterm");
+        return -1;
+    }
+    start_color();
+    use_default_colors();
+    resizeterm(rows, cols);
+    screen_rows = rows;
+    screen_cols = cols;
+    return 0;
+}
+
+static void headless_stop(void)
+{
+    endwin();
+    delscreen(headless_screen);
+    headless_screen = NULL;
+    fflush(stdout);
+    dup2(headless_saved_stdout, STDOUT_FILENO);
+    close(headless_saved_stdout);
+    headless_saved_stdout = -1;
+    fclose(headless_in);
+    headless_in = NULL;
+}
+#endif
+
+/* ---------- Benchmark ---------- */
+/*
+    ced --bench [-nN]
+
+    Times draw_line over synthetic C, assembly and log buffers (MAX_LINES
+    lines each) highlighted with the rules in ./highlight.syntax, with the
+    search overlay off and on, for each keyword matching strategy and into
+    both screen sinks (the VT back grid and ncurses' stdscr, neither sent to
+    the terminal), N passes per case. Then it times full frames scrolling
+    through the C buffer on each backend. Everything is drawn on a headless
+    screen; only the report reaches stdout. Each strategy's rendering is
+    checksummed, and the run fails if they disagree.
+*/
+#if defined(CED_BENCH) || defined(CED_FUZZ_MAIN) /* the fuzz driver mutates its inputs with bench_rand() */
+static unsigned long bench_seed = 1;
+
+static int bench_rand(int range)
+{
+    bench_seed = bench_seed * 6364136223846793005UL + 1442695040888963407UL;
+    return (int)((bench_seed >> 33) % (unsigned long)range);
+}
+#endif
+
+#ifdef CED_BENCH
+#define BENCH_ROWS 50
+#define BENCH_COLS 160
+#define BENCH_FRAMES_PER_PASS 25
+
+static const char *const bench_c_lines[] = {
+    "static int parse_%d(const char *s, unsigned long n)",
+    "{",
+    "    int count = %d;",
+    "    for (int i = 0; i < n; i++)",
+    "        if (s[i] == ';') count += %d; else if (!s[i]) break;",
+    "    while (count > %d && buffer[count] != 0) count--;",
+    "    /* fields seen so far: %d */",
+    "    switch (mode_%d) { case 1: return -1; default: break; }",
+    "    struct node *next = table[%d].next; double weight = 0.5;",
+    "    return count + sizeof(struct header) * %d;",
+    "}",
+    "",
+    "typedef struct entry_%d { volatile long key; const char *name; } entry_t;",
+};
+static const char *const bench_asm_lines[] = {
+    "section .text",
+    "func_%d:",
+    "    mov eax, [ebp+%d]",
+    "    add eax, ebx",
+    "    cmp ecx, %d",
+    "    jne .L%d",
+    "    call helper_%d",
+    "    sub esp, %d",
+    "    ret",
+    ".L%d:  ; loop body, %d iterations",
+    "    mov edx, [table+ecx*4]",
+};
+static const char *const bench_log_lines[] = {
+    "2026-10-17T12:00:%02d.%03dZ INFO  [worker-%d] GET /api/v1/items/%d status=200 latency_ms=%d",
+    "2026-10-17T12:00:%02d.%03dZ INFO  [worker-%d] POST /api/v1/orders/%d status=201 latency_ms=%d",
+    "2026-10-17T12:00:%02d.%03dZ WARN  [worker-%d] slow query on shard %d took %d ms (limit 250)",
+    "2026-10-17T12:00:%02d.%03dZ ERROR [worker-%d] request %d failed: connection reset by peer (attempt %d)",
+    "2026-10-17T12:00:%02d.%03dZ DEBUG [scheduler] queue depth=%d in_flight=%d idle_workers=%d",
+};
+
+typedef struct BenchCorpus
+{
+    const char *name;
+    const char *file; /* picks the syntax by extension */
+    const char *search;
+    const char *const *lines;
+    int line_count;
+    int shuffle; /* pick templates at random instead of in order */
+} BenchCorpus;
+
+/* Fills the buffer from the corpus templates; every %d gets a pseudo-random number. */
+static void bench_fill(const BenchCorpus *corpus)
+{
     int i;
-    if (len >= MAX_COLS - 1)
+    bench_seed = 1;
+    init_editor();
+    for (i = 0; i < MAX_LINES; i++)
     {
-        return;
+        const char *fmt = corpus->lines[corpus->shuffle ? bench_rand(corpus->line_count) : i % corpus->line_count];
+        snprintf(editor.text[i], MAX_COLS, fmt, bench_rand(60), bench_rand(1000), bench_rand(16), bench_rand(100000),
+                 bench_rand(500));
     }
-    for (i = len; i >= editor.cursor_x; i--)
+    editor.num_lines = MAX_LINES;
+    snprintf(current_file, sizeof(current_file), "%s", corpus->file);
+    editor_buffer_replaced();
+    editor_select_syntax();
+}
+
+static long bench_chars(void)
+{
+    long chars = 0;
+    int i;
+    for (i = 0; i < editor.num_lines; i++)
     {
-        line[i + 1] = line[i];
+        int len = (int)strlen(editor.text[i]);
+        chars += len < BENCH_COLS ? len : BENCH_COLS;
     }
-    line[editor.cursor_x] = (char)ch;
-    editor.cursor_x++;
-    editor_mark_line_dirty(editor.cursor_y);
+    return chars;
 }
 
-/* Delete char to the left of the cursor */
-void editor_delete_char(void)
+/* Hash of every line as draw_line renders it into the VT back grid. */
+static unsigned long bench_checksum(void)
 {
-    if (editor.cursor_x == 0)
+    unsigned long h = 5381;
+    int i, x;
+    vt_backend = 1;
+    for (i = 0; i < editor.num_lines; i++)
     {
-        if (editor.cursor_y == 0)
+        draw_line(0, i, BENCH_COLS);
+        for (x = 0; x < BENCH_COLS; x++)
         {
-            return;
+            h = h * 33 + vt_back[x];
         }
-        else
+    }
+    return h;
+}
+
+/* Draws every line 'passes' times into the sink; returns ns per character. */
+static double bench_draw_lines(int sink_vt, int passes)
+{
+    long start, elapsed;
+    int p, i;
+    vt_backend = sink_vt;
+    start = monotonic_us();
+    for (p = 0; p < passes; p++)
+    {
+        for (i = 0; i < editor.num_lines; i++)
         {
-            int prev_len = (int)strlen(editor.text[editor.cursor_y - 1]);
-            strcat(editor.text[editor.cursor_y - 1], editor.text[editor.cursor_y]);
+            draw_line(i % BENCH_ROWS, i, BENCH_COLS);
+        }
+    }
+    elapsed = monotonic_us() - start;
+    return (double)elapsed * 1000.0 / ((double)passes * (double)bench_chars());
+}
+
+/* Full frames scrolling one line at a time, each sent to the (null) terminal; returns ms per frame. */
+static double bench_frames(int use_vt, int frames)
+{
+    long start, elapsed;
+    int f;
+    vt_backend = use_vt;
+    clear();
+    scr_invalidate(0);
+    start = monotonic_us();
+    for (f = 0; f < frames; f++)
+    {
+        editor.row_offset = editor.cursor_y = f % (editor.num_lines - BENCH_ROWS);
+        editor.cursor_x = 0;
+        editor_mark_all_lines_dirty();
+        editor_refresh_screen(FRAME_FULL);
+    }
+    elapsed = monotonic_us() - start;
+    return (double)elapsed / frames / 1e3;
+}
+
+int bench_main(int argc, char **argv)
+{
+    static const BenchCorpus corpora[] = {
+        {"c", "bench.c", "count", bench_c_lines, (int)(sizeof(bench_c_lines) / sizeof(bench_c_lines[0])), 0},
+        {"asm", "bench.asm", "eax", bench_asm_lines, (int)(sizeof(bench_asm_lines) / sizeof(bench_asm_lines[0])), 0},
+        {"log", "bench.log", "ERROR", bench_log_lines, (int)(sizeof(bench_log_lines) / sizeof(bench_log_lines[0])), 1},
+    };
+    static const char *const strategy_names[] = {"linear", "indexed"};
+    int passes = 20, c, search, strategy, sink, failed = 0;
+
+    if (argc > 0 && !strncmp(argv[0], "-n", 2))
+    {
+        passes = atoi(argv[0] + 2);
+    }
+    if (passes < 1)
+    {
+        fprintf(stderr, "usage: ced --bench [-nN]\n");
+        return 2;
+    }
+
+    if (headless_start(BENCH_ROWS, BENCH_COLS) != 0)
+    {
+        return 1;
+    }
+
+    {
+        char report[8192];
+        size_t n = 0;
+        double ms[2];
+        n += (size_t)snprintf(report + n, sizeof(report) - n,
+                              "ced --bench: %d lines, %dx%d screen, %d passes\n"
+                              "%-6s %-8s %-7s %-6s %-8s %9s\n",
+                              MAX_LINES, BENCH_COLS, BENCH_ROWS, passes, "corpus", "keywords", "search", "sink",
+                              "strategy", "ns/char");
+        for (c = 0; c < (int)(sizeof(corpora) / sizeof(corpora[0])); c++)
+        {
+            unsigned long sums[2];
+            bench_fill(&corpora[c]);
+            for (strategy = 0; strategy < 2; strategy++)
             {
-                int i;
-                for (i = editor.cursor_y; i < editor.num_lines - 1; i++)
+                highlight_strategy = strategy;
+                sums[strategy] = bench_checksum();
+            }
+            if (sums[HIGHLIGHT_LINEAR] != sums[HIGHLIGHT_INDEXED])
+            {
+                n += (size_t)snprintf(report + n, sizeof(report) - n, "%-6s strategies render differently\n",
+                                      corpora[c].name);
+                failed = 1;
+            }
+            for (search = 0; search < 2; search++)
+            {
+                snprintf(g_searchTerm, sizeof(g_searchTerm), "%s", corpora[c].search);
+                g_searchActive = search;
+                for (sink = 0; sink < 2; sink++)
                 {
-                    strcpy(editor.text[i], editor.text[i + 1]);
+                    /* Without a keyword table both strategies draw the same way. */
+                    for (strategy = 0; strategy < (syntax_enabled ? 2 : 1); strategy++)
+                    {
+                        highlight_strategy = strategy;
+                        show_line_numbers = 0;
+                        n += (size_t)snprintf(report + n, sizeof(report) - n, "%-6s %-8d %-7s %-6s %-8s %9.1f\n",
+                                              corpora[c].name, syntax_enabled ? token_lookup_count : 0,
+                                              search ? corpora[c].search : "off", sink ? "curses" : "grid",
+                                              syntax_enabled ? strategy_names[strategy] : "-",
+                                              bench_draw_lines(!sink, passes));
+                    }
                 }
             }
-            editor.num_lines--;
-            editor.cursor_y--;
-            editor.cursor_x = prev_len;
-            editor_mark_all_lines_dirty();
         }
+        g_searchActive = 0;
+        show_line_numbers = 1;
+        highlight_strategy = HIGHLIGHT_INDEXED;
+        bench_fill(&corpora[0]);
+        ms[0] = bench_frames(0, passes * BENCH_FRAMES_PER_PASS);
+        ms[1] = bench_frames(1, passes * BENCH_FRAMES_PER_PASS);
+        n += (size_t)snprintf(report + n, sizeof(report) - n,
+                              "%d full frames scrolling the c corpus: ncurses %.3f ms/frame, vt %.3f ms/frame\n",
+                              passes * BENCH_FRAMES_PER_PASS, ms[0], ms[1]);
+
+        headless_stop();
+        fputs(report, stdout);
     }
-    else
+    return failed;
+}
+#endif
+
+/* ---------- Trace Replay ---------- */
+#ifdef CED_REPLAY
+/*
+    ced --replay [-r] trace
+
+    Opens the file the trace was recorded on, checks that it still hashes
+    to what the recording started from, and feeds the events back on a
+    headless screen of the recorded size, drawing a full frame after every
+    key. With -r the recorded pauses are kept (real speed, so timers and
+    background work line up as they did); otherwise keys follow each other
+    at once. Saves and shell commands are not carried out. Prints key
+    handling times as recorded and as replayed, plus frame times, and exits
+    1 if the buffer does not end up with the hash the recording ended with.
+*/
+static int trace_load(const char *path, int *rows, int *cols, unsigned long *hash, int *view, char *file,
+                      size_t filesize)
+{
+    char line[PROMPT_BUFFER_SIZE + 64], magic[16];
+    int version, n = 0, cap = 0;
+    FILE *fp = fopen(path, "r");
+    if (!fp)
     {
-        char *line = editor.text[editor.cursor_y];
-        int len = (int)strlen(line);
-        int i;
-        for (i = editor.cursor_x - 1; i < len; i++)
+        fprintf(stderr, "ced: cannot open trace %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (!fgets(line, sizeof(line), fp) ||
+        sscanf(line, "%15s %d %d %d %lu %d %d %d %d %n", magic, &version, rows, cols, hash, &view[0], &view[1],
+               &view[2], &view[3], &n) < 9 ||
+        strcmp(magic, TRACE_MAGIC) != 0 || version != TRACE_VERSION)
+    {
+        fprintf(stderr, "ced: %s is not a version %d trace\n", path, TRACE_VERSION);
+        fclose(fp);
+        return -1;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    snprintf(file, filesize, "%s", line + n);
+    while (fgets(line, sizeof(line), fp))
+    {
+        TraceEvent ev;
+        int used = 0;
+        line[strcspn(line, "\n")] = '\0';
+        memset(&ev, 0, sizeof(ev));
+        if (sscanf(line, "%ld %c%n", &ev.ms, &ev.kind, &used) < 2)
         {
-            line[i] = line[i + 1];
+            continue;
         }
-        editor.cursor_x--;
-        editor_mark_line_dirty(editor.cursor_y);
+        if (ev.kind == 'P')
+        {
+            /* The answer is the rest of the line after "P ", possibly empty. */
+            const char *text = line + used + (line[used] == ' ');
+            ev.text = (char *)malloc(strlen(text) + 1);
+            strcpy(ev.text, text);
+        }
+        else if (ev.kind == 'Q')
+        {
+            sscanf(line + used, "%lu", &ev.c);
+        }
+        else
+        {
+            sscanf(line + used, "%d %d %lu", &ev.a, &ev.b, &ev.c);
+        }
+        if (trace_event_count == cap)
+        {
+            cap = cap ? cap * 2 : 1024;
+            trace_events = (TraceEvent *)realloc(trace_events, sizeof(TraceEvent) * cap);
+        }
+        trace_events[trace_event_count++] = ev;
     }
+    fclose(fp);
+    return 0;
 }
 
-/* Delete char at the cursor */
-void editor_delete_at_cursor(void)
+static int compare_long(const void *a, const void *b)
 {
-    char *line = editor.text[editor.cursor_y];
-    int len = (int)strlen(line);
-    if (editor.cursor_x == len)
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/* One line of percentiles over 'n' durations in microseconds (sorted in place). */
+static void trace_report_times(const char *label, long *us, int n)
+{
+    long total = 0;
+    int i;
+    if (n == 0)
     {
-        /* Join with next line, if any */
-        if (editor.cursor_y == editor.num_lines - 1)
+        printf("%-16s none\n", label);
+        return;
+    }
+    qsort(us, n, sizeof(long), compare_long);
+    for (i = 0; i < n; i++)
+    {
+        total += us[i];
+    }
+    printf("%-16s %6d  p50 %8.3f ms  p99 %8.3f ms  max %8.3f ms  total %9.1f ms\n", label, n, us[n / 2] / 1000.0,
+           us[(int)((n - 1) * 0.99)] / 1000.0, us[n - 1] / 1000.0, total / 1000.0);
+}
+
+int replay_main(int argc, char **argv)
+{
+    char file[PROMPT_BUFFER_SIZE];
+    char slowest_key[32] = "";
+    int rows, cols, view[4], realtime = 0, keys = 0, recorded = 0, have_end = 0, failed = 0;
+    unsigned long start_hash, end_hash = 0, hash;
+    long *handle_us, *frame_us, *recorded_us, slowest_us = -1, slowest_ms = 0, start;
+
+    if (argc > 0 && !strcmp(argv[0], "-r"))
+    {
+        realtime = 1;
+        argc--;
+        argv++;
+    }
+    if (argc != 1)
+    {
+        fprintf(stderr, "usage: ced --replay [-r] trace\n");
+        return 2;
+    }
+    if (trace_load(argv[0], &rows, &cols, &start_hash, view, file, sizeof(file)) != 0 ||
+        headless_start(rows, cols) != 0)
+    {
+        return 2;
+    }
+    handle_us = (long *)malloc(sizeof(long) * (trace_event_count + 1));
+    frame_us = (long *)malloc(sizeof(long) * (trace_event_count + 1));
+    recorded_us = (long *)malloc(sizeof(long) * (trace_event_count + 1));
+
+    init_editor();
+    if (file[0] && editor_open_path(file) == 0)
+    {
+        editor_select_syntax();
+    }
+    editor.cursor_y = view[0];
+    editor.cursor_x = view[1];
+    editor.row_offset = view[2];
+    editor.col_offset = view[3];
+    hash = editor_buffer_hash();
+
+    trace_replaying = 1;
+    start = monotonic_ms();
+    while (trace_next < trace_event_count)
+    {
+        TraceEvent *ev = &trace_events[trace_next++];
+        if (realtime && ev->ms > monotonic_ms() - start)
         {
-            return;
+            poll(NULL, 0, (int)(ev->ms - (monotonic_ms() - start)));
         }
-        strcat(line, editor.text[editor.cursor_y + 1]);
+        switch (ev->kind)
         {
-            int i;
-            for (i = editor.cursor_y + 1; i < editor.num_lines - 1; i++)
+            case 'K':
             {
-                strcpy(editor.text[i], editor.text[i + 1]);
+                long t0, t1, t2;
+                if (ev->a == 17)
+                {
+                    /* Ctrl+Q: the Q event that follows has the final hash. */
+                    break;
+                }
+                t0 = monotonic_us();
+                editor_process_key(ev->a);
+                t1 = monotonic_us();
+                editor_refresh_screen(FRAME_FULL);
+                t2 = monotonic_us();
+                handle_us[keys] = t1 - t0;
+                frame_us[keys] = t2 - t1;
+                if (handle_us[keys] > slowest_us)
+                {
+                    const char *name = keyname(ev->a);
+                    slowest_us = handle_us[keys];
+                    slowest_ms = ev->ms;
+                    snprintf(slowest_key, sizeof(slowest_key), "%s", name ? name : "?");
+                }
+                keys++;
+                break;
             }
+            case 'D':
+                recorded_us[recorded++] = ev->a;
+                break;
+            case 'R':
+                screen_rows = ev->a;
+                screen_cols = ev->b;
+                resizeterm(screen_rows, screen_cols);
+                scr_invalidate(0);
+                editor_mark_all_lines_dirty();
+                break;
+            case 'Q':
+                end_hash = ev->c;
+                have_end = 1;
+                break;
+            default:
+                /* A prompt answer or mouse position nobody asked for. */
+                trace_desyncs++;
+                break;
         }
-        editor.num_lines--;
-        editor_mark_all_lines_dirty();
+    }
+    headless_stop();
+
+    printf("replayed %s: %d keys over %.1f s as recorded%s\n", argv[0], keys,
+           trace_event_count ? trace_events[trace_event_count - 1].ms / 1000.0 : 0.0,
+           realtime ? " (real speed)" : "");
+    if (hash != start_hash)
+    {
+        printf("start: %s differs from the recording (hash %lu, expected %lu)\n", file[0] ? file : "buffer", hash,
+               start_hash);
+        failed = 1;
+    }
+    trace_report_times("handle recorded", recorded_us, recorded);
+    trace_report_times("handle replayed", handle_us, keys);
+    trace_report_times("frame replayed", frame_us, keys);
+    if (slowest_us >= 0)
+    {
+        printf("slowest key: %s at %.1f s (%.3f ms)\n", slowest_key, slowest_ms / 1000.0, slowest_us / 1000.0);
+    }
+    if (trace_desyncs > 0)
+    {
+        printf("warning: %d events did not line up with what the editor asked for\n", trace_desyncs);
+    }
+    hash = editor_buffer_hash();
+    if (!have_end)
+    {
+        printf("end: no final hash in the trace (recording did not quit); buffer hash %lu\n", hash);
+    }
+    else if (hash != end_hash)
+    {
+        printf("end: buffer hash %lu, recorded %lu: MISMATCH\n", hash, end_hash);
+        failed = 1;
     }
     else
     {
-        int i;
-        for (i = editor.cursor_x; i < len; i++)
-        {
-            line[i] = line[i + 1];
-        }
-        editor_mark_line_dirty(editor.cursor_y);
+        printf("end: buffer hash %lu matches the recording\n", hash);
     }
+    free(handle_us);
+    free(frame_us);
+    free(recorded_us);
+    return failed;
 }
+#endif
 
-void editor_insert_newline(void)
+/* ---------- Client/Server Mode ---------- */
+/*
+    ced --daemon [file...] keeps config, syntax definitions and file contents
+    warm in one long-lived process listening on a UNIX socket. ced --client
+    [file] hands its terminal (stdin/stdout/stderr) to the daemon over the
+    socket; the daemon forks a session that inherits the warm state and drives
+    that terminal directly, so ncurses' own diffed output goes straight to the
+    client's tty and the client just waits for the session to end.
+*/
+typedef struct DaemonRequest
 {
-    if (editor.num_lines >= MAX_LINES)
+    char cwd[PATH_MAX];
+    char path[PROMPT_BUFFER_SIZE];
+    char term[64];
+    int has_path;
+} DaemonRequest;
+
+/*
+    Puts the socket path in 'buf': $CED_SOCKET, else ced.sock in $XDG_RUNTIME_DIR,
+    else in /tmp/ced-<uid>/. That last directory is created private when
+    'create' is set and is refused if someone else owns it or can enter it.
+    Returns 0, or -1 with a message on stderr.
+*/
+static int daemon_socket_path(char *buf, size_t bufsize, int create)
+{
+    const char *env = getenv("CED_SOCKET");
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    struct sockaddr_un addr;
+    if (env && env[0])
     {
-        return;
+        snprintf(buf, bufsize, "%s", env);
     }
+    else if (runtime && runtime[0])
     {
-        char *line = editor.text[editor.cursor_y];
-        int len = (int)strlen(line);
-        char remainder[MAX_COLS];
-        strcpy(remainder, line + editor.cursor_x);
-        line[editor.cursor_x] = '\0';
+        snprintf(buf, bufsize, "%s/ced.sock", runtime);
+    }
+    else
+    {
+        struct stat st;
+        snprintf(buf, bufsize, "/tmp/ced-%d", (int)getuid());
+        if (create && mkdir(buf, 0700) == -1 && errno != EEXIST)
         {
-            int i;
-            for (i = editor.num_lines; i > editor.cursor_y + 1; i--)
-            {
-                strcpy(editor.text[i], editor.text[i - 1]);
-            }
+            fprintf(stderr, "ced: cannot create %s: %s\n", buf, strerror(errno));
+            return -1;
         }
-        if (config.auto_indent)
+        if (lstat(buf, &st) == 0 &&
+            (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0))
         {
-            int indent = 0;
-            while (line[indent] == ' ' && indent < MAX_COLS - 1)
-            {
-                indent++;
-            }
+            fprintf(stderr, "ced: %s is not a private directory owned by you\n", buf);
+            return -1;
+        }
+        strncat(buf, "/ced.sock", bufsize - strlen(buf) - 1);
+    }
+    if (strlen(buf) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "ced: socket path too long: %s\n", buf);
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns the cached copy of 'path', (re)reading it if it is new or changed on disk. */
+static DaemonFile *daemon_cache_file(const char *path)
+{
+    char abs[PATH_MAX];
+    struct stat st;
+    DaemonFile *df = NULL;
+    int i;
+    if (!realpath(path, abs) || stat(abs, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        return NULL;
+    }
+    for (i = 0; i < daemon_file_count; i++)
+    {
+        if (!strcmp(daemon_files[i].path, abs))
+        {
+            df = &daemon_files[i];
+            if (df->st.st_dev == st.st_dev && df->st.st_ino == st.st_ino && df->st.st_size == st.st_size &&
+                df->st.st_mtim.tv_sec == st.st_mtim.tv_sec && df->st.st_mtim.tv_nsec == st.st_mtim.tv_nsec &&
+                df->st.st_ctim.tv_sec == st.st_ctim.tv_sec && df->st.st_ctim.tv_nsec == st.st_ctim.tv_nsec)
             {
-                char new_line[MAX_COLS];
-                memset(new_line, ' ', indent);
-                new_line[indent] = '\0';
-                strncat(new_line, remainder, MAX_COLS - indent - 1);
-                strcpy(editor.text[editor.cursor_y + 1], new_line);
+                return df;
             }
-            editor.cursor_x = indent;
+            break;
         }
-        else
+    }
+    if (!df)
+    {
+        daemon_files = (DaemonFile *)realloc(daemon_files, sizeof(DaemonFile) * (daemon_file_count + 1));
+        df = &daemon_files[daemon_file_count++];
+        strcpy(df->path, abs);
+        df->data = NULL;
+    }
+    {
+        FILE *fp = fopen(abs, "r");
+        free(df->data);
+        df->data = (char *)malloc((size_t)st.st_size + 1);
+        df->size = fp ? fread(df->data, 1, (size_t)st.st_size, fp) : 0;
+        df->st = st;
+        if (fp)
         {
-            strcpy(editor.text[editor.cursor_y + 1], remainder);
-            editor.cursor_x = 0;
+            fclose(fp);
         }
-        editor.num_lines++;
-        editor.cursor_y++;
-        editor_mark_all_lines_dirty();
     }
+    return df;
 }
 
-/* ---------- QoL: Duplicate current line (Ctrl+D) ---------- */
-void editor_duplicate_line(void)
+static void daemon_serve(int listen_fd, int conn, const DaemonRequest *req, const int *fds)
 {
-    if (editor.num_lines >= MAX_LINES)
+    char full[PATH_MAX + PROMPT_BUFFER_SIZE];
+    DaemonFile *df = NULL;
+    pid_t pid;
+    if (req->has_path)
     {
-        return;
+        if (req->path[0] == '/')
+        {
+            snprintf(full, sizeof(full), "%s", req->path);
+        }
+        else
+        {
+            snprintf(full, sizeof(full), "%s/%s", req->cwd, req->path);
+        }
+        df = daemon_cache_file(full);
     }
-    save_state_undo();
-    int y = editor.cursor_y;
-    /* shift lines down from the bottom if needed */
-    for (int i = editor.num_lines; i > y + 1; i--)
+    pid = fork();
+    if (pid == 0)
     {
-        strcpy(editor.text[i], editor.text[i - 1]);
+        FILE *src = NULL;
+        close(listen_fd);
+        dup2(fds[0], 0);
+        dup2(fds[1], 1);
+        dup2(fds[2], 2);
+        if (chdir(req->cwd) == -1)
+        {
+            _exit(1);
+        }
+        if (req->term[0])
+        {
+            setenv("TERM", req->term, 1);
+        }
+        if (df && df->size > 0)
+        {
+            src = fmemopen(df->data, df->size, "r");
+        }
+        /* 'conn' stays open in the session; its close tells the client we are done. */
+        {
+            pid_t self = getpid();
+            if (write(conn, &self, sizeof(self)) != (ssize_t)sizeof(self))
+            {
+                _exit(1);
+            }
+        }
+        _exit(editor_interactive(req->has_path ? req->path : NULL, src));
     }
-    strcpy(editor.text[y + 1], editor.text[y]);
-    editor.num_lines++;
-    editor.cursor_y++;
-    editor_mark_all_lines_dirty();
 }
 
-/* ---------- QoL: Kill (delete) entire current line (Ctrl+K) ---------- */
-void editor_kill_line(void)
+int daemon_main(int argc, char **argv)
 {
-    if (editor.num_lines == 1 && editor.cursor_y == 0)
+    char sock_path[PATH_MAX];
+    struct sockaddr_un addr;
+    int listen_fd, i;
+
+    for (i = 0; i < argc; i++)
     {
-        /* If there's only one line, just clear it. */
-        editor.text[0][0] = '\0';
-        editor.cursor_x = 0;
-        editor_mark_line_dirty(0);
-        return;
+        if (!daemon_cache_file(argv[i]))
+        {
+            fprintf(stderr, "ced: cannot preload %s\n", argv[i]);
+        }
     }
-    save_state_undo();
-    for (int i = editor.cursor_y; i < editor.num_lines - 1; i++)
+    if (daemon_socket_path(sock_path, sizeof(sock_path), 1) != 0)
     {
-        strcpy(editor.text[i], editor.text[i + 1]);
+        return 1;
     }
-    editor.num_lines--;
-    if (editor.cursor_y >= editor.num_lines)
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1)
     {
-        editor.cursor_y = editor.num_lines - 1;
+        perror("ced: socket");
+        return 1;
     }
-    if (editor.cursor_y < 0)
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, sock_path, strlen(sock_path) + 1);
+    unlink(sock_path);
     {
-        editor.cursor_y = 0;
+        /* Created 0600 from the start: there is no window where another user can connect. */
+        mode_t old_mask = umask(077);
+        int rc = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+        umask(old_mask);
+        if (rc == -1 || listen(listen_fd, 16) == -1)
+        {
+            perror("ced: bind");
+            return 1;
+        }
     }
-    editor.cursor_x = 0;
-    editor_mark_all_lines_dirty();
-}
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "ced: daemon listening on %s\n", sock_path);
 
-/* ---------- QoL: Toggle line numbers (Ctrl+T) ---------- */
-void editor_toggle_line_numbers(void)
-{
-    show_line_numbers = !show_line_numbers;
-    editor_mark_all_lines_dirty();
+    while (1)
+    {
+        DaemonRequest req;
+        struct msghdr msg;
+        struct iovec iov;
+        char cbuf[CMSG_SPACE(sizeof(int) * 3)];
+        struct cmsghdr *cmsg;
+        int fds[3], conn = accept(listen_fd, NULL, NULL);
+        if (conn == -1)
+        {
+            continue;
+        }
+#ifdef SO_PEERCRED
+        {
+            /* A session runs shell commands as us, so only we may start one. */
+            struct ucred cred;
+            socklen_t cred_len = sizeof(cred);
+            if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 || cred.uid != getuid())
+            {
+                close(conn);
+                continue;
+            }
+        }
+#endif
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &req;
+        iov.iov_len = sizeof(req);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        if (recvmsg(conn, &msg, MSG_WAITALL) == (ssize_t)sizeof(req) &&
+            (cmsg = CMSG_FIRSTHDR(&msg)) != NULL &&
+            cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int) * 3))
+        {
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+            req.cwd[sizeof(req.cwd) - 1] = '\0';
+            req.path[sizeof(req.path) - 1] = '\0';
+            req.term[sizeof(req.term) - 1] = '\0';
+            daemon_serve(listen_fd, conn, &req, fds);
+            for (i = 0; i < 3; i++)
+            {
+                close(fds[i]);
+            }
+        }
+        close(conn);
+    }
+    return 0;
 }
 
-/* ---------- QoL: Jump to top (Ctrl+U) ---------- */
-void editor_goto_top(void)
+/* The session is not in the terminal's foreground process group, so the client relays window size changes. */
+static volatile sig_atomic_t client_winch = 0;
+static void client_on_winch(int sig)
 {
-    editor.cursor_y = 0;
-    editor.cursor_x = 0;
-    editor_mark_all_lines_dirty();
+    (void)sig;
+    client_winch = 1;
 }
 
-/* ---------- QoL: Jump to bottom (Ctrl+L) ---------- */
-void editor_goto_bottom(void)
+int client_main(const char *path)
 {
-    editor.cursor_y = editor.num_lines - 1;
-    if (editor.cursor_y < 0)
+    char sock_path[PATH_MAX];
+    struct sockaddr_un addr;
+    DaemonRequest req;
+    struct msghdr msg;
+    struct iovec iov;
+    char cbuf[CMSG_SPACE(sizeof(int) * 3)];
+    struct cmsghdr *cmsg;
+    struct termios saved;
+    struct sigaction sa;
+    int fds[3] = {0, 1, 2};
+    int fd, have_termios;
+    pid_t session = 0;
+    ssize_t got;
+    char byte;
+
+    memset(&req, 0, sizeof(req));
+    if (!getcwd(req.cwd, sizeof(req.cwd)))
     {
-        editor.cursor_y = 0;
+        perror("ced: getcwd");
+        return 1;
+    }
+    if (path)
+    {
+        snprintf(req.path, sizeof(req.path), "%s", path);
+        req.has_path = 1;
+    }
+    if (getenv("TERM"))
+    {
+        snprintf(req.term, sizeof(req.term), "%s", getenv("TERM"));
     }
-    editor.cursor_x = (int)strlen(editor.text[editor.cursor_y]);
-    editor_mark_all_lines_dirty();
-}
 
-/* ---------- Editor Prompt ---------- */
-static void editor_prompt(char *prompt, char *buffer, size_t bufsize)
-{
-    int rows, cols;
-    getmaxyx(stdscr, rows, cols);
-    move(rows - 1, 0);
-    clrtoeol();
-    mvprintw(rows - 1, 0, "%s", prompt);
-    echo();
-    curs_set(1);
-    getnstr(buffer, (int)bufsize - 1);
-    noecho();
-    curs_set(1);
-}
+    if (daemon_socket_path(sock_path, sizeof(sock_path), 0) != 0)
+    {
+        return 1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, sock_path, strlen(sock_path) + 1);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        fprintf(stderr, "ced: no daemon on %s (start one with ced --daemon)\n", sock_path);
+        return 1;
+    }
 
-/* ---------- Goto Line ---------- */
-void editor_goto_line(void)
-{
-    char line_str[PROMPT_BUFFER_SIZE];
-    editor_prompt("Goto line: ", line_str, sizeof(line_str));
-    if (!line_str[0])
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    have_termios = (tcgetattr(0, &saved) == 0);
+    if (sendmsg(fd, &msg, 0) != (ssize_t)sizeof(req))
     {
-        return;
+        perror("ced: sendmsg");
+        return 1;
     }
+    /* The session owns the terminal now; forward resizes to it until it hangs up. */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = client_on_winch;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, NULL); /* no SA_RESTART: the read below returns to relay it */
+    while ((got = read(fd, &session, sizeof(session))) == -1 && errno == EINTR)
     {
-        int ln = atoi(line_str);
-        if (ln < 1)
-        {
-            ln = 1;
-        }
-        if (ln > editor.num_lines)
+    }
+    if (got != (ssize_t)sizeof(session))
+    {
+        session = 0;
+    }
+    while ((got = read(fd, &byte, 1)) > 0 || (got == -1 && errno == EINTR))
+    {
+        if (client_winch && session > 0)
         {
-            ln = editor.num_lines;
+            client_winch = 0;
+            kill(session, SIGWINCH);
         }
-        editor.cursor_y = ln - 1;
-        editor.cursor_x = 0;
-        editor_mark_all_lines_dirty();
     }
+    if (have_termios)
+    {
+        tcsetattr(0, TCSANOW, &saved);
+    }
+    close(fd);
+    return 0;
 }
 
-/* ---------- Save File ---------- */
-void editor_save_file(void)
+/* ---------- Fuzzing ---------- */
+/*
+    Built only with -DCED_FUZZ, which replaces main() with the libFuzzer
+    entry point LLVMFuzzerTestOneInput:
+
+        clang -g -O1 -fsanitize=fuzzer,address -DCED_FUZZ -o ced-fuzz main.c -lncurses -lpthread
+        ./ced-fuzz corpus/
+
+    Adding -DCED_FUZZ_MAIN gives a plain driver instead (any compiler, AFL):
+    "ced-fuzz FILE..." runs each input once (afl-fuzz ... -- ./ced-fuzz @@),
+    and "ced-fuzz -tSECONDS [SEED...]" runs random mutations of the seeds
+    for that long and reports execs/sec, keeping an input that crashes or
+    runs longer than FUZZ_HANG_SECONDS as ced-fuzz-crash.
+
+    The first input byte picks the target. Even: the rest up to a NUL byte
+    is loaded as the buffer, and each byte after it is a key from
+    fuzz_keys (editing, movement, selection and clipboard, multi-cursor,
+    folds, completion, macros, undo/redo); 0xFF instead starts a
+    replace-all whose old and new strings follow as length-prefixed bytes.
+    The buffer invariants are checked after every operation. Odd: the rest
+    is parsed as a highlight.syntax file, and the two keyword matching
+    strategies must agree on every position of a sample line.
+*/
+#ifdef CED_FUZZ
+static const int fuzz_keys[] = {
+    'a', 'b', 'z', '_', '(', ')', '{', '}', '[', ']', ' ', ';', '"', '0', 'x', 'y',
+    '\n', '\t', KEY_BACKSPACE, KEY_DC, KEY_LEFT, KEY_RIGHT, KEY_UP, KEY_DOWN,
+    KEY_HOME, KEY_END, KEY_PPAGE, KEY_NPAGE,
+    4 /* Ctrl+D */, 11 /* Ctrl+K */, 26 /* Ctrl+Z */, 25 /* Ctrl+Y */, 21 /* Ctrl+U */, 12 /* Ctrl+L */,
+    2 /* Ctrl+B */, 1 /* Ctrl+A */, 3 /* Ctrl+C */, 24 /* Ctrl+X */, 22 /* Ctrl+V */, 27 /* Esc */,
+    14 /* Ctrl+N */, 16 /* Ctrl+P */, 20 /* Ctrl+T */, KEY_F(2), KEY_F(3), KEY_F(4), KEY_F(5), KEY_F(6),
+};
+#define FUZZ_KEY_COUNT ((int)(sizeof(fuzz_keys) / sizeof(fuzz_keys[0])))
+#define FUZZ_REPLACE 0xFF
+#define FUZZ_HANG_SECONDS 5
+
+static void fuzz_check_buffer(void)
 {
-    char filename[PROMPT_BUFFER_SIZE];
-    char filepath[PROMPT_BUFFER_SIZE];
-    int i, r, c;
-    if (current_file[0])
+    int i;
+    if (editor.num_lines < 1 || editor.num_lines > MAX_LINES)
     {
-        strncpy(filename, current_file, PROMPT_BUFFER_SIZE);
+        abort();
     }
-    else
+    for (i = 0; i < MAX_LINES; i++)
     {
-        editor_prompt("Save as: ", filename, PROMPT_BUFFER_SIZE);
-        if (!filename[0])
+        if (!memchr(editor.text[i], '\0', MAX_COLS))
         {
-            return;
+            abort();
         }
     }
+    if (editor.cursor_y < 0 || editor.cursor_y >= editor.num_lines || editor.cursor_x < 0 ||
+        editor.cursor_x > (int)strlen(editor.text[editor.cursor_y]))
+    {
+        abort();
+    }
+}
 
-    /* If user typed no slash, assume "saves/filename" */
-    if (!strchr(filename, '/'))
+/* Back to an empty, unmodified editor, as if freshly started. */
+static void fuzz_reset(void)
+{
+    init_editor();
+    undo_drop_oldest(undo_stack, &undo_stack_top, undo_stack_top);
+    undo_drop_oldest(redo_stack, &redo_stack_top, redo_stack_top);
+    selection_mode = SELECTION_NONE;
+    clipboard_clear();
+    extra_cursor_count = 0;
+    fold_unfold_all();
+    macro_recording = 0;
+    macro_length = 0;
+    completion_cycling = 0;
+    dirty = 0;
+}
+
+/* Loads lines the way editor_load_stream does (long lines cut, at most MAX_LINES). */
+static size_t fuzz_load(const unsigned char *data, size_t size)
+{
+    size_t pos = 0;
+    int col = 0;
+    editor.num_lines = 1;
+    while (pos < size && data[pos] != '\0')
     {
-        struct stat stt;
-        if (stat("saves", &stt) == -1)
+        if (data[pos] == '\n')
         {
-            if (mkdir("saves", 0777) == -1)
+            if (editor.num_lines == MAX_LINES)
             {
-                getmaxyx(stdscr, r, c);
-                mvprintw(r - 1, 0, "Error creating 'saves' dir: %s", strerror(errno));
-                getch();
-                return;
+                break;
             }
+            editor.num_lines++;
+            col = 0;
         }
-        snprintf(filepath, PROMPT_BUFFER_SIZE, "saves/%s", filename);
-        strncpy(current_file, filepath, PROMPT_BUFFER_SIZE);
+        else if (col < MAX_COLS - 1)
+        {
+            editor.text[editor.num_lines - 1][col++] = (char)data[pos];
+        }
+        pos++;
     }
-    else
+    editor_buffer_replaced();
+    return pos + 1;
+}
+
+/* Takes a length-prefixed string from the input. */
+static size_t fuzz_string(const unsigned char *data, size_t size, char *out, size_t outsize)
+{
+    size_t len = size > 0 ? data[0] : 0;
+    if (len > size - (size > 0))
     {
-        /* user typed a path with slash => open from that path */
-        strncpy(current_file, filename, PROMPT_BUFFER_SIZE);
+        len = size - (size > 0);
+    }
+    if (len > outsize - 1)
+    {
+        len = outsize - 1;
     }
+    memcpy(out, data + 1, len);
+    out[len] = '\0';
+    return size > 0 ? (size_t)data[0] + 1 : 0;
+}
 
+static void fuzz_edit(const unsigned char *data, size_t size)
+{
+    size_t pos;
+    fuzz_reset();
+    pos = fuzz_load(data, size);
+    fuzz_check_buffer();
+    while (pos < size)
     {
-        FILE *fp = fopen(current_file, "w");
-        if (!fp)
+        if (data[pos] == FUZZ_REPLACE)
         {
-            getmaxyx(stdscr, r, c);
-            mvprintw(r - 1, 0, "Error opening file: %s", strerror(errno));
-            clrtoeol();
-            getch();
-            return;
+            char oldstr[PROMPT_BUFFER_SIZE], newstr[PROMPT_BUFFER_SIZE];
+            pos++;
+            pos += fuzz_string(data + pos, pos < size ? size - pos : 0, oldstr, sizeof(oldstr));
+            pos += fuzz_string(data + pos, pos < size ? size - pos : 0, newstr, sizeof(newstr));
+            save_state_undo();
+            editor_replace_all_with(oldstr, newstr);
         }
-        for (i = 0; i < editor.num_lines; i++)
+        else
         {
-            fprintf(fp, "%s\n", editor.text[i]);
+            editor_process_key(fuzz_keys[data[pos] % FUZZ_KEY_COUNT]);
+            pos++;
         }
-        fclose(fp);
-        dirty = 0;
-        getmaxyx(stdscr, r, c);
-        mvprintw(r - 1, 0, "File saved as %s. Press any key...", current_file);
-        clrtoeol();
-        getch();
+        fuzz_check_buffer();
     }
 }
 
-/* ---------- Load File ---------- */
-void editor_load_file(void)
+static void fuzz_syntax(const unsigned char *data, size_t size)
 {
-    char filename[PROMPT_BUFFER_SIZE];
-    char filepath[PROMPT_BUFFER_SIZE];
-    char line_buffer[MAX_COLS];
-    int i, r, c;
-    editor_prompt("Open file: ", filename, PROMPT_BUFFER_SIZE);
-    if (!filename[0])
+    static const char sample[] = "int main(void) { if (x) return sizeof(long); mov eax, ebx; .data do_while }";
+    SH_SyntaxDefinitions defs;
+    FILE *fp;
+    int i, j;
+    if (size == 0 || (fp = fmemopen((void *)data, size, "r")) == NULL)
     {
         return;
     }
-
-    /* If user typed no slash, assume "saves/filename" */
-    if (!strchr(filename, '/'))
-    {
-        snprintf(filepath, PROMPT_BUFFER_SIZE, "saves/%s", filename);
-    }
-    else
+    defs = sh_parse_syntax_stream(fp);
+    fclose(fp);
+    syntax_enabled = 1;
+    for (i = 0; i < defs.count; i++)
     {
-        strncpy(filepath, filename, PROMPT_BUFFER_SIZE);
+        build_token_lookup(&defs.definitions[i]);
+        for (j = 0; sample[j]; j++)
+        {
+            if (token_match_linear(sample, j, (int)strlen(sample)) !=
+                token_match_indexed(sample, j, (int)strlen(sample)))
+            {
+                abort();
+            }
+        }
+        free(token_lookup);
+        token_lookup = NULL;
+        token_lookup_count = 0;
     }
+    syntax_enabled = 0;
+    sh_free_syntax_definitions(defs);
+}
 
-    FILE *fp = fopen(filepath, "r");
-    if (!fp)
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+    if (size == 0)
     {
-        getmaxyx(stdscr, r, c);
-        mvprintw(r - 1, 0, "Error opening: %s", strerror(errno));
-        clrtoeol();
-        getch();
-        return;
+        return 0;
     }
-    memset(editor.text, 0, sizeof(editor.text));
-    editor.num_lines = 0;
-    while (fgets(line_buffer, MAX_COLS, fp) && editor.num_lines < MAX_LINES)
+    if (data[0] & 1)
     {
-        size_t ln = strlen(line_buffer);
-        if (ln > 0 && line_buffer[ln - 1] == '\n')
-        {
-            line_buffer[ln - 1] = '\0';
-        }
-        strncpy(editor.text[editor.num_lines], line_buffer, MAX_COLS - 1);
-        editor.num_lines++;
+        fuzz_syntax(data + 1, size - 1);
     }
-    fclose(fp);
-
-    /* Ensure there is at least one line */
-    if (editor.num_lines == 0)
+    else
     {
-        editor.num_lines = 1;
-        editor.text[0][0] = '\0';
+        fuzz_edit(data + 1, size - 1);
     }
+    return 0;
+}
 
-    /* Reset viewport and cursor */
-    editor.cursor_x = 0;
-    editor.cursor_y = 0;
-    editor.row_offset = 0;
-    editor.col_offset = 0;
-
-    strncpy(current_file, filepath, PROMPT_BUFFER_SIZE);
-    dirty = 0;
-    syntax_enabled = 0;
+#ifdef CED_FUZZ_MAIN
+static const unsigned char *fuzz_current;
+static size_t fuzz_current_size;
 
-    /* Initialize syntax highlighting if applicable */
-    for (i = 0; i < global_syntax_defs.count; i++)
+/* Keeps the failing (or hanging) input of a throughput run as ced-fuzz-crash. */
+static void fuzz_crash_handler(int sig)
+{
+    int fd = open("ced-fuzz-crash", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0)
     {
-        if (sh_file_has_extension(current_file, global_syntax_defs.definitions[i]))
+        if (write(fd, fuzz_current, fuzz_current_size) < 0)
         {
-            selected_syntax = &global_syntax_defs.definitions[i];
-            syntax_enabled = 1;
-            if (selected_syntax->rule_count > 0)
-            {
-                if (token_lookup)
-                {
-                    free(token_lookup);
-                    token_lookup = NULL;
-                    token_lookup_count = 0;
-                }
-                sh_init_syntax_colors(selected_syntax);
-                build_token_lookup(selected_syntax);
-            }
-            break;
+            /* Nothing more to do in a dying process. */
         }
+        close(fd);
     }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
 
-    getmaxyx(stdscr, r, c);
-    mvprintw(r - 1, 0, "File loaded from %s. Press any key...", current_file);
-    clrtoeol();
-    getch();
-
-    editor_mark_all_lines_dirty();
+static unsigned char *fuzz_read_file(const char *path, size_t *size)
+{
+    unsigned char *data = NULL;
+    size_t cap = 0;
+    FILE *fp = fopen(path, "rb");
+    *size = 0;
+    if (!fp)
+    {
+        fprintf(stderr, "ced-fuzz: cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    do
+    {
+        cap = cap ? cap * 2 : 4096;
+        data = (unsigned char *)realloc(data, cap);
+        *size += fread(data + *size, 1, cap - *size, fp);
+    } while (*size == cap);
+    fclose(fp);
+    return data;
 }
 
-/* ---------- Process Key & Mouse ---------- */
-void process_keypress(void)
+int main(int argc, char **argv)
 {
-    int ch = getch();
-    if (ch == KEY_MOUSE)
+    unsigned char input[4096];
+    long seconds = 0;
+    long runs = 0, start, deadline;
+    int i;
+    if (argc > 1 && !strncmp(argv[1], "-t", 2))
     {
-        MEVENT event;
-        if (getmouse(&event) == OK)
+        seconds = atol(argv[1] + 2);
+        argc--;
+        argv++;
+    }
+    if (seconds <= 0)
+    {
+        /* Each file once: regression runs and AFL's @@. */
+        for (i = 1; i < argc; i++)
         {
-            if (event.bstate & BUTTON1_CLICKED)
-            {
-                int new_y = event.y + editor.row_offset;
-                int new_x = new_y >= 0 && new_y < editor.num_lines
-                            ? (event.x - (show_line_numbers ? LINE_NUMBER_WIDTH : 0) + editor.col_offset)
-                            : 0;
-                if (new_y >= editor.num_lines)
-                {
-                    new_y = editor.num_lines - 1;
-                }
-                if (new_y < 0)
-                {
-                    new_y = 0;
-                }
-                {
-                    int ll = (int)strlen(editor.text[new_y]);
-                    if (new_x < 0)
-                    {
-                        new_x = 0;
-                    }
-                    if (new_x > ll)
-                    {
-                        new_x = ll;
-                    }
-                }
-                editor.cursor_y = new_y;
-                editor.cursor_x = new_x;
-                editor_mark_all_lines_dirty();
-            }
-            else if (event.bstate & BUTTON4_PRESSED)
-            {
-                editor.cursor_y -= 3;
-                if (editor.cursor_y < 0)
-                {
-                    editor.cursor_y = 0;
-                }
-                editor_mark_all_lines_dirty();
-            }
-            else if (event.bstate & BUTTON5_PRESSED)
+            size_t size;
+            unsigned char *data = fuzz_read_file(argv[i], &size);
+            if (data)
             {
-                editor.cursor_y += 3;
-                if (editor.cursor_y >= editor.num_lines)
-                {
-                    editor.cursor_y = editor.num_lines - 1;
-                }
-                editor_mark_all_lines_dirty();
+                LLVMFuzzerTestOneInput(data, size);
+                free(data);
             }
         }
-        return;
+        return 0;
     }
-
-    switch (ch)
+    /* Throughput: random byte flips, inserts and truncations of the seeds (or of nothing). */
+    fuzz_current = input;
+    signal(SIGABRT, fuzz_crash_handler);
+    signal(SIGSEGV, fuzz_crash_handler);
+    signal(SIGALRM, fuzz_crash_handler);
+    start = monotonic_ms();
+    deadline = start + seconds * 1000L;
+    while (monotonic_ms() < deadline)
     {
-        case 8: /* Ctrl+H: toggle help */
-            show_help = !show_help;
-            editor_mark_all_lines_dirty();
-            break;
-        case 23: /* Ctrl+W: shell panel toggle */
-            shell_panel_toggle();
-            break;
-        case 5: /* Ctrl+E: run command in shell panel */
-            shell_panel_run_command();
-            break;
-        case 6: /* Ctrl+F: search */
-            editor_search();
-            break;
-        case 18: /* Ctrl+R: replace */
-            editor_replace_all();
-            editor_mark_all_lines_dirty();
-            break;
-        case 7: /* Ctrl+G: goto line */
-            editor_goto_line();
-            break;
-        case 17: /* Ctrl+Q: quit */
-            endwin();
-            exit(0);
-            break;
-        case 26: /* Ctrl+Z: undo */
-            undo();
-            break;
-        case 25: /* Ctrl+Y: redo */
-            redo();
-            break;
-        case 19: /* Ctrl+S: save */
-            editor_save_file();
-            break;
-        case 15: /* Ctrl+O: open */
-            editor_load_file();
-            break;
-        case 4: /* Ctrl+D: Duplicate line */
-            editor_duplicate_line();
-            break;
-        case 11: /* Ctrl+K: Kill line */
-            editor_kill_line();
-            break;
-        case 20: /* Ctrl+T: Toggle line numbers */
-            editor_toggle_line_numbers();
-            break;
-        case 21: /* Ctrl+U: goto top */
-            editor_goto_top();
-            break;
-        case 12: /* Ctrl+L: goto bottom */
-            editor_goto_bottom();
-            break;
-        case KEY_HOME:
-            editor.cursor_x = 0;
-            editor_mark_line_dirty(editor.cursor_y);
-            break;
-        case KEY_END:
-        {
-            int ln = (int)strlen(editor.text[editor.cursor_y]);
-            editor.cursor_x = ln;
-            editor_mark_line_dirty(editor.cursor_y);
-            break;
-        }
-        case KEY_PPAGE:
-            editor.cursor_y -= 5;
-            if (editor.cursor_y < 0)
-            {
-                editor.cursor_y = 0;
-            }
-            editor_mark_all_lines_dirty();
-            break;
-        case KEY_NPAGE:
-            editor.cursor_y += 5;
-            if (editor.cursor_y >= editor.num_lines)
-            {
-                editor.cursor_y = editor.num_lines - 1;
-            }
-            editor_mark_all_lines_dirty();
-            break;
-        case '\t':
+        size_t size = 0;
+        int k, edits = 1 + bench_rand(16);
+        if (argc > 1)
         {
-            int i;
-            save_state_undo();
-            if (config.tab_four_spaces)
+            unsigned char *seed = fuzz_read_file(argv[1 + bench_rand(argc - 1)], &size);
+            if (size > sizeof(input))
             {
-                for (i = 0; i < 4; i++)
-                {
-                    editor_insert_char(' ');
-                }
+                size = sizeof(input);
             }
-            else
+            if (seed)
             {
-                editor_insert_char('\t');
+                memcpy(input, seed, size);
+                free(seed);
             }
-            break;
         }
-        case KEY_LEFT:
-            if (editor.cursor_x > 0)
-            {
-                editor.cursor_x--;
-                editor_mark_line_dirty(editor.cursor_y);
-            }
-            else if (editor.cursor_y > 0)
-            {
-                editor.cursor_y--;
-                editor.cursor_x = (int)strlen(editor.text[editor.cursor_y]);
-                editor_mark_all_lines_dirty();
-            }
-            break;
-        case KEY_RIGHT:
+        for (k = 0; k < edits; k++)
         {
-            int length = (int)strlen(editor.text[editor.cursor_y]);
-            if (editor.cursor_x < length)
-            {
-                editor.cursor_x++;
-                editor_mark_line_dirty(editor.cursor_y);
-            }
-            else if (editor.cursor_y < editor.num_lines - 1)
-            {
-                editor.cursor_y++;
-                editor.cursor_x = 0;
-                editor_mark_all_lines_dirty();
-            }
-            break;
-        }
-        case KEY_UP:
-            if (editor.cursor_y > 0)
+            int op = bench_rand(3);
+            if (op == 0 && size > 0)
             {
-                editor.cursor_y--;
-                {
-                    int ll = (int)strlen(editor.text[editor.cursor_y]);
-                    if (editor.cursor_x > ll)
-                    {
-                        editor.cursor_x = ll;
-                    }
-                }
-                editor_mark_all_lines_dirty();
+                input[bench_rand((int)size)] = (unsigned char)bench_rand(256);
             }
-            break;
-        case KEY_DOWN:
-            if (editor.cursor_y < editor.num_lines - 1)
+            else if (op == 1 && size < sizeof(input))
             {
-                editor.cursor_y++;
-                {
-                    int ll = (int)strlen(editor.text[editor.cursor_y]);
-                    if (editor.cursor_x > ll)
-                    {
-                        editor.cursor_x = ll;
-                    }
-                }
-                editor_mark_all_lines_dirty();
+                size_t at = size > 0 ? (size_t)bench_rand((int)size + 1) : 0;
+                memmove(input + at + 1, input + at, size - at);
+                input[at] = (unsigned char)bench_rand(256);
+                size++;
             }
-            break;
-        case KEY_BACKSPACE:
-        case 127:
-            save_state_undo();
-            editor_delete_char();
-            break;
-        case KEY_DC:
-            save_state_undo();
-            editor_delete_at_cursor();
-            break;
-        case '\n':
-        case '\r':
-            save_state_undo();
-            editor_insert_newline();
-            break;
-        default:
-            /* Printable ASCII? Insert it. */
-            if (ch >= 32 && ch <= 126)
+            else if (size > 0)
             {
-                save_state_undo();
-                editor_insert_char(ch);
+                size = (size_t)bench_rand((int)size + 1);
             }
-            break;
+        }
+        fuzz_current_size = size;
+        alarm(FUZZ_HANG_SECONDS);
+        LLVMFuzzerTestOneInput(input, size);
+        runs++;
     }
+    printf("%ld execs in %ld s (%.0f execs/sec)\n", runs, seconds, runs / ((monotonic_ms() - start) / 1e3));
+    return 0;
 }
+#endif
+#endif
 
 /* ---------- Main ---------- */
-int main(void)
+/* Runs the interactive editor on the terminal; 'src' (if not NULL) supplies the file contents. */
+static int editor_interactive(const char *path, FILE *src)
 {
-    load_config();
-    global_syntax_defs = sh_load_syntax_definitions("highlight.syntax");
     initscr();
     start_color();
     use_default_colors();
@@ -1625,11 +8402,48 @@ int main(void)
     curs_set(1);
     mousemask(ALL_MOUSE_EVENTS, NULL);
     mouseinterval(0);
+    set_escdelay(25);
+    getmaxyx(stdscr, screen_rows, screen_cols);
+    if (vt_backend)
+    {
+        /* ncurses' first refresh clears the screen; get it out of the way before our first frame. */
+        refresh();
+    }
+    timeout(0);
     init_editor();
+    event_init();
+    tags_prepare();
+    session_map();
+    if (!path && !src)
+    {
+        /* No file named: pick up where the last session in this directory left off. */
+        path = session_resume();
+    }
+    if (path)
+    {
+        if (src)
+        {
+            editor_load_stream(src, path);
+            editor_select_syntax();
+        }
+        else if (editor_open_path(path) == 0)
+        {
+            editor_select_syntax();
+        }
+    }
+#ifdef CED_REPLAY
+    if (trace_out)
+    {
+        trace_record_header();
+    }
+#endif
 
     while (1)
     {
-        editor_refresh_screen();
+        if (!render_schedule())
+        {
+            event_wait();
+        }
         process_keypress();
     }
 
@@ -1637,3 +8451,54 @@ int main(void)
     endwin();
     return 0;
 }
+
+#ifndef CED_FUZZ
+int main(int argc, char **argv)
+{
+    prof_init();
+    if (argc > 1 && !strcmp(argv[1], "--batch"))
+    {
+        return batch_main(argc - 2, argv + 2);
+    }
+    if (argc > 1 && !strcmp(argv[1], "--client"))
+    {
+        return client_main(argc > 2 ? argv[2] : NULL);
+    }
+    load_config();
+    global_syntax_defs = sh_load_syntax_definitions("highlight.syntax");
+    if (argc > 1 && !strcmp(argv[1], "--daemon"))
+    {
+        return daemon_main(argc - 2, argv + 2);
+    }
+#ifdef CED_BENCH
+    if (argc > 1 && !strcmp(argv[1], "--bench"))
+    {
+        return bench_main(argc - 2, argv + 2);
+    }
+#endif
+#ifdef CED_REPLAY
+    if (argc > 1 && !strcmp(argv[1], "--replay"))
+    {
+        return replay_main(argc - 2, argv + 2);
+    }
+    if (argc > 2 && !strcmp(argv[1], "--record"))
+    {
+        trace_out = fopen(argv[2], "w");
+        if (!trace_out)
+        {
+            fprintf(stderr, "ced: cannot write trace %s: %s\n", argv[2], strerror(errno));
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+#endif
+    if (argc > 1 && !strcmp(argv[1], "--vt"))
+    {
+        vt_backend = 1;
+        argc--;
+        argv++;
+    }
+    return editor_interactive(argc > 1 ? argv[1] : NULL, NULL);
+}
+#endif
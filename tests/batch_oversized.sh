@@ -0,0 +1,39 @@
+#!/bin/sh
+# Batch mode must refuse, not truncate, files it cannot hold whole.
+# Usage: tests/batch_oversized.sh [path/to/ced]
+CED=${1:-./ced}
+CED=$(cd "$(dirname "$CED")" && pwd)/$(basename "$CED")
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+fail=0
+
+printf 'replace /a/b/\nsave\n' > script
+awk 'BEGIN { for (i = 0; i < 1500; i++) print "a" i }' > many_lines.txt
+awk 'BEGIN { s = ""; for (i = 0; i < 2000; i++) s = s "a"; print s }' > long_line.txt
+awk 'BEGIN { s = ""; for (i = 0; i < 1023; i++) s = s "a"; print s; print "a" }' > fits.txt
+cp many_lines.txt many_lines.orig
+cp long_line.txt long_line.orig
+
+for f in many_lines long_line; do
+    if "$CED" --batch -j1 script $f.txt 2>/dev/null; then
+        echo "FAIL: $f.txt: expected a non-zero exit status"
+        fail=1
+    fi
+    if ! cmp -s $f.txt $f.orig; then
+        echo "FAIL: $f.txt was modified"
+        fail=1
+    fi
+done
+
+# A line of exactly MAX_COLS - 1 characters still fits.
+if ! "$CED" --batch -j1 script fits.txt; then
+    echo "FAIL: fits.txt: expected success"
+    fail=1
+elif [ "$(wc -l < fits.txt)" -ne 2 ] || grep -q a fits.txt; then
+    echo "FAIL: fits.txt: wrong content after replace"
+    fail=1
+fi
+
+[ $fail -eq 0 ] && echo "ok"
+exit $fail